@@ -0,0 +1,82 @@
+// Read the raw pin log (RAW_CAPTURE in src/capture.h) from the pad's
+// vendor interface and write it out as a trace file.
+//
+// Usage: capture_dump /dev/hidrawN > unit42.trace
+//
+// Runs until interrupted.  The trace format is described in README.md
+// under "Raw input capture".
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define REPORT_SIZE 64
+#define CAPTURE_REPORT_ID 3
+
+int main(int argc, char **argv)
+{
+    uint8_t report[REPORT_SIZE];
+    uint8_t expected_sequence = 0;
+    int have_sequence = 0, have_tick = 0;
+    uint16_t last_tick = 0;
+    uint32_t tick = 0;
+    ssize_t len;
+    int fd;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s /dev/hidrawN\n", argv[0]);
+        return 2;
+    }
+    fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    printf("# volumepad trace\n");
+    fflush(stdout);
+
+    while ((len = read(fd, report, sizeof(report))) > 0) {
+        uint8_t count, i;
+
+        if (len < 6 || report[0] != CAPTURE_REPORT_ID) {
+            continue;
+        }
+        if (!have_sequence) {
+            printf("ticks_per_second %u\n", report[4] | (report[5] << 8));
+            have_sequence = 1;
+        } else if (report[1] != expected_sequence) {
+            printf("# lost %u reports\n", (uint8_t)(report[1] - expected_sequence));
+        }
+        expected_sequence = report[1] + 1;
+        if (report[3]) {
+            printf("# lost %u records\n", report[3]);
+        }
+
+        count = report[2];
+        for (i = 0; i < count && 6 + (i + 1) * 3 <= len; i++) {
+            uint8_t *r = report + 6 + i * 3;
+            uint16_t t = r[0] | (r[1] << 8);
+
+            // The device's tick counter is 16 bits; it records the pins
+            // at least every 0x8000 ticks, so unwrapping is unambiguous.
+            if (!have_tick) {
+                tick = t;
+                have_tick = 1;
+            } else {
+                tick += (uint16_t)(t - last_tick);
+            }
+            last_tick = t;
+            printf("%u %02x\n", tick, r[2]);
+        }
+        fflush(stdout);
+    }
+    if (len < 0) {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    return 0;
+}
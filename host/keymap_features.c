@@ -0,0 +1,77 @@
+// Work out what the keymap (src/keymap.h) uses, and write it out as
+// src/keymap_features.h, so the firmware can compile out the rest.
+// Both Makefiles run this whenever keymap.h changes.
+//
+// Usage: keymap_features > keymap_features.h
+//
+// Everything is worked out from the keymap itself, by building it
+// here and looking through the arrays:
+//
+//   KEYMAP_KEYBOARD              any keyboard (not media) key, or any
+//                                text, which is typed on the keyboard
+//   KEYMAP_TEXT                  any switch that types text
+//   KEYMAP_SWITCHES              mask of switches with any action
+//   KEYMAP_LONG_PRESS_SWITCHES   mask of switches with long-press keys
+//
+// and USB_KEYBOARD_INTERFACE with KEYMAP_KEYBOARD, for the firmware's
+// USB code and for uhid_pad, which has to offer the same devices.
+
+#include <stdio.h>
+
+#include "keymap.h"
+
+static int has_keyboard_keys(uint16_t const *keys)
+{
+    for (; keys && *keys; keys++) {
+        if (!(*keys & MediaKey(0))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(void)
+{
+    int keyboard = has_keyboard_keys(DialCWKeys) || has_keyboard_keys(DialCCWKeys);
+    int text = 0;
+    unsigned switches = 0, long_press = 0;
+
+    // Every build of the firmware has the same rate limits.
+    (void)RateLimits;
+
+    for (int i = 0; i < 7; i++) {
+        SwitchAction const *action = &SwitchActionMap[i];
+
+        if (action->press_keys || action->long_press_keys || action->text) {
+            switches |= 1 << i;
+        }
+        if (action->long_press_keys) {
+            long_press |= 1 << i;
+        }
+        if (action->text) {
+            text = 1;
+        }
+        keyboard |= has_keyboard_keys(action->press_keys) || has_keyboard_keys(action->long_press_keys);
+    }
+    keyboard |= text;
+
+    printf("// Generated from keymap.h by host/keymap_features; don't edit.\n"
+           "\n"
+           "#ifndef keymap_features_h__\n"
+           "#define keymap_features_h__\n"
+           "\n"
+           "#define KEYMAP_KEYBOARD %d\n"
+           "#define KEYMAP_TEXT %d\n"
+           "#define KEYMAP_SWITCHES 0x%02x\n"
+           "#define KEYMAP_LONG_PRESS_SWITCHES 0x%02x\n"
+           "\n"
+           "// The keyboard interface is only there if the keymap has keyboard\n"
+           "// keys or text.\n"
+           "#if KEYMAP_KEYBOARD\n"
+           "#define USB_KEYBOARD_INTERFACE\n"
+           "#endif\n"
+           "\n"
+           "#endif\n",
+           keyboard, text, switches, long_press);
+    return 0;
+}
@@ -0,0 +1,185 @@
+// Running the firmware's input and keymap code; see pad.h.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usb_keyboard.h"
+#include "input.h"
+#include "actions.h"
+#include "keymap_features.h"
+#include "pad.h"
+#include "sampler.h"
+
+// Pins read as released, as IGNORED_PINS in main.c: switches with
+// nothing in the keymap, and the dial when it's sampled separately.
+#define IGNORED_SWITCHES (0x7f & ~KEYMAP_SWITCHES & ~DIAL_PINS)
+
+// The key state actions.c fills in, as in usb_keyboard.c.
+volatile uint8_t keyboard_modifier_keys = 0;
+volatile uint8_t keyboard_keys[6] = {0, 0, 0, 0, 0, 0};
+volatile uint16_t media_keys[4] = {0, 0, 0, 0};
+volatile uint8_t keyboard_leds = 0;
+
+// KEYBOARD_INTERVAL and MEDIA_INTERVAL
+const double pad_interval[PAD_DEVICES] = { 0.001, 0.008 };
+
+// USB_IN_QUEUE_DEPTH
+#define PAD_QUEUE_DEPTH 8
+
+unsigned long pad_overwritten[PAD_DEVICES];
+
+static PadReport *reports;
+static size_t report_count, report_capacity;
+static double current_time;
+static double last_poll[PAD_DEVICES];
+// Each device's newest report (in reports), or -1, and its contents.
+static long newest[PAD_DEVICES];
+static uint8_t last_data[PAD_DEVICES][PAD_REPORT_SIZE];
+
+// Reports the host hasn't taken yet from a device's queue, not
+// counting the one in the endpoint bank, as report_queue.count in
+// usb_keyboard.c.  Those are the reports whose poll hasn't come, less
+// the first of them, which is in the bank.
+static unsigned queued(int device)
+{
+    unsigned waiting = 0;
+
+    // A device's polls only go forward, so its reports are in order.
+    for (long i = newest[device]; i >= 0 && waiting <= PAD_QUEUE_DEPTH; i--) {
+        if (reports[i].device != device) {
+            continue;
+        }
+        if (reports[i].time <= current_time) {
+            break;
+        }
+        waiting++;
+    }
+    return waiting ? waiting - 1 : 0;
+}
+
+// Queue a report as queue_report() in usb_keyboard.c does: one the same
+// as the last is skipped, and when the queue is full the newest report
+// is replaced.
+static void add_report(int device, const uint8_t *data)
+{
+    double interval = pad_interval[device];
+    double poll = ceil(current_time / interval - 1e-9) * interval;
+    PadReport *r;
+
+    if (!memcmp(data, last_data[device], PAD_REPORT_SIZE)) {
+        return;
+    }
+    memcpy(last_data[device], data, PAD_REPORT_SIZE);
+    if (newest[device] >= 0 && queued(device) == PAD_QUEUE_DEPTH) {
+        r = &reports[newest[device]];
+        r->tick = current_time;
+        memcpy(r->data, data, PAD_REPORT_SIZE);
+        pad_overwritten[device]++;
+        return;
+    }
+    if (poll <= last_poll[device]) {
+        poll = last_poll[device] + interval;
+    }
+    last_poll[device] = poll;
+    if (report_count == report_capacity) {
+        report_capacity = report_capacity ? report_capacity * 2 : 256;
+        reports = realloc(reports, report_capacity * sizeof(PadReport));
+        if (!reports) {
+            fprintf(stderr, "out of memory\n");
+            exit(2);
+        }
+    }
+    newest[device] = report_count;
+    r = &reports[report_count++];
+    r->device = device;
+    r->time = poll;
+    r->tick = current_time;
+    memcpy(r->data, data, PAD_REPORT_SIZE);
+}
+
+// The reports are laid out as copy_key_data and copy_media_key_data
+// in usb_keyboard.c do.
+int8_t usb_keyboard_send(void)
+{
+    uint8_t data[PAD_REPORT_SIZE];
+
+    data[0] = keyboard_modifier_keys;
+    data[1] = 0;
+    for (int i = 0; i < 6; i++) {
+        data[2 + i] = keyboard_keys[i];
+    }
+    add_report(PadKeyboard, data);
+    return 0;
+}
+
+uint8_t usb_keyboard_queue_space(void)
+{
+    return PAD_QUEUE_DEPTH - queued(PadKeyboard);
+}
+
+int8_t usb_media_send(void)
+{
+    uint8_t data[PAD_REPORT_SIZE];
+
+    for (int i = 0; i < 4; i++) {
+        data[2 * i] = media_keys[i] & 0xff;
+        data[2 * i + 1] = media_keys[i] >> 8;
+    }
+    add_report(PadMedia, data);
+    return 0;
+}
+
+#ifdef USB_ABSOLUTE_VOLUME
+// There's no host companion here, so the dial sends keys.
+int8_t usb_volume_adjust(int8_t steps)
+{
+    (void)steps;
+    return -1;
+}
+#endif
+
+void input_event(uint8_t type, uint8_t value, uint16_t tick)
+{
+    (void)type;
+    (void)value;
+    (void)tick;
+}
+
+size_t pad_run(const PinLog *log, double tick_period, double dial_period, PadReport **out)
+{
+    unsigned long tick, ticks = (unsigned long)(log->end / tick_period);
+    DialSampler dial;
+
+    reports = NULL;
+    report_count = report_capacity = 0;
+    for (int i = 0; i < PAD_DEVICES; i++) {
+        last_poll[i] = -1;
+        newest[i] = -1;
+        pad_overwritten[i] = 0;
+        memset(last_data[i], 0, PAD_REPORT_SIZE);
+    }
+
+    // The tick interrupt first fires one period after the timer
+    // starts.
+    input_init(actions_tap_hold_switches(), actions_long_press_switches(), pinlog_pins_at(log, 0));
+    actions_init();
+    sampler_init(&dial, log, dial_period);
+    for (tick = 1; tick <= ticks; tick++) {
+        current_time = tick * tick_period;
+        if (dial_period > 0) {
+            // The dial pins were sampled already.
+            int8_t detents = sampler_run(&dial, log, current_time);
+
+            input_update(pinlog_pins_at(log, current_time) | IGNORED_SWITCHES | DIAL_PINS,
+                         (uint16_t)tick);
+            input_add_detents(detents, (uint16_t)tick);
+        } else {
+            input_update(pinlog_pins_at(log, current_time) | IGNORED_SWITCHES, (uint16_t)tick);
+        }
+        actions_run((uint16_t)tick);
+    }
+    *out = reports;
+    return report_count;
+}
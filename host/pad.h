@@ -0,0 +1,45 @@
+// The firmware's input and keymap code (src/input.c and src/actions.c)
+// run over a pin capture, collecting the keyboard and media reports it
+// sends.  This is kept apart from the tools that use it because the
+// firmware's key names clash with the Linux input headers.
+
+#ifndef pad_h__
+#define pad_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pinlog.h"
+
+// The two HID interfaces, in the order of their report descriptors in
+// usb_report_desc.h.
+enum { PadKeyboard, PadMedia, PAD_DEVICES };
+
+#define PAD_REPORT_SIZE 8
+
+typedef struct {
+    int device;			// PadKeyboard or PadMedia
+    double time;		// when the host collects it
+    double tick;		// the tick that sent it
+    uint8_t data[PAD_REPORT_SIZE];
+} PadReport;
+
+// Polling interval (bInterval, in seconds) of each interface's endpoint
+// in usb_keyboard.c.  A report goes out on the first poll after the
+// tick that sent it, and at most one goes out per poll.
+extern const double pad_interval[PAD_DEVICES];
+
+// Reports each device lost from pad_run()'s last run because its queue
+// was full: as on the pad, which holds USB_IN_QUEUE_DEPTH reports
+// besides the one in the endpoint bank, the newest queued report is
+// replaced by the next one.
+extern unsigned long pad_overwritten[PAD_DEVICES];
+
+// Sample the capture once per tick of tick_period seconds and run the
+// firmware's code on it, with the current tuning (see tuning.h), as
+// run() in main.c does.  A dial_period above 0 samples the dial pins
+// separately, as DIAL_FAST_SAMPLING does (see sampler.h).  Returns the
+// number of reports, in *reports, which the caller frees.
+size_t pad_run(const PinLog *log, double tick_period, double dial_period, PadReport **reports);
+
+#endif
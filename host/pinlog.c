@@ -0,0 +1,366 @@
+// Reading pin captures; see pinlog.h.
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "pinlog.h"
+
+// Add the pins at a time, if they changed.
+static int add_change(PinLog *log, size_t *capacity, double time, uint8_t pins)
+{
+    if (log->count && log->changes[log->count - 1].pins == pins) {
+        return 0;
+    }
+    if (log->count && log->changes[log->count - 1].time >= time) {
+        // Several changes at the same time: only the last one counts.
+        log->count--;
+        if (log->count && log->changes[log->count - 1].pins == pins) {
+            return 0;
+        }
+    }
+    if (log->count == *capacity) {
+        PinChange *changes;
+
+        *capacity = *capacity ? *capacity * 2 : 256;
+        changes = realloc(log->changes, *capacity * sizeof(PinChange));
+        if (!changes) {
+            return -1;
+        }
+        log->changes = changes;
+    }
+    log->changes[log->count].time = time;
+    log->changes[log->count].pins = pins;
+    log->count++;
+    return 0;
+}
+
+// Which PB pin a channel name is, or -1.
+static int pin_for_name(const char *const names[7], const char *name)
+{
+    for (int i = 0; i < 7; i++) {
+        if (!strcasecmp(names[i], name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static uint8_t set_pin(uint8_t pins, int pin, int high)
+{
+    return high ? (pins | (1 << pin)) : (pins & ~(1 << pin));
+}
+
+// A trace from capture_dump: "ticks_per_second N", then "<tick> <pins
+// in hex>" lines.
+static int read_trace(FILE *f, const char *path, PinLog *log)
+{
+    char line[256];
+    size_t capacity = 0;
+    unsigned lineno = 0;
+    unsigned long rate = 0, tick = 0, last_tick = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long pins;
+
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (sscanf(line, "ticks_per_second %lu", &rate) == 1) {
+            continue;
+        }
+        if (sscanf(line, "%lu %lx", &tick, &pins) != 2 || pins > 0x7f || !rate) {
+            fprintf(stderr, "%s:%u: bad line\n", path, lineno);
+            return -1;
+        }
+        if (tick < last_tick) {
+            fprintf(stderr, "%s:%u: tick goes backwards\n", path, lineno);
+            return -1;
+        }
+        if (!log->count && tick) {
+            add_change(log, &capacity, 0, 0x7f);
+        }
+        last_tick = tick;
+        if (add_change(log, &capacity, (double)tick / rate, pins)) {
+            fprintf(stderr, "%s: out of memory\n", path);
+            return -1;
+        }
+    }
+    log->end = rate ? (double)last_tick / rate : 0;
+    return 0;
+}
+
+// Split a CSV line in place.  Returns the number of fields.
+static int split_csv(char *line, char **fields, int max)
+{
+    int n = 0;
+
+    line[strcspn(line, "\r\n")] = 0;
+    while (n < max) {
+        while (isspace((unsigned char)*line)) line++;
+        fields[n++] = line;
+        line = strchr(line, ',');
+        if (!line) break;
+        *line++ = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        char *e = fields[i] + strlen(fields[i]);
+        while (e > fields[i] && isspace((unsigned char)e[-1])) *--e = 0;
+    }
+    return n;
+}
+
+// "Samplerate: 1 MHz" in a sigrok comment
+static double parse_samplerate(const char *text)
+{
+    double rate;
+    char unit[8] = "";
+
+    if (sscanf(text, "%lf %7s", &rate, unit) < 1) {
+        return 0;
+    }
+    if (!strncasecmp(unit, "k", 1)) rate *= 1e3;
+    else if (!strncmp(unit, "M", 1)) rate *= 1e6;
+    else if (!strncasecmp(unit, "G", 1)) rate *= 1e9;
+    return rate;
+}
+
+#define CSV_MAX_FIELDS 64
+
+static int read_csv(FILE *f, const char *path, const char *const names[7], double samplerate, PinLog *log)
+{
+    char line[1024], *fields[CSV_MAX_FIELDS];
+    int column_pin[CSV_MAX_FIELDS];
+    int time_column = -1, have_header = 0, n, i;
+    size_t capacity = 0;
+    unsigned long row = 0;
+    unsigned lineno = 0;
+    double time = 0;
+
+    for (i = 0; i < CSV_MAX_FIELDS; i++) {
+        column_pin[i] = i < 7 ? i : -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        uint8_t pins = 0x7f;
+        char *p;
+
+        lineno++;
+        if (line[0] == ';' || line[0] == '#') {
+            p = strstr(line, "Samplerate:");
+            if (p && !samplerate) {
+                samplerate = parse_samplerate(p + 11);
+            }
+            continue;
+        }
+        n = split_csv(line, fields, CSV_MAX_FIELDS);
+        if (n == 1 && !fields[0][0]) {
+            continue;
+        }
+        if (!have_header && !isdigit((unsigned char)fields[0][0]) && fields[0][0] != '.') {
+            // The header row: find the time column and the pins.
+            int found = 0;
+            for (i = 0; i < n; i++) {
+                column_pin[i] = pin_for_name(names, fields[i]);
+                found += column_pin[i] >= 0;
+                if (!strncasecmp(fields[i], "time", 4)) {
+                    time_column = i;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "%s:%u: none of the channels are in the header\n", path, lineno);
+                return -1;
+            }
+            have_header = 1;
+            continue;
+        }
+        have_header = 1;
+        if (time_column >= 0) {
+            if (time_column >= n) {
+                fprintf(stderr, "%s:%u: bad line\n", path, lineno);
+                return -1;
+            }
+            time = strtod(fields[time_column], NULL);
+        } else if (samplerate > 0) {
+            time = row / samplerate;
+        } else {
+            fprintf(stderr, "%s: no time column or sample rate; use -r\n", path);
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            if (column_pin[i] >= 0) {
+                pins = set_pin(pins, column_pin[i], strtol(fields[i], NULL, 0) != 0);
+            }
+        }
+        if (add_change(log, &capacity, time, pins)) {
+            fprintf(stderr, "%s: out of memory\n", path);
+            return -1;
+        }
+        row++;
+    }
+    log->end = time;
+    return 0;
+}
+
+// Read one whitespace-separated token.
+static int read_token(FILE *f, char *token, size_t size)
+{
+    int c;
+    size_t n = 0;
+
+    while ((c = getc(f)) != EOF && isspace(c)) ;
+    while (c != EOF && !isspace(c)) {
+        if (n + 1 < size) token[n++] = c;
+        c = getc(f);
+    }
+    token[n] = 0;
+    return n > 0;
+}
+
+static int skip_to_end(FILE *f)
+{
+    char token[256];
+
+    while (read_token(f, token, sizeof(token))) {
+        if (!strcmp(token, "$end")) return 0;
+    }
+    return -1;
+}
+
+#define VCD_MAX_IDS 256
+
+static int read_vcd(FILE *f, const char *path, const char *const names[7], PinLog *log)
+{
+    char token[256], ids[VCD_MAX_IDS][16];
+    int id_pin[VCD_MAX_IDS], nids = 0, found = 0, i;
+    size_t capacity = 0;
+    double timescale = 1e-9, time = 0;
+    uint8_t pins = 0x7f;
+
+    while (read_token(f, token, sizeof(token))) {
+        if (!strcmp(token, "$timescale")) {
+            double scale;
+            char unit[8] = "";
+
+            if (!read_token(f, token, sizeof(token))) break;
+            if (sscanf(token, "%lf%7s", &scale, unit) < 2 && !read_token(f, unit, sizeof(unit))) break;
+            timescale = scale;
+            if (!strcmp(unit, "s")) ;
+            else if (!strcmp(unit, "ms")) timescale *= 1e-3;
+            else if (!strcmp(unit, "us")) timescale *= 1e-6;
+            else if (!strcmp(unit, "ns")) timescale *= 1e-9;
+            else if (!strcmp(unit, "ps")) timescale *= 1e-12;
+            else if (!strcmp(unit, "fs")) timescale *= 1e-15;
+            else {
+                fprintf(stderr, "%s: unknown timescale unit %s\n", path, unit);
+                return -1;
+            }
+            skip_to_end(f);
+        } else if (!strcmp(token, "$var")) {
+            char type[32], width[16], id[16], name[64];
+
+            if (!read_token(f, type, sizeof(type)) || !read_token(f, width, sizeof(width)) ||
+                !read_token(f, id, sizeof(id)) || !read_token(f, name, sizeof(name))) {
+                break;
+            }
+            if (nids < VCD_MAX_IDS) {
+                strcpy(ids[nids], id);
+                id_pin[nids] = atoi(width) == 1 ? pin_for_name(names, name) : -1;
+                found += id_pin[nids] >= 0;
+                nids++;
+            }
+            skip_to_end(f);
+        } else if (!strcmp(token, "$dumpvars") || !strcmp(token, "$end")) {
+            // the values in $dumpvars are read like any others
+        } else if (token[0] == '$') {
+            skip_to_end(f);
+        } else if (token[0] == '#') {
+            double t = strtod(token + 1, NULL) * timescale;
+            if (add_change(log, &capacity, time, pins)) goto nomem;
+            time = t;
+        } else if (strchr("01xXzZ", token[0])) {
+            for (i = 0; i < nids && strcmp(ids[i], token + 1); i++) ;
+            if (i < nids && id_pin[i] >= 0) {
+                // undriven pins read high, through the pull-ups
+                pins = set_pin(pins, id_pin[i], token[0] != '0');
+            }
+        } else if (strchr("bBrR", token[0])) {
+            read_token(f, token, sizeof(token));  // vector; not ours
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "%s: none of the channels are in the file\n", path);
+        return -1;
+    }
+    if (add_change(log, &capacity, time, pins)) goto nomem;
+    log->end = time;
+    return 0;
+
+nomem:
+    fprintf(stderr, "%s: out of memory\n", path);
+    return -1;
+}
+
+int pinlog_read(const char *path, const char *const names[7], double samplerate, PinLog *log)
+{
+    char first[32] = "";
+    FILE *f;
+    int r;
+
+    log->changes = NULL;
+    log->count = 0;
+    log->end = 0;
+
+    f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    if (!fgets(first, sizeof(first), f)) {
+        fprintf(stderr, "%s: empty\n", path);
+        fclose(f);
+        return -1;
+    }
+    rewind(f);
+    if (first[0] == '$') {
+        r = read_vcd(f, path, names, log);
+    } else if (!strncmp(first, "# volumepad trace", 17) || !strncmp(first, "ticks_per_second", 16)) {
+        r = read_trace(f, path, log);
+    } else {
+        r = read_csv(f, path, names, samplerate, log);
+    }
+    fclose(f);
+    if (!r && !log->count) {
+        fprintf(stderr, "%s: no samples\n", path);
+        r = -1;
+    }
+    if (r) {
+        pinlog_free(log);
+    }
+    return r;
+}
+
+void pinlog_free(PinLog *log)
+{
+    free(log->changes);
+    log->changes = NULL;
+    log->count = 0;
+}
+
+uint8_t pinlog_pins_at(const PinLog *log, double time)
+{
+    size_t lo = 0, hi = log->count;
+
+    // the last change at or before time
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (log->changes[mid].time <= time) lo = mid;
+        else hi = mid;
+    }
+    if (!log->count || log->changes[lo].time > time) {
+        return 0x7f;
+    }
+    return log->changes[lo].pins;
+}
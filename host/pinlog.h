@@ -0,0 +1,44 @@
+// Recorded switch pins, read from a capture_dump trace or from a
+// logic analyzer capture exported by sigrok as CSV or VCD.
+//
+// A log is the list of times the seven pins (PB0-PB6, as in PINB &
+// 0x7f; 1 = open, 0 = pressed) changed, starting with their state at
+// time 0.  Pins that aren't in the capture read as open.
+
+#ifndef pinlog_h__
+#define pinlog_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    double time;		// seconds from the start of the capture
+    uint8_t pins;		// from this time until the next change
+} PinChange;
+
+typedef struct {
+    PinChange *changes;
+    size_t count;
+    double end;			// time of the last sample in the capture
+} PinLog;
+
+// Read a capture.  The format is worked out from the contents:
+//
+//   trace  capture_dump output (see "Raw input capture" in README.md)
+//   VCD    sigrok-cli -O vcd
+//   CSV    sigrok-cli -O csv, or any CSV with a header row naming
+//          the channels, an optional time column in seconds, and
+//          one row per sample
+//
+// names[i] is the channel carrying PBi in a VCD or CSV file (compared
+// without case).  samplerate is the CSV sample rate in Hz, for files
+// with no time column and no "Samplerate:" comment; 0 if unknown.
+//
+// Returns 0 on success, or -1 after printing an error.
+int pinlog_read(const char *path, const char *const names[7], double samplerate, PinLog *log);
+void pinlog_free(PinLog *log);
+
+// The pins at a time in the log.
+uint8_t pinlog_pins_at(const PinLog *log, double time);
+
+#endif
@@ -0,0 +1,218 @@
+// Replay a pin capture through the firmware's debounce and dial code
+// (src/input.c, built for the host) and check what comes out.
+//
+// Usage: replay [options] capture
+//
+// The capture is a capture_dump trace, or a logic analyzer capture of
+// PB0-PB6 exported by sigrok-cli as CSV or VCD (see pinlog.h).  It's
+// sampled once per tick, as the tick interrupt would, and every event
+// the firmware would send on the vendor interface is listed with its
+// latency from the pin edge that caused it.
+//
+// The same capture is also decoded at its own resolution: a pin that
+// holds a new level for the settle time (-s, the debounce time unless
+// given) is an intended press or release, and dial detents come from
+// those.  Intended changes that produce no event are listed as
+// missed, and events with no intended change behind them as
+// spurious.  Long presses are listed but not checked.  The exit status
+// is 1 if anything was missed or spurious, so a capture from a field
+// complaint can be kept as a test case.
+//
+// Options (the defaults are the firmware's):
+//   -c D0,D1,...  channels carrying PB0-PB6 in a CSV or VCD capture
+//                 (default D0,D1,D2,D3,D4,D5,D6)
+//   -r HZ         CSV sample rate, if the file doesn't give it
+//   -t US         tick period in microseconds (default 1000)
+//   -d MS         debounce time (default 12)
+//   -l MS         long press time (default 655)
+//   -a MS:STEPS   a dial curve point; repeat for up to four
+//   -T MASK       tap-hold switches, as a hex mask of PB pins
+//   -s MS         settle time for intended changes (default: -d)
+//   -D US         dial sampling period in microseconds, as
+//                 DIAL_SAMPLE_US (default 256); 0 samples the dial
+//                 with the other switches, once per tick
+//   -e            also list every raw pin change
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "input.h"
+#include "tuning.h"
+#include "pinlog.h"
+#include "sampler.h"
+#include "score.h"
+
+// The tuning input.c runs with.
+Tuning tuning;
+
+static const char *event_name(uint8_t type)
+{
+    switch (type & 0xf0) {
+    case EVENT_PRESS: return "press";
+    case EVENT_RELEASE: return "release";
+    case EVENT_LONG_PRESS: return "long press";
+    case EVENT_DIAL_CW: return "dial cw";
+    case EVENT_DIAL_CCW: return "dial ccw";
+    }
+    return "?";
+}
+
+// eg. "press PB2", or "dial cw x2" with steps
+static void describe(char *buf, size_t size, uint8_t type, int steps)
+{
+    if ((type & 0xf0) == EVENT_DIAL_CW || (type & 0xf0) == EVENT_DIAL_CCW) {
+        snprintf(buf, size, steps ? "%s x%d" : "%s", event_name(type), abs(steps));
+    } else {
+        snprintf(buf, size, "%s PB%u", event_name(type), type & 0x0f);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-c channels] [-r hz] [-t us] [-d ms] [-l ms] [-a ms:steps]\n"
+            "          [-T mask] [-s ms] [-D us] [-e] capture\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *names[7] = { "D0", "D1", "D2", "D3", "D4", "D5", "D6" };
+    char *channels = NULL;
+    double samplerate = 0, tick_us = 1000, debounce_ms = 12, long_press_ms = 655, settle_ms = -1;
+    double dial_us = DIAL_SAMPLE_US;
+    double period;
+    double curve_ms[DIAL_CURVE_POINTS];
+    unsigned long tap_hold = 0, dial_points = 0;
+    int list_edges = 0, opt;
+    size_t e, c, edge;
+    Score score;
+    PinLog log;
+
+    memset(&tuning, 0, sizeof(tuning));
+    tuning.version = TUNING_VERSION;
+
+    while ((opt = getopt(argc, argv, "c:r:t:d:l:a:T:s:D:e")) != -1) {
+        double ms;
+        unsigned steps;
+
+        switch (opt) {
+        case 'c': channels = optarg; break;
+        case 'r': samplerate = atof(optarg); break;
+        case 't': tick_us = atof(optarg); break;
+        case 'd': debounce_ms = atof(optarg); break;
+        case 'l': long_press_ms = atof(optarg); break;
+        case 's': settle_ms = atof(optarg); break;
+        case 'D': dial_us = atof(optarg); break;
+        case 'T': tap_hold = strtoul(optarg, NULL, 16) & 0x7f; break;
+        case 'e': list_edges = 1; break;
+        case 'a':
+            if (dial_points == DIAL_CURVE_POINTS || sscanf(optarg, "%lf:%u", &ms, &steps) != 2 || steps > 255) {
+                usage(argv[0]);
+            }
+            curve_ms[dial_points] = ms;
+            tuning.dial_curve[dial_points].steps = steps;
+            dial_points++;
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc || tick_us <= 0 || dial_us < 0) {
+        usage(argv[0]);
+    }
+    if (channels) {
+        char *p = channels;
+        for (int i = 0; i < 7; i++) {
+            names[i] = p ? strsep(&p, ",") : "";
+        }
+    }
+    if (settle_ms < 0) {
+        settle_ms = debounce_ms;
+    }
+
+    // Times in ticks, rounded to the nearest tick like MsToTicks in
+    // main.c.
+    period = tick_us / 1e6;
+    tuning.tick_period_us = tick_us;
+    tuning.debounce_ticks = lround(debounce_ms * 1000 / tick_us);
+    tuning.long_press_ticks = lround(long_press_ms * 1000 / tick_us);
+    for (unsigned long i = 0; i < dial_points; i++) {
+        tuning.dial_curve[i].within_ticks = lround(curve_ms[i] * 1000 / tick_us);
+    }
+    if (debounce_ms * 1000 / tick_us > 255 || long_press_ms * 1000 / tick_us > 65535 ||
+        tuning.long_press_ticks <= tuning.debounce_ticks) {
+        fprintf(stderr, "%s: times don't fit in the tuning (see tuning_valid)\n", argv[0]);
+        return 2;
+    }
+
+    if (pinlog_read(argv[optind], names, samplerate, &log)) {
+        return 2;
+    }
+
+    score_capture(&log, period, dial_us / 1e6, tap_hold, settle_ms / 1000, 0, &score);
+
+    printf("# %s: %.3f s, %zu pin changes, %lu ticks of %g us\n",
+           argv[optind], log.end, log.count ? log.count - 1 : 0, score.ticks, tick_us);
+    printf("# debounce %u ticks, long press %u ticks, settle %g ms\n",
+           tuning.debounce_ticks, tuning.long_press_ticks, settle_ms);
+    printf("#    time_ms  event            latency_ms\n");
+
+    // Events, intended changes that were missed, and (with -e) raw pin
+    // changes, in time order.
+    e = c = 0;
+    edge = 1;
+    for (;;) {
+        double te = e < score.event_count ? score.events[e].time : INFINITY;
+        double tc = INFINITY, tp = INFINITY;
+
+        while (c < score.change_count && score.changes[c].matched) c++;
+        if (c < score.change_count) tc = score.changes[c].settled;
+        if (list_edges && edge < log.count) tp = log.changes[edge].time;
+        if (te == INFINITY && tc == INFINITY && tp == INFINITY) break;
+
+        if (tp <= te && tp <= tc) {
+            printf("  %11.3f  pins %02x\n", tp * 1000, log.changes[edge].pins);
+            edge++;
+        } else if (tc < te) {
+            char what[32];
+
+            describe(what, sizeof(what), score.changes[c].type, 0);
+            printf("  %11.3f  %-16s  MISSED (edge at %.3f)\n", tc * 1000, what,
+                   score.changes[c].edge * 1000);
+            c++;
+        } else {
+            Event *ev = &score.events[e++];
+            char what[32];
+
+            describe(what, sizeof(what), ev->type, ev->steps);
+            printf("  %11.3f  %-16s", ev->time * 1000, what);
+            if (ev->matched) {
+                printf(" %10.3f", (ev->time - ev->edge) * 1000);
+            } else if ((ev->type & 0xf0) != EVENT_LONG_PRESS) {
+                printf("  SPURIOUS");
+            }
+            if ((ev->type & 0xf0) == EVENT_PRESS || (ev->type & 0xf0) == EVENT_RELEASE) {
+                printf("  (%u bounces)", ev->value);
+            }
+            printf("\n");
+        }
+    }
+
+    printf("# %zu events", score.event_count);
+    if (score.latencies) {
+        printf(", latency %.3f min, %.3f avg, %.3f max (ms)", score.latency_min * 1000,
+               score.latency_sum / score.latencies * 1000, score.latency_max * 1000);
+    }
+    printf("; %u missed, %u spurious\n", score.missed, score.spurious);
+    printf("# dial: %u detents missed, %u spurious", score.missed_detents, score.spurious_detents);
+    if (dial_us > 0) {
+        printf("; %lu sample interrupts", score.dial_interrupts);
+    }
+    printf("; %lu busy ticks\n", score.busy_ticks);
+
+    score_free(&score);
+    pinlog_free(&log);
+    return score.missed || score.spurious;
+}
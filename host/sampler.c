@@ -0,0 +1,65 @@
+// Running the dial sampling interrupts over a capture; see sampler.h.
+
+#include <math.h>
+
+#include "input.h"
+#include "sampler.h"
+
+// As in main.c.
+#define DIAL_IDLE_SAMPLES 32
+
+void sampler_init(DialSampler *d, const PinLog *log, double period)
+{
+    d->period = period;
+    d->next = INFINITY;
+    d->change = 0;
+    d->pins = DIAL_PINS & pinlog_pins_at(log, 0);
+    d->still = 0;
+    d->samples = 0;
+}
+
+// Take one sample of pins at time t, as sample_dial() in main.c does.
+static int8_t sample(DialSampler *d, uint8_t pins, double t)
+{
+    d->samples++;
+    d->next = t + d->period;
+    if ((pins & DIAL_PINS) == d->pins) {
+        if (++d->still == DIAL_IDLE_SAMPLES) {
+            d->next = INFINITY;
+        }
+        return 0;
+    }
+    d->pins = pins & DIAL_PINS;
+    d->still = 0;
+    return input_sample_dial(d->pins);
+}
+
+int8_t sampler_run(DialSampler *d, const PinLog *log, double until)
+{
+    int8_t detents = 0;
+
+    for (;;) {
+        if (d->next == INFINITY) {
+            // Waiting for a pin change, which samples straight away.
+            while (d->change < log->count && log->changes[d->change].time <= until &&
+                   (log->changes[d->change].pins & DIAL_PINS) == d->pins) {
+                d->change++;
+            }
+            if (d->change == log->count || log->changes[d->change].time > until) {
+                return detents;
+            }
+            d->still = 0;
+            detents += sample(d, log->changes[d->change].pins, log->changes[d->change].time);
+            d->change++;
+        } else if (d->next <= until) {
+            double t = d->next;
+
+            while (d->change < log->count && log->changes[d->change].time <= t) {
+                d->change++;
+            }
+            detents += sample(d, d->change ? log->changes[d->change - 1].pins : 0x7f, t);
+        } else {
+            return detents;
+        }
+    }
+}
@@ -0,0 +1,35 @@
+// The dial sampling interrupts of DIAL_FAST_SAMPLING in main.c, run
+// over a pin capture: a change on a dial pin starts sampling every
+// period, until the pins have been still for DIAL_IDLE_SAMPLES
+// samples.  Each sample goes through input_sample_dial() in
+// src/input.c, so replay, sweep and uhid_pad decode the dial as the
+// firmware does.
+
+#ifndef sampler_h__
+#define sampler_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pinlog.h"
+
+// The firmware's DIAL_SAMPLE_US, which the tools default to.
+#define DIAL_SAMPLE_US 256
+
+typedef struct {
+    double period;
+    double next;		// next sample, or INFINITY while waiting for a pin change
+    size_t change;		// next pin change in the log
+    uint8_t pins;		// dial pins at the last sample
+    unsigned still;		// samples since they changed
+    unsigned long samples;	// interrupts taken so far
+} DialSampler;
+
+// Start with the pins at the start of the log, waiting for a change,
+// sampling every period seconds once there is one.
+void sampler_init(DialSampler *d, const PinLog *log, double period);
+// Take the samples due up to time until.  Returns the detents they
+// found, for input_add_detents().
+int8_t sampler_run(DialSampler *d, const PinLog *log, double until);
+
+#endif
@@ -0,0 +1,308 @@
+// Scoring input.c against a capture; see score.h.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "input.h"
+#include "tuning.h"
+#include "keymap_features.h"
+#include "score.h"
+#include "sampler.h"
+
+#define DialA 1
+#define DialB 5
+
+// Pins read as released, as IGNORED_PINS in main.c: switches with
+// nothing in the keymap, and the dial when it's sampled separately.
+#define IGNORED_SWITCHES (0x7f & ~KEYMAP_SWITCHES & ~DIAL_PINS)
+
+static Event *events;
+static size_t event_count, event_capacity;
+static double current_time;
+
+static void *grow(void *array, size_t *capacity, size_t size)
+{
+    *capacity = *capacity ? *capacity * 2 : 256;
+    array = realloc(array, *capacity * size);
+    if (!array) {
+        fprintf(stderr, "out of memory\n");
+        exit(2);
+    }
+    return array;
+}
+
+void input_event(uint8_t type, uint8_t value, uint16_t tick)
+{
+    (void)tick;
+    if (event_count == event_capacity) {
+        events = grow(events, &event_capacity, sizeof(Event));
+    }
+    events[event_count].type = type;
+    events[event_count].value = value;
+    events[event_count].steps = 0;
+    events[event_count].time = current_time;
+    events[event_count].matched = 0;
+    event_count++;
+}
+
+static void add_change(Change **changes, size_t *count, size_t *capacity, uint8_t type, double edge, double settled)
+{
+    if (*count == *capacity) {
+        *changes = grow(*changes, capacity, sizeof(Change));
+    }
+    (*changes)[*count].type = type;
+    (*changes)[*count].edge = edge;
+    (*changes)[*count].settled = settled;
+    (*changes)[*count].held = 0;
+    (*changes)[*count].matched = 0;
+    (*changes)[*count].hold_matched = 0;
+    (*count)++;
+}
+
+static int is_detent(uint8_t type)
+{
+    return (type & 0xf0) == EVENT_DIAL_CW || (type & 0xf0) == EVENT_DIAL_CCW;
+}
+
+// Intended changes: each pin's level once it has held for `settle`
+// seconds.  Like the firmware, every pin starts out open.  Switch pins
+// give presses and releases; the dial pins give detents, decoded the
+// same way as in input.c.
+static Change *intended_changes(const PinLog *log, double settle, size_t *count)
+{
+    Change *changes = NULL;
+    size_t capacity = 0, press[7];
+    uint8_t settled = 0x7f;
+    double first_edge[7];
+    uint8_t dial_moving = 0, dial_position = 1, dial_direction = EVENT_DIAL_CCW;
+    double dial_edge = 0;
+
+    *count = 0;
+    for (int i = 0; i < 7; i++) {
+        first_edge[i] = -1;
+        press[i] = SIZE_MAX;
+    }
+
+    for (size_t j = 0; j < log->count; j++) {
+        double start = log->changes[j].time;
+        double end = j + 1 < log->count ? log->changes[j + 1].time : log->end;
+        uint8_t pins = log->changes[j].pins;
+        uint8_t dial_before = settled;
+
+        for (int i = 0; i < 7; i++) {
+            int level = (pins >> i) & 1;
+
+            if (level != ((settled >> i) & 1)) {
+                if (first_edge[i] < 0) first_edge[i] = start;
+                if (end - start >= settle) {
+                    settled ^= (1 << i);
+                    if (level && press[i] != SIZE_MAX) {
+                        changes[press[i]].held = first_edge[i] - changes[press[i]].edge;
+                        press[i] = SIZE_MAX;
+                    } else if (!level) {
+                        press[i] = *count;
+                    }
+                    add_change(&changes, count, &capacity,
+                               (level ? EVENT_RELEASE : EVENT_PRESS) | i,
+                               first_edge[i], start + settle);
+                    if ((i == DialA || i == DialB) && !dial_moving) {
+                        dial_edge = first_edge[i];
+                    }
+                    first_edge[i] = -1;
+                }
+            } else if (end - start >= settle) {
+                // it came back and stayed: just a glitch
+                first_edge[i] = -1;
+            }
+        }
+
+        if (((settled ^ dial_before) & ((1 << DialA) | (1 << DialB)))) {
+            uint8_t a = (settled >> DialA) & 1, b = (settled >> DialB) & 1;
+
+            if (a != b) {
+                dial_direction = a != dial_position ? EVENT_DIAL_CW : EVENT_DIAL_CCW;
+                dial_moving = 1;
+            } else if (dial_moving) {
+                dial_moving = 0;
+                if (a != dial_position) {
+                    dial_position = a;
+                    add_change(&changes, count, &capacity, dial_direction, dial_edge, start + settle);
+                }
+            } else {
+                dial_position = a;
+            }
+        }
+    }
+    // still down at the end of the capture
+    for (int i = 0; i < 7; i++) {
+        if (press[i] != SIZE_MAX) {
+            changes[press[i]].held = log->end - changes[press[i]].edge;
+        }
+    }
+    return changes;
+}
+
+// Pair up intended changes with the events they caused.  For each
+// intended change, the next unmatched event of the same type is taken
+// if it came after the first edge and no later than `slack` after the
+// change settled.  Changes of one type come in time order, so each
+// type's search carries on from where the last one stopped.
+static void match(Change *changes, size_t change_count, double slack)
+{
+    size_t next[256] = {0};
+
+    for (size_t c = 0; c < change_count; c++) {
+        uint8_t type = changes[c].type;
+        size_t e;
+
+        for (e = next[type]; e < event_count; e++) {
+            if (events[e].matched || events[e].type != type) continue;
+            if (events[e].time < changes[c].edge) continue;
+            if (events[e].time <= changes[c].settled + slack) {
+                events[e].matched = 1;
+                events[e].edge = changes[c].edge;
+                changes[c].matched = 1;
+            }
+            break;
+        }
+        next[type] = e;
+    }
+}
+
+// Pair up long presses with the intended press they belong to: the
+// last one on the same pin to settle before it.  Only presses on the
+// tracked pins (as input_init() tracks them) should give one.
+static void match_holds(Score *score, double hold, uint8_t tracked)
+{
+    size_t last_press[7], c = 0;
+
+    for (int i = 0; i < 7; i++) last_press[i] = SIZE_MAX;
+    for (size_t e = 0; e < event_count; e++) {
+        size_t found;
+
+        if ((events[e].type & 0xf0) != EVENT_LONG_PRESS) continue;
+        for (; c < score->change_count && score->changes[c].settled <= events[e].time; c++) {
+            if ((score->changes[c].type & 0xf0) == EVENT_PRESS) {
+                last_press[score->changes[c].type & 0x0f] = c;
+            }
+        }
+        found = last_press[events[e].type & 0x0f];
+        if (found == SIZE_MAX || score->changes[found].hold_matched || score->changes[found].held < hold) {
+            score->false_holds++;
+        } else {
+            double latency = events[e].time - score->changes[found].edge;
+
+            score->changes[found].hold_matched = 1;
+            score->hold_latency_sum += latency;
+            if (latency > score->hold_latency_max) score->hold_latency_max = latency;
+            score->hold_latencies++;
+        }
+    }
+    for (c = 0; c < score->change_count; c++) {
+        if ((score->changes[c].type & 0xf0) == EVENT_PRESS && !score->changes[c].hold_matched &&
+            score->changes[c].held >= hold && ((tracked >> (score->changes[c].type & 0x0f)) & 1)) {
+            score->missed_holds++;
+        }
+    }
+}
+
+void score_capture(const PinLog *log, double tick_period, double dial_period, uint8_t tap_hold,
+                   double settle, double hold, Score *score)
+{
+    uint8_t last_debounced, last_long;
+    size_t next_change = 0;
+    uint8_t pins = 0x7f;
+    uint8_t ignored = IGNORED_SWITCHES | (dial_period > 0 ? DIAL_PINS : 0);
+    DialSampler dial;
+
+    memset(score, 0, sizeof(*score));
+    events = NULL;
+    event_count = event_capacity = 0;
+    sampler_init(&dial, log, dial_period);
+
+    // Run the firmware's input code once per tick.  The tick
+    // interrupt first fires one period after the timer starts.
+    score->ticks = (unsigned long)(log->end / tick_period);
+    input_init(tap_hold, KEYMAP_LONG_PRESS_SWITCHES, pinlog_pins_at(log, 0));
+    last_debounced = debounced_switches;
+    last_long = long_press_switches;
+    for (unsigned long tick = 1; tick <= score->ticks; tick++) {
+        current_time = tick * tick_period;
+        // pinlog_pins_at(), walking forward instead of searching
+        while (next_change < log->count && log->changes[next_change].time <= current_time) {
+            pins = log->changes[next_change++].pins;
+        }
+        if (dial_period > 0) {
+            int8_t detents = sampler_run(&dial, log, current_time);
+
+            score->busy_ticks += input_update(pins | ignored, (uint16_t)tick);
+            input_add_detents(detents, (uint16_t)tick);
+        } else {
+            score->busy_ticks += input_update(pins | ignored, (uint16_t)tick);
+        }
+        if ((last_debounced ^ debounced_switches) | (last_long ^ long_press_switches) ||
+            input_dial_pending()) {
+            size_t before = event_count;
+            int16_t steps = input_update_dial((uint16_t)tick);
+            if (steps && event_count > before) {
+                events[event_count - 1].steps = steps;
+            }
+        }
+        last_debounced = debounced_switches;
+        last_long = long_press_switches;
+    }
+
+    score->dial_interrupts = dial.samples;
+    score->changes = intended_changes(log, settle, &score->change_count);
+    if (ignored) {
+        // Ignored pins, including sampled dial pins, aren't debounced,
+        // so they make no presses or releases.
+        size_t kept = 0;
+
+        for (size_t c = 0; c < score->change_count; c++) {
+            uint8_t type = score->changes[c].type;
+
+            if (((type & 0xf0) == EVENT_PRESS || (type & 0xf0) == EVENT_RELEASE) &&
+                ((ignored >> (type & 0x0f)) & 1)) {
+                continue;
+            }
+            score->changes[kept++] = score->changes[c];
+        }
+        score->change_count = kept;
+    }
+    match(score->changes, score->change_count, (tuning.debounce_ticks + 2) * tick_period);
+    score->events = events;
+    score->event_count = event_count;
+
+    score->latency_min = INFINITY;
+    for (size_t c = 0; c < score->change_count; c++) {
+        score->missed += !score->changes[c].matched;
+        score->missed_detents += !score->changes[c].matched && is_detent(score->changes[c].type);
+    }
+    for (size_t e = 0; e < event_count; e++) {
+        if (events[e].matched) {
+            double latency = events[e].time - events[e].edge;
+
+            score->latency_sum += latency;
+            if (latency < score->latency_min) score->latency_min = latency;
+            if (latency > score->latency_max) score->latency_max = latency;
+            score->latencies++;
+        } else if ((events[e].type & 0xf0) != EVENT_LONG_PRESS) {
+            score->spurious++;
+            score->spurious_detents += is_detent(events[e].type);
+        }
+    }
+    if (hold > 0) {
+        match_holds(score, hold, KEYMAP_LONG_PRESS_SWITCHES | tap_hold);
+    }
+}
+
+void score_free(Score *score)
+{
+    free(score->events);
+    free(score->changes);
+    score->events = NULL;
+    score->changes = NULL;
+}
@@ -0,0 +1,78 @@
+// Running a pin capture through the firmware's debounce and dial code
+// (src/input.c, built for the host) and checking the events it makes
+// against what the capture shows was intended.
+//
+// A pin that holds a new level for the settle time is an intended
+// press or release, and dial detents come from those, decoded the same
+// way as in input.c.  Each intended change is paired with the event it
+// caused, if any; intended changes left over were missed, and events
+// left over are spurious.
+
+#ifndef score_h__
+#define score_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pinlog.h"
+
+typedef struct {
+    uint8_t type;		// EVENT_*, with the pin in the low nibble
+    uint8_t value;		// bounces, for presses and releases
+    int16_t steps;		// dial steps, for dial events
+    double time;		// the tick it happened in
+    double edge;		// the edge that caused it, if matched
+    int matched;
+} Event;
+
+// An intended press, release or dial detent, from the capture at full
+// resolution.
+typedef struct {
+    uint8_t type;		// EVENT_PRESS, _RELEASE, _DIAL_CW or _DIAL_CCW
+    double edge;		// first edge away from the old level
+    double settled;		// when it had held the new level for the settle time
+    double held;		// for presses, how long until the intended release
+    int matched;
+    int hold_matched;		// a press that got its long press
+} Change;
+
+typedef struct {
+    Event *events;
+    size_t event_count;
+    Change *changes;
+    size_t change_count;
+
+    unsigned long ticks;	// ticks run
+    unsigned long busy_ticks;	// ticks input_update() had work to do in
+    unsigned long dial_interrupts;	// dial samples taken, with a dial_period
+
+    // Presses, releases and dial detents (long presses aren't
+    // counted here).
+    unsigned missed, spurious;
+    unsigned missed_detents, spurious_detents;	// the dial's share of those
+    unsigned long latencies;	// matched events
+    double latency_sum, latency_min, latency_max;
+
+    // Long presses, when checked: an intended press held for the hold
+    // time or longer should give one, and a shorter one shouldn't.
+    // Hold latency is from the press's first edge.
+    unsigned missed_holds, false_holds;
+    unsigned long hold_latencies;
+    double hold_latency_sum, hold_latency_max;
+} Score;
+
+// Run the capture once per tick of tick_period seconds, with the
+// current tuning (see tuning.h) and tap_hold as in input_init(), and
+// score it.  As in main.c, pins with nothing in the keymap are read as
+// released and only switches with long-press keys are tracked (see
+// keymap_features.h).  A dial_period above 0 samples the dial pins
+// separately every dial_period seconds while it turns, as
+// DIAL_FAST_SAMPLING in main.c does; their presses and releases aren't
+// scored then.  settle is the settle time for intended changes, and
+// hold the time an intended press has to last to be meant as a long
+// press, or 0 to leave long presses unchecked; both in seconds.
+void score_capture(const PinLog *log, double tick_period, double dial_period, uint8_t tap_hold,
+                   double settle, double hold, Score *score);
+void score_free(Score *score);
+
+#endif
@@ -0,0 +1,251 @@
+// Bit-sliced debouncing and dial decoding; see slice.h.  Each function
+// follows its counterpart in src/input.c step by step, with the
+// per-switch branches turned into lane masks.
+
+#include <string.h>
+
+#include "input.h"
+#include "slice.h"
+
+#define DialA 1
+#define DialB 5
+
+#define ALL_LANES (~(Lanes)0)
+
+// Run the statement that follows once for each lane in a mask.
+#define FOR_LANES(mask, lane) \
+    for (Lanes m_ = (mask); m_; m_ &= m_ - 1) \
+        for (int lane = __builtin_ctzll(m_), once_ = 1; once_; once_ = 0)
+
+static Lanes lane_bit(int lane)
+{
+    return (Lanes)1 << lane;
+}
+
+// Add one to a bit-sliced counter, in the lanes in mask.
+static void increment(Lanes *planes, int bits, Lanes mask)
+{
+    for (int k = 0; k < bits && mask; k++) {
+        Lanes carry = planes[k] & mask;
+        planes[k] ^= mask;
+        mask = carry;
+    }
+}
+
+static void clear(Lanes *planes, int bits, Lanes mask)
+{
+    for (int k = 0; k < bits; k++) {
+        planes[k] &= ~mask;
+    }
+}
+
+// Lanes where two bit-sliced values are equal.  Counts seldom hit
+// their limits, so this usually runs out of lanes after a plane or two.
+static Lanes equal(const Lanes *a, const Lanes *b, int bits, Lanes lanes)
+{
+    for (int k = 0; k < bits && lanes; k++) {
+        lanes &= ~(a[k] ^ b[k]);
+    }
+    return lanes;
+}
+
+// Lanes where every bit of a value is set.
+static Lanes all_ones(const Lanes *planes, int bits)
+{
+    Lanes ones = ALL_LANES;
+
+    for (int k = 0; k < bits; k++) {
+        ones &= planes[k];
+    }
+    return ones;
+}
+
+static unsigned lane_value(const Lanes *planes, int bits, int lane)
+{
+    unsigned v = 0;
+
+    for (int k = 0; k < bits; k++) {
+        v |= ((planes[k] >> lane) & 1) << k;
+    }
+    return v;
+}
+
+static void set_lane_value(Lanes *planes, int bits, int lane, unsigned v)
+{
+    for (int k = 0; k < bits; k++) {
+        planes[k] = (planes[k] & ~lane_bit(lane)) | ((Lanes)((v >> k) & 1) << lane);
+    }
+}
+
+void slice_init(Slice *s, const Tuning *tunings, const uint8_t *tap_hold, const uint8_t *long_press,
+                const uint8_t *raw_pins)
+{
+    memset(s, 0, sizeof(*s));
+    s->count_bits = 1;
+    for (int i = 0; i < 7; i++) {
+        s->state[i] = ALL_LANES;
+        s->counting[i] = ALL_LANES;
+        s->debounced[i] = ALL_LANES;
+        s->long_press[i] = ALL_LANES;
+    }
+    for (int lane = 0; lane < SLICE_LANES; lane++) {
+        set_lane_value(s->debounce_ticks, 16, lane, tunings[lane].debounce_ticks);
+        set_lane_value(s->long_press_ticks, 16, lane, tunings[lane].long_press_ticks);
+        while (s->count_bits < 16 && tunings[lane].long_press_ticks >> s->count_bits) {
+            s->count_bits++;
+        }
+        memcpy(s->dial_curve[lane], tunings[lane].dial_curve, sizeof(s->dial_curve[lane]));
+        for (int i = 0; i < 7; i++) {
+            s->tap_hold[i] |= (Lanes)((tap_hold[lane] >> i) & 1) << lane;
+            // Tap-hold switches resolve as held after a long press, too.
+            s->tracked[i] |= (Lanes)(((long_press[lane] | tap_hold[lane]) >> i) & 1) << lane;
+        }
+        s->dial_position |= (Lanes)((raw_pins[lane] >> DialA) & 1) << lane;
+    }
+}
+
+void slice_restart_debounce(Slice *s, Lanes lanes)
+{
+    for (int i = 0; i < 7; i++) {
+        clear(s->count[i], s->count_bits, lanes);
+        s->counting[i] |= lanes;
+    }
+}
+
+Lanes slice_update(Slice *s, const Lanes raw[7], uint16_t tick)
+{
+    Lanes undecided[7], other_activity[7], any_undecided = 0, outside = 0, busy = 0, fire;
+
+    // The early return in input_update() skips work that would change
+    // nothing, so every lane just runs the loop; busy only reports
+    // which lanes it would have skipped.
+    for (int i = 0; i < 7; i++) {
+        busy |= (raw[i] ^ s->state[i]) | s->counting[i];
+        // Tap-hold switches that are down but not yet resolved as
+        // held.
+        undecided[i] = s->tap_hold[i] & ~s->debounced[i] & s->long_press[i];
+        other_activity[i] = 0;
+    }
+
+    for (int i = 0; i < 7; i++) {
+        Lanes key = raw[i];
+        Lanes changed = key ^ s->state[i];
+        Lanes matched = ~changed & s->counting[i];
+        Lanes at_debounce, reported, released, at_long_press, long_pressed;
+
+        if (!(changed | matched)) {
+            continue;
+        }
+
+        // The read value doesn't match the debounce state: reset the
+        // count.
+        if (changed) {
+            clear(s->count[i], s->count_bits, changed);
+            s->state[i] ^= changed;
+            increment(s->bounces[i], 8, changed & ~all_ones(s->bounces[i], 8));
+            s->counting[i] |= changed;
+        }
+
+        // It does match, and is still counting.
+        increment(s->count[i], s->count_bits, matched);
+
+        at_debounce = equal(s->count[i], s->debounce_ticks, s->count_bits, matched);
+        reported = at_debounce & (s->debounced[i] ^ key);
+        FOR_LANES(reported, lane) {
+            slice_event(lane, (((key >> lane) & 1) ? EVENT_RELEASE : EVENT_PRESS) | i,
+                        (uint8_t)(lane_value(s->bounces[i], 8, lane) - 1), tick);
+        }
+        if (at_debounce) {
+            clear(s->bounces[i], 8, at_debounce);
+            other_activity[i] = (i == DialA || i == DialB) ? reported : reported & ~key;
+            s->debounced[i] = (s->debounced[i] & ~at_debounce) | (key & at_debounce);
+            released = at_debounce & key;
+            s->long_press[i] |= released;
+            // Released switches, and pressed ones with no long press
+            // to wait for, stop counting.
+            s->counting[i] &= ~(released | (at_debounce & ~s->tracked[i]));
+        }
+
+        at_long_press = equal(s->count[i], s->long_press_ticks, s->count_bits, matched);
+        long_pressed = at_long_press & ~key;
+        s->long_press[i] &= ~long_pressed;
+        FOR_LANES(long_pressed, lane) {
+            slice_event(lane, EVENT_LONG_PRESS | i, 0, tick);
+        }
+        s->counting[i] &= ~at_long_press;
+    }
+
+    // A switch released this tick was a tap, whatever else happened.
+    // Any other switch being pressed, or the dial moving, resolves the
+    // rest as held.
+    for (int i = 0; i < 7; i++) {
+        undecided[i] &= ~s->debounced[i];
+        any_undecided |= undecided[i];
+        outside |= other_activity[i] & ~undecided[i];
+    }
+    fire = any_undecided & outside;
+    for (int i = 0; i < 7 && fire; i++) {
+        Lanes held = undecided[i] & fire;
+
+        s->long_press[i] &= ~held;
+        FOR_LANES(held, lane) {
+            slice_event(lane, EVENT_LONG_PRESS | i, 0, tick);
+        }
+    }
+    return busy;
+}
+
+Lanes slice_update_dial(Slice *s, uint16_t tick)
+{
+    Lanes a = s->debounced[DialA], b = s->debounced[DialB];
+    Lanes apart = a ^ b;
+    Lanes moved = a ^ s->dial_position;
+    Lanes stopped = ~apart & s->dial_moving;
+    Lanes detent = stopped & moved;
+    Lanes missed = ~apart & ~s->dial_moving & moved;
+
+    // Moving: the inputs differ.
+    s->dial_moving |= apart;
+    s->dial_cw = (s->dial_cw & ~apart) | (moved & apart);
+    // Stopped, at a new position or back at the old one.
+    s->dial_moving &= ~stopped;
+    // Stopped at a new position, or a whole click was missed.
+    s->dial_position = (s->dial_position & ~(detent | missed)) | (a & (detent | missed));
+
+    FOR_LANES(detent, lane) {
+        int cw = (s->dial_cw >> lane) & 1;
+        uint16_t ticks = tick - s->last_detent_tick[lane];
+        int16_t steps = 1;
+
+        slice_event(lane, cw ? EVENT_DIAL_CW : EVENT_DIAL_CCW, 0, tick);
+        for (int p = 0; p < DIAL_CURVE_POINTS; p++) {
+            if (s->dial_curve[lane][p].steps && ticks <= s->dial_curve[lane][p].within_ticks) {
+                steps = s->dial_curve[lane][p].steps;
+                break;
+            }
+        }
+        s->last_detent_tick[lane] = tick;
+        s->dial_steps[lane] = cw ? steps : -steps;
+    }
+    return detent;
+}
+
+uint8_t slice_debounced(const Slice *s, int lane)
+{
+    uint8_t v = 0;
+
+    for (int i = 0; i < 7; i++) {
+        v |= ((s->debounced[i] >> lane) & 1) << i;
+    }
+    return v;
+}
+
+uint8_t slice_long_press(const Slice *s, int lane)
+{
+    uint8_t v = 0;
+
+    for (int i = 0; i < 7; i++) {
+        v |= ((s->long_press[i] >> lane) & 1) << i;
+    }
+    return v;
+}
@@ -0,0 +1,77 @@
+// A bit-sliced copy of the firmware's debounce and dial code
+// (src/input.c) that runs 64 independent pads at once, one per bit of
+// a uint64_t.  Each pad (lane) has its own pins and its own tuning, so
+// one pass over the planes below advances 64 separate simulations:
+// different captures, random traces, or different timings of the same
+// capture.
+//
+// Every per-switch value is stored as bit planes: plane k of a counter
+// holds bit k of that counter for all 64 lanes, and a flag is a single
+// plane.  Counting, comparing and branching become a few word-wide
+// logic operations, whichever lanes they apply to.
+//
+// It has to behave exactly like input.c, tick for tick; slice_check
+// runs both on the same random traces and compares them.
+
+#ifndef slice_h__
+#define slice_h__
+
+#include <stdint.h>
+
+#include "tuning.h"
+
+#define SLICE_LANES 64
+
+typedef uint64_t Lanes;
+
+typedef struct {
+    // per switch (PB0-PB6)
+    Lanes state[7];		// PinState.state
+    Lanes count[7][16];		// PinState.count
+    Lanes bounces[7][8];	// PinState.bounces
+    Lanes counting[7];		// counting_switches
+    Lanes debounced[7];		// debounced_switches
+    Lanes long_press[7];	// long_press_switches
+    Lanes tap_hold[7];		// tap_hold_switches
+    Lanes tracked[7];		// long_press_tracked
+
+    // each lane's tuning
+    Lanes debounce_ticks[16];
+    Lanes long_press_ticks[16];
+    DialCurvePoint dial_curve[SLICE_LANES][DIAL_CURVE_POINTS];
+    // Counts stop at the long press time, so they only need as many
+    // planes as the longest one has bits.
+    int count_bits;
+
+    // dial
+    Lanes dial_moving, dial_position, dial_cw;
+    uint16_t last_detent_tick[SLICE_LANES];
+    // Steps of each lane's last detent, as input_update_dial() returns
+    // them.
+    int16_t dial_steps[SLICE_LANES];
+} Slice;
+
+// Like input_init() for every lane: lane n runs with tunings[n],
+// tap_hold[n] and long_press[n], and raw_pins[n] gives its dial's
+// starting position.
+void slice_init(Slice *s, const Tuning *tunings, const uint8_t *tap_hold, const uint8_t *long_press,
+                const uint8_t *raw_pins);
+// input_restart_debounce() for the given lanes.
+void slice_restart_debounce(Slice *s, Lanes lanes);
+// input_update() for every lane.  raw[i] holds pin PBi of every lane.
+// Returns the lanes that had work to do (where input_update() would
+// return nonzero).
+Lanes slice_update(Slice *s, const Lanes raw[7], uint16_t tick);
+// input_update_dial() for every lane.  Returns the lanes that finished
+// a detent, with their steps in dial_steps.
+Lanes slice_update_dial(Slice *s, uint16_t tick);
+
+// One lane's debounced_switches or long_press_switches.
+uint8_t slice_debounced(const Slice *s, int lane);
+uint8_t slice_long_press(const Slice *s, int lane);
+
+// Called for each lane's events, in the order input.c would make them
+// for that lane.
+void slice_event(int lane, uint8_t type, uint8_t value, uint16_t tick);
+
+#endif
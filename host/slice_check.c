@@ -0,0 +1,382 @@
+// Check the bit-sliced simulator (slice.c) against the firmware's own
+// debounce and dial code (src/input.c), and time them both.
+//
+// Usage: slice_check [options]
+//
+// Random pads are made up 64 at a time, each with its own random
+// tuning, tap-hold and long-press switches and pin trace: switches
+// that change now and then and bounce for a while when they do, and a
+// dial turned the same way.  Each batch runs through slice.c once, and then each pad
+// through input.c on its own.  After every tick, every pad's debounced
+// and long press states must be the same in both, and so must the
+// events, their values and ticks, and the dial steps.  The first
+// difference is printed and the exit status is 1.
+//
+// The two are then timed on the same traces, without the checking.
+//
+// Options:
+//   -b N    batches of 64 pads (default 16)
+//   -t N    ticks per pad (default 60000)
+//   -s N    random seed (default 1)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "input.h"
+#include "tuning.h"
+#include "slice.h"
+
+// The tuning input.c runs with.
+Tuning tuning;
+
+#define DialA 1
+#define DialB 5
+
+typedef struct {
+    uint8_t type, value;
+    uint16_t tick;
+    int16_t steps;
+} Event;
+
+typedef struct {
+    Event *events;
+    size_t count, capacity;
+} EventList;
+
+// Where the events go: one list per lane while checking, nowhere while
+// timing.
+static EventList *recording;
+static int scalar_lane;
+static unsigned long events_seen;
+
+static void record(EventList *list, uint8_t type, uint8_t value, uint16_t tick)
+{
+    events_seen++;
+    if (!list) {
+        return;
+    }
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->events = realloc(list->events, list->capacity * sizeof(Event));
+        if (!list->events) {
+            fprintf(stderr, "out of memory\n");
+            exit(2);
+        }
+    }
+    list->events[list->count].type = type;
+    list->events[list->count].value = value;
+    list->events[list->count].tick = tick;
+    list->events[list->count].steps = 0;
+    list->count++;
+}
+
+void slice_event(int lane, uint8_t type, uint8_t value, uint16_t tick)
+{
+    record(recording ? &recording[lane] : NULL, type, value, tick);
+}
+
+void input_event(uint8_t type, uint8_t value, uint16_t tick)
+{
+    record(recording ? &recording[scalar_lane] : NULL, type, value, tick);
+}
+
+// xorshift64*
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static unsigned rng_below(unsigned n)
+{
+    return (rng() >> 32) % n;
+}
+
+static void random_tuning(Tuning *t, uint8_t *tap_hold, uint8_t *long_press)
+{
+    memset(t, 0, sizeof(*t));
+    t->version = TUNING_VERSION;
+    t->tick_period_us = 1000;
+    t->timer0_clock_select = 0x03;
+    t->debounce_ticks = 1 + rng_below(rng_below(4) ? 30 : 255);
+    t->long_press_ticks = t->debounce_ticks + 1 + rng_below(rng_below(4) ? 1000 : 65535 - t->debounce_ticks);
+    for (int p = 0; p < DIAL_CURVE_POINTS; p++) {
+        if (rng_below(2)) {
+            t->dial_curve[p].within_ticks = rng_below(400);
+            t->dial_curve[p].steps = rng_below(6);
+        }
+    }
+    *tap_hold = rng() & 0x7f;
+    // mostly a keymap's few long-press switches, sometimes all of them
+    *long_press = rng_below(4) ? rng() & 0x7f : 0x7f;
+}
+
+// A lane's pins over a run.  Each pin holds a level for a random time,
+// then changes, bouncing for a random time first.  The dial pins change
+// in quadrature, a quarter step at a time, in a random direction.
+typedef struct {
+    uint32_t hold_left[7];	// ticks until the next change
+    uint32_t bounce_left[7];	// ticks of bouncing left
+    uint8_t level[7];		// the level it's settling to
+    uint8_t dial_phase, dial_cw;
+} Trace;
+
+static void trace_init(Trace *tr)
+{
+    for (int i = 0; i < 7; i++) {
+        tr->hold_left[i] = 1 + rng_below(500);
+        tr->bounce_left[i] = 0;
+        tr->level[i] = 1;
+    }
+    tr->dial_phase = 2;		// both open
+    tr->dial_cw = rng_below(2);
+}
+
+static void start_change(Trace *tr, int i)
+{
+    // mostly short bounces, sometimes long ones
+    tr->bounce_left[i] = rng_below(4) ? rng_below(8) : rng_below(60);
+    // quick taps, ordinary presses, and long holds
+    switch (rng_below(4)) {
+    case 0: tr->hold_left[i] = 1 + rng_below(20); break;
+    case 3: tr->hold_left[i] = 1 + rng_below(3000); break;
+    default: tr->hold_left[i] = 1 + rng_below(300); break;
+    }
+}
+
+static uint8_t trace_step(Trace *tr)
+{
+    uint8_t pins = 0;
+
+    for (int i = 0; i < 7; i++) {
+        if (i == DialB) {
+            continue;
+        }
+        if (!--tr->hold_left[i]) {
+            if (i == DialA) {
+                // A quarter step: 00 -> 01 -> 11 -> 10 as (A, B).
+                if (!rng_below(8)) tr->dial_cw ^= 1;
+                tr->dial_phase = (tr->dial_phase + (tr->dial_cw ? 1 : 3)) & 3;
+                tr->level[DialA] = (tr->dial_phase >> 1) & 1;
+                tr->level[DialB] = ((tr->dial_phase + 1) >> 1) & 1;
+                start_change(tr, DialB);
+            } else {
+                tr->level[i] ^= 1;
+            }
+            start_change(tr, i);
+            if (i == DialA && rng_below(2)) {
+                // turning steadily
+                tr->hold_left[i] = 1 + rng_below(40);
+            }
+        }
+    }
+    for (int i = 0; i < 7; i++) {
+        uint8_t level = tr->level[i];
+
+        if (tr->bounce_left[i]) {
+            tr->bounce_left[i]--;
+            level = rng() & 1;
+        }
+        pins |= level << i;
+    }
+    return pins;
+}
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-b batches] [-t ticks] [-s seed]\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long batches = 16, ticks = 60000, seed = 1;
+    double scalar_time = 0, slice_time = 0;
+    unsigned long scalar_events = 0, slice_events = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:t:s:")) != -1) {
+        switch (opt) {
+        case 'b': batches = strtoul(optarg, NULL, 0); break;
+        case 't': ticks = strtoul(optarg, NULL, 0); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || !batches || !ticks) {
+        usage(argv[0]);
+    }
+    rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    Lanes (*raw)[7] = malloc(ticks * sizeof(*raw));
+    uint8_t (*states)[SLICE_LANES][2] = malloc(ticks * sizeof(*states));
+    EventList lists[SLICE_LANES], scalar_list;
+    Tuning tunings[SLICE_LANES];
+    uint8_t tap_hold[SLICE_LANES], long_press[SLICE_LANES], first_pins[SLICE_LANES];
+    Trace traces[SLICE_LANES];
+    Slice *slice = malloc(sizeof(Slice));
+
+    if (!raw || !states || !slice) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    memset(lists, 0, sizeof(lists));
+    memset(&scalar_list, 0, sizeof(scalar_list));
+
+    for (unsigned long batch = 0; batch < batches; batch++) {
+        struct timespec start;
+
+        // Make up the pads.  Tick 0 is the pins input_init() sees.
+        for (int lane = 0; lane < SLICE_LANES; lane++) {
+            random_tuning(&tunings[lane], &tap_hold[lane], &long_press[lane]);
+            trace_init(&traces[lane]);
+            first_pins[lane] = 0x7f;
+        }
+        for (unsigned long t = 0; t < ticks; t++) {
+            memset(raw[t], 0, sizeof(raw[t]));
+            for (int lane = 0; lane < SLICE_LANES; lane++) {
+                uint8_t pins = trace_step(&traces[lane]);
+                for (int i = 0; i < 7; i++) {
+                    raw[t][i] |= (Lanes)((pins >> i) & 1) << lane;
+                }
+            }
+        }
+
+        // The sliced run, recording every lane's states and events.
+        recording = lists;
+        for (int lane = 0; lane < SLICE_LANES; lane++) {
+            lists[lane].count = 0;
+        }
+        slice_init(slice, tunings, tap_hold, long_press, first_pins);
+        for (unsigned long t = 0; t < ticks; t++) {
+            Lanes detents;
+
+            slice_update(slice, raw[t], (uint16_t)(t + 1));
+            detents = slice_update_dial(slice, (uint16_t)(t + 1));
+            for (int lane = 0; lane < SLICE_LANES; lane++) {
+                if ((detents >> lane) & 1) {
+                    lists[lane].events[lists[lane].count - 1].steps = slice->dial_steps[lane];
+                }
+                states[t][lane][0] = slice_debounced(slice, lane);
+                states[t][lane][1] = slice_long_press(slice, lane);
+            }
+        }
+
+        // Each pad through input.c, compared as it goes.  The firmware
+        // only follows the dial when something changed.
+        recording = &scalar_list;
+        scalar_lane = 0;
+        for (int lane = 0; lane < SLICE_LANES; lane++) {
+            uint8_t last_debounced, last_long;
+            size_t e = 0;
+
+            scalar_list.count = 0;
+            tuning = tunings[lane];
+            input_init(tap_hold[lane], long_press[lane], first_pins[lane]);
+            last_debounced = debounced_switches;
+            last_long = long_press_switches;
+            for (unsigned long t = 0; t < ticks; t++) {
+                uint8_t pins = 0;
+
+                for (int i = 0; i < 7; i++) {
+                    pins |= ((raw[t][i] >> lane) & 1) << i;
+                }
+                input_update(pins, (uint16_t)(t + 1));
+                if ((last_debounced ^ debounced_switches) | (last_long ^ long_press_switches)) {
+                    int16_t steps = input_update_dial((uint16_t)(t + 1));
+                    if (steps) {
+                        scalar_list.events[scalar_list.count - 1].steps = steps;
+                    }
+                }
+                last_debounced = debounced_switches;
+                last_long = long_press_switches;
+
+                for (; e < scalar_list.count; e++) {
+                    const Event *a = &scalar_list.events[e], *b = &lists[lane].events[e];
+                    if (e >= lists[lane].count || memcmp(a, b, sizeof(Event))) {
+                        printf("batch %lu lane %d tick %lu: event %zu is %02x/%u/%d, sliced %s%02x/%u/%d\n",
+                               batch, lane, t + 1, e, a->type, a->value, a->steps,
+                               e >= lists[lane].count ? "(none) " : "",
+                               b->type, b->value, b->steps);
+                        return 1;
+                    }
+                }
+                if (debounced_switches != states[t][lane][0] || long_press_switches != states[t][lane][1]) {
+                    printf("batch %lu lane %d tick %lu: debounced %02x long %02x, sliced %02x %02x\n",
+                           batch, lane, t + 1, debounced_switches, long_press_switches,
+                           states[t][lane][0], states[t][lane][1]);
+                    return 1;
+                }
+            }
+            if (scalar_list.count != lists[lane].count) {
+                printf("batch %lu lane %d: %zu events, sliced %zu\n",
+                       batch, lane, scalar_list.count, lists[lane].count);
+                return 1;
+            }
+        }
+
+        // Timed runs, the way a sweep would use them.
+        recording = NULL;
+        events_seen = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int lane = 0; lane < SLICE_LANES; lane++) {
+            uint8_t last_debounced, last_long;
+
+            tuning = tunings[lane];
+            input_init(tap_hold[lane], long_press[lane], first_pins[lane]);
+            last_debounced = debounced_switches;
+            last_long = long_press_switches;
+            for (unsigned long t = 0; t < ticks; t++) {
+                uint8_t pins = 0;
+
+                for (int i = 0; i < 7; i++) {
+                    pins |= ((raw[t][i] >> lane) & 1) << i;
+                }
+                input_update(pins, (uint16_t)(t + 1));
+                if ((last_debounced ^ debounced_switches) | (last_long ^ long_press_switches)) {
+                    input_update_dial((uint16_t)(t + 1));
+                }
+                last_debounced = debounced_switches;
+                last_long = long_press_switches;
+            }
+        }
+        scalar_time += seconds_since(&start);
+        scalar_events += events_seen;
+
+        events_seen = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        slice_init(slice, tunings, tap_hold, long_press, first_pins);
+        for (unsigned long t = 0; t < ticks; t++) {
+            slice_update(slice, raw[t], (uint16_t)(t + 1));
+            slice_update_dial(slice, (uint16_t)(t + 1));
+        }
+        slice_time += seconds_since(&start);
+        slice_events += events_seen;
+    }
+
+    printf("%lu pads x %lu ticks, %lu events: all the same\n",
+           batches * SLICE_LANES, ticks, scalar_events);
+    printf("input.c  %8.2f M pad-ticks/s\n", batches * SLICE_LANES * ticks / scalar_time / 1e6);
+    printf("slice.c  %8.2f M pad-ticks/s  (%.1fx)\n", batches * SLICE_LANES * ticks / slice_time / 1e6,
+           scalar_time / slice_time);
+    if (scalar_events != slice_events) {
+        printf("but the timed runs made %lu and %lu events\n", scalar_events, slice_events);
+        return 1;
+    }
+    return 0;
+}
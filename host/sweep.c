@@ -0,0 +1,371 @@
+// Sweep the timing parameters over a corpus of pin captures, to choose
+// them from data rather than by feel.
+//
+// Usage: sweep [options] capture...
+//
+// Every combination of the tick periods, debounce times and long press
+// times given is run over every capture, through the firmware's
+// debounce and dial code as replay does, and scored the same way:
+// latency from the first pin edge, intended changes missed, and
+// spurious events.  The cost is counted too, as the ticks per second in
+// which input_update() had work to do.  The combinations that nothing
+// else beats on all of these at once (the Pareto front) are listed.
+//
+// Combinations are shared out over worker processes, one per core by
+// default.  (input.c keeps its state in globals, so each worker is a
+// process of its own.)
+//
+// Intended changes are worked out with a fixed settle time (-s), so
+// that every combination is held to the same standard.  Long presses
+// are only checked given -H: an intended press that lasted that long
+// was meant as a long press, and a shorter one wasn't.
+//
+// Lists are comma separated values or FROM:TO:STEP ranges, eg.
+// "-d 2:20:2 -t 250,500,1000".
+//
+// Options:
+//   -c D0,D1,...  channels carrying PB0-PB6 in a CSV or VCD capture
+//                 (default D0,D1,D2,D3,D4,D5,D6)
+//   -r HZ         CSV sample rate, if the file doesn't give it
+//   -t LIST       tick periods in microseconds (default 1000)
+//   -d LIST       debounce times in ms (default 12)
+//   -l LIST       long press times in ms (default 655)
+//   -a MS:STEPS   a dial curve point; repeat for up to four
+//   -T MASK       tap-hold switches, as a hex mask of PB pins
+//   -s MS         settle time for intended changes (default 5)
+//   -D US         dial sampling period in microseconds, as
+//                 DIAL_SAMPLE_US (default 256); 0 samples the dial
+//                 with the other switches, once per tick
+//   -H MS         check long presses against presses held this long
+//   -j N          worker processes (default: one per core)
+//   -A            list every combination, not just the front
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "input.h"
+#include "tuning.h"
+#include "pinlog.h"
+#include "sampler.h"
+#include "score.h"
+
+// The tuning input.c runs with.
+Tuning tuning;
+
+#define MAX_VALUES 256
+
+typedef struct {
+    double values[MAX_VALUES];
+    int count;
+} List;
+
+// One combination's totals over the corpus.
+typedef struct {
+    double tick_us, debounce_ms, long_press_ms;
+    int valid;			// the times fit in the tuning
+    int done;
+    unsigned long ticks, busy_ticks;
+    unsigned long changes, missed, spurious, latencies;
+    double latency_sum, latency_max;
+    unsigned long missed_holds, false_holds, hold_latencies;
+    double hold_latency_sum, hold_latency_max;
+    int front;
+} Result;
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-c channels] [-r hz] [-t list] [-d list] [-l list] [-a ms:steps]\n"
+            "          [-T mask] [-s ms] [-D us] [-H ms] [-j n] [-A] capture...\n", name);
+    exit(2);
+}
+
+// "1,2,4" or "2:20:2"
+static int parse_list(const char *text, List *list)
+{
+    double from, to, step;
+    char *copy, *p, *item;
+
+    list->count = 0;
+    if (sscanf(text, "%lf:%lf:%lf", &from, &to, &step) == 3) {
+        if (step <= 0 || to < from) return -1;
+        for (int i = 0; from + i * step <= to + step * 1e-9; i++) {
+            if (list->count == MAX_VALUES) return -1;
+            list->values[list->count++] = from + i * step;
+        }
+        return 0;
+    }
+    copy = p = strdup(text);
+    while ((item = strsep(&p, ","))) {
+        char *end;
+        double v = strtod(item, &end);
+        if (end == item || *end || list->count == MAX_VALUES) {
+            free(copy);
+            return -1;
+        }
+        list->values[list->count++] = v;
+    }
+    free(copy);
+    return 0;
+}
+
+// Times in ticks, rounded to the nearest tick like MsToTicks in
+// main.c.  Returns 0 if they don't fit (see tuning_valid).
+static int set_tuning(const Result *r, const double *curve_ms, int dial_points)
+{
+    tuning.tick_period_us = r->tick_us;
+    tuning.debounce_ticks = lround(r->debounce_ms * 1000 / r->tick_us);
+    tuning.long_press_ticks = lround(r->long_press_ms * 1000 / r->tick_us);
+    for (int i = 0; i < dial_points; i++) {
+        tuning.dial_curve[i].within_ticks = lround(curve_ms[i] * 1000 / r->tick_us);
+    }
+    return r->tick_us <= 65535 && r->debounce_ms * 1000 / r->tick_us <= 255 &&
+        r->long_press_ms * 1000 / r->tick_us <= 65535 &&
+        tuning.long_press_ticks > tuning.debounce_ticks;
+}
+
+static void run(Result *r, const PinLog *logs, int log_count, double dial_period,
+                uint8_t tap_hold, double settle, double hold)
+{
+    for (int i = 0; i < log_count; i++) {
+        Score score;
+
+        score_capture(&logs[i], r->tick_us / 1e6, dial_period, tap_hold, settle, hold, &score);
+        r->ticks += score.ticks;
+        r->busy_ticks += score.busy_ticks;
+        r->changes += score.change_count;
+        r->missed += score.missed;
+        r->spurious += score.spurious;
+        r->latencies += score.latencies;
+        r->latency_sum += score.latency_sum;
+        if (score.latency_max > r->latency_max) r->latency_max = score.latency_max;
+        r->missed_holds += score.missed_holds;
+        r->false_holds += score.false_holds;
+        r->hold_latencies += score.hold_latencies;
+        r->hold_latency_sum += score.hold_latency_sum;
+        if (score.hold_latency_max > r->hold_latency_max) r->hold_latency_max = score.hold_latency_max;
+        score_free(&score);
+    }
+}
+
+// What the front is chosen on; all to be as small as possible.
+#define OBJECTIVES 4
+
+static void objectives(const Result *r, double seconds, double *o)
+{
+    o[0] = r->latencies ? r->latency_sum / r->latencies : INFINITY;
+    o[1] = r->missed + r->spurious + r->missed_holds + r->false_holds;
+    o[2] = r->busy_ticks / seconds;
+    o[3] = r->hold_latencies ? r->hold_latency_sum / r->hold_latencies : INFINITY;
+}
+
+// a is at least as good as b on everything, and better on something
+static int dominates(const double *a, const double *b)
+{
+    int better = 0;
+
+    for (int i = 0; i < OBJECTIVES; i++) {
+        if (a[i] > b[i]) return 0;
+        if (a[i] < b[i]) better = 1;
+    }
+    return better;
+}
+
+static int by_latency(const void *a, const void *b)
+{
+    const Result *ra = a, *rb = b;
+    double la = ra->latencies ? ra->latency_sum / ra->latencies : INFINITY;
+    double lb = rb->latencies ? rb->latency_sum / rb->latencies : INFINITY;
+
+    if (la != lb) return la < lb ? -1 : 1;
+    if (ra->tick_us != rb->tick_us) return ra->tick_us > rb->tick_us ? -1 : 1;
+    if (ra->debounce_ms != rb->debounce_ms) return ra->debounce_ms < rb->debounce_ms ? -1 : 1;
+    return ra->long_press_ms < rb->long_press_ms ? -1 : ra->long_press_ms > rb->long_press_ms;
+}
+
+int main(int argc, char **argv)
+{
+    const char *names[7] = { "D0", "D1", "D2", "D3", "D4", "D5", "D6" };
+    char *channels = NULL;
+    double samplerate = 0, settle_ms = 5, hold_ms = 0, seconds = 0, dial_us = DIAL_SAMPLE_US;
+    double curve_ms[DIAL_CURVE_POINTS];
+    List ticks = { { 1000 }, 1 }, debounces = { { 12 }, 1 }, long_presses = { { 655 }, 1 };
+    unsigned long tap_hold = 0;
+    int dial_points = 0, all = 0, opt, log_count, combos, workers, valid = 0, front = 0;
+    struct timespec started, finished;
+    Result *results;
+    PinLog *logs;
+
+    memset(&tuning, 0, sizeof(tuning));
+    tuning.version = TUNING_VERSION;
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "c:r:t:d:l:a:T:s:D:H:j:A")) != -1) {
+        double ms;
+        unsigned steps;
+
+        switch (opt) {
+        case 'c': channels = optarg; break;
+        case 'r': samplerate = atof(optarg); break;
+        case 't': if (parse_list(optarg, &ticks)) usage(argv[0]); break;
+        case 'd': if (parse_list(optarg, &debounces)) usage(argv[0]); break;
+        case 'l': if (parse_list(optarg, &long_presses)) usage(argv[0]); break;
+        case 'T': tap_hold = strtoul(optarg, NULL, 16) & 0x7f; break;
+        case 's': settle_ms = atof(optarg); break;
+        case 'D': dial_us = atof(optarg); break;
+        case 'H': hold_ms = atof(optarg); break;
+        case 'j': workers = atoi(optarg); break;
+        case 'A': all = 1; break;
+        case 'a':
+            if (dial_points == DIAL_CURVE_POINTS || sscanf(optarg, "%lf:%u", &ms, &steps) != 2 || steps > 255) {
+                usage(argv[0]);
+            }
+            curve_ms[dial_points] = ms;
+            tuning.dial_curve[dial_points].steps = steps;
+            dial_points++;
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind == argc || workers < 1 || dial_us < 0) {
+        usage(argv[0]);
+    }
+    if (channels) {
+        char *p = channels;
+        for (int i = 0; i < 7; i++) {
+            names[i] = p ? strsep(&p, ",") : "";
+        }
+    }
+    for (int i = 0; i < ticks.count; i++) {
+        if (ticks.values[i] <= 0) usage(argv[0]);
+    }
+
+    log_count = argc - optind;
+    logs = calloc(log_count, sizeof(PinLog));
+    for (int i = 0; i < log_count; i++) {
+        if (!logs || pinlog_read(argv[optind + i], names, samplerate, &logs[i])) {
+            return 2;
+        }
+        seconds += logs[i].end;
+    }
+    if (seconds <= 0) {
+        fprintf(stderr, "%s: the captures are empty\n", argv[0]);
+        return 2;
+    }
+
+    // Results are written by the workers, straight into memory shared
+    // with this process.
+    combos = ticks.count * debounces.count * long_presses.count;
+    results = mmap(NULL, combos * sizeof(Result), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        return 2;
+    }
+    for (int i = 0; i < combos; i++) {
+        Result *r = &results[i];
+
+        memset(r, 0, sizeof(*r));
+        r->tick_us = ticks.values[i / (debounces.count * long_presses.count)];
+        r->debounce_ms = debounces.values[i / long_presses.count % debounces.count];
+        r->long_press_ms = long_presses.values[i % long_presses.count];
+        r->valid = set_tuning(r, curve_ms, dial_points);
+        valid += r->valid;
+    }
+    if (workers > valid) {
+        workers = valid ? valid : 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    fflush(stdout);
+    for (int w = 0; w < workers; w++) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            perror("fork");
+            return 2;
+        }
+        if (pid == 0) {
+            // Worker w takes every workers'th combination, so the
+            // expensive short tick periods are spread over all of them.
+            for (int i = w; i < combos; i += workers) {
+                if (results[i].valid) {
+                    set_tuning(&results[i], curve_ms, dial_points);
+                    run(&results[i], logs, log_count, dial_us / 1e6, tap_hold, settle_ms / 1000,
+                        hold_ms / 1000);
+                    results[i].done = 1;
+                }
+            }
+            _exit(0);
+        }
+    }
+    for (int w = 0; w < workers; w++) {
+        int status;
+
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            fprintf(stderr, "%s: a worker failed\n", argv[0]);
+            return 2;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    // The Pareto front.
+    for (int i = 0; i < combos; i++) {
+        double oi[OBJECTIVES], oj[OBJECTIVES];
+
+        if (!results[i].done) continue;
+        objectives(&results[i], seconds, oi);
+        results[i].front = 1;
+        for (int j = 0; j < combos && results[i].front; j++) {
+            if (j == i || !results[j].done) continue;
+            objectives(&results[j], seconds, oj);
+            if (dominates(oj, oi)) results[i].front = 0;
+        }
+        front += results[i].front;
+    }
+    qsort(results, combos, sizeof(Result), by_latency);
+
+    // The intended changes don't depend on the combination.
+    printf("# %d captures, %.3f s, %lu intended changes\n", log_count, seconds,
+           results[0].done ? results[0].changes : 0);
+    printf("# %d of %d combinations on the front; %d run by %d workers in %.3f s\n",
+           front, combos, valid, workers,
+           (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9);
+    printf("# tick_us  debounce_ms  long_ms   latency_ms avg/max   missed spurious");
+    if (hold_ms > 0) {
+        printf("  holds missed/false  hold_ms avg/max");
+    }
+    printf("  ticks/s  busy/s\n");
+    for (int i = 0; i < combos; i++) {
+        const Result *r = &results[i];
+
+        if (!r->done || (!all && !r->front)) continue;
+        printf("%c%7g  %11g  %7g", r->front ? ' ' : '-', r->tick_us, r->debounce_ms, r->long_press_ms);
+        if (r->latencies) {
+            printf("  %9.3f %9.3f", r->latency_sum / r->latencies * 1000, r->latency_max * 1000);
+        } else {
+            printf("  %9s %9s", "-", "-");
+        }
+        printf("  %7lu %8lu", r->missed, r->spurious);
+        if (hold_ms > 0) {
+            printf("  %12lu %5lu", r->missed_holds, r->false_holds);
+            if (r->hold_latencies) {
+                printf("  %7.1f %7.1f", r->hold_latency_sum / r->hold_latencies * 1000,
+                       r->hold_latency_max * 1000);
+            } else {
+                printf("  %7s %7s", "-", "-");
+            }
+        }
+        printf("  %7.0f %7.1f\n", r->ticks / seconds, r->busy_ticks / seconds);
+    }
+    if (combos > valid) {
+        fprintf(stderr, "%s: %d combinations skipped; their times don't fit in the tuning\n",
+                argv[0], combos - valid);
+    }
+    return 0;
+}
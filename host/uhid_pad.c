@@ -0,0 +1,393 @@
+// A virtual volumepad: play a pin capture through the firmware's input
+// and keymap code (src/input.c and src/actions.c, built for the host)
+// and publish the reports it sends through /dev/uhid, so the kernel's
+// HID and input layers see the same report descriptors and the same
+// reports as from the real device.
+//
+// Usage: uhid_pad [options] capture
+//
+// The capture is read as by replay (see pinlog.h), and sampled once per
+// tick.  Each report goes out on the next poll of its endpoint, as the
+// host would collect it from the device, at the wall-clock time it
+// would arrive.  Every event the kernel then produces on the evdev
+// nodes of the virtual devices is listed with its timestamp and its
+// latency from the report behind it.  The devices are the ones the
+// firmware built from the same keymap has: media, and keyboard only
+// if the keymap has keyboard keys or text (see keymap_features.h).
+//
+// Needs write access to /dev/uhid and read access to /dev/input/event*
+// (usually root).  With -n, nothing is created and the reports are
+// just listed, with their times.
+//
+// Options (the defaults are the firmware's):
+//   -c D0,D1,...  channels carrying PB0-PB6 in a CSV or VCD capture
+//                 (default D0,D1,D2,D3,D4,D5,D6)
+//   -r HZ         CSV sample rate, if the file doesn't give it
+//   -t US         tick period in microseconds (default 1000)
+//   -d MS         debounce time (default 12)
+//   -l MS         long press time (default 655)
+//   -a MS:STEPS   a dial curve point; repeat for up to four
+//   -D US         dial sampling period in microseconds, as
+//                 DIAL_SAMPLE_US (default 256); 0 samples the dial
+//                 with the other switches, once per tick
+//   -n            list the reports without creating any devices
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+#define PROGMEM
+#include "usb_report_desc.h"
+#include "tuning.h"
+#include "pinlog.h"
+#include "pad.h"
+#include "sampler.h"
+
+// The tuning input.c runs with.
+Tuning tuning;
+
+// A device the firmware doesn't have has no descriptor.
+static const struct {
+    const char *name;
+    const char *label;
+    const uint8_t *desc;
+    size_t desc_size;
+} devices[PAD_DEVICES] = {
+#ifdef USB_KEYBOARD_INTERFACE
+    { "volumepad keyboard", "keyboard", keyboard_hid_report_desc, sizeof(keyboard_hid_report_desc) },
+#else
+    { "volumepad keyboard", "keyboard", NULL, 0 },
+#endif
+    { "volumepad media", "media", media_hid_report_desc, sizeof(media_hid_report_desc) },
+};
+
+// The firmware's USB IDs, from usb_keyboard.c.
+#define VENDOR_ID	0x16C0
+#define PRODUCT_ID	0x047C
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int uhid_write(int fd, const struct uhid_event *ev)
+{
+    ssize_t n = write(fd, ev, sizeof(*ev));
+
+    if (n != sizeof(*ev)) {
+        perror("/dev/uhid");
+        return -1;
+    }
+    return 0;
+}
+
+static int uhid_create(int device)
+{
+    struct uhid_event ev;
+    int fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+
+    if (fd < 0) {
+        perror("/dev/uhid");
+        return -1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_CREATE2;
+    snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "%s", devices[device].name);
+    memcpy(ev.u.create2.rd_data, devices[device].desc, devices[device].desc_size);
+    ev.u.create2.rd_size = devices[device].desc_size;
+    ev.u.create2.bus = BUS_USB;
+    ev.u.create2.vendor = VENDOR_ID;
+    ev.u.create2.product = PRODUCT_ID;
+    if (uhid_write(fd, &ev)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void uhid_destroy(int fd)
+{
+    struct uhid_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_DESTROY;
+    uhid_write(fd, &ev);
+    close(fd);
+}
+
+#define MAX_NODES 8
+
+typedef struct {
+    int fd;
+    int device;
+    char path[300];
+} Node;
+
+// Open the evdev nodes the kernel made for our devices, found by name.
+// The input layer may add a suffix (eg. "Consumer Control"), so the
+// names only have to start with ours.
+static int find_nodes(Node *nodes)
+{
+    int count = 0;
+    DIR *dir = opendir("/dev/input");
+    struct dirent *d;
+
+    if (!dir) {
+        return 0;
+    }
+    while ((d = readdir(dir)) && count < MAX_NODES) {
+        char name[256] = "";
+        int fd, clock = CLOCK_MONOTONIC;
+
+        if (strncmp(d->d_name, "event", 5)) continue;
+        snprintf(nodes[count].path, sizeof(nodes[count].path), "/dev/input/%s", d->d_name);
+        fd = open(nodes[count].path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) continue;
+        ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name);
+        for (int i = 0; i < PAD_DEVICES; i++) {
+            if (devices[i].desc && !strncmp(name, devices[i].name, strlen(devices[i].name))) {
+                ioctl(fd, EVIOCSCLOCKID, &clock);
+                nodes[count].fd = fd;
+                nodes[count].device = i;
+                count++;
+                fd = -1;
+                break;
+            }
+        }
+        if (fd >= 0) close(fd);
+    }
+    closedir(dir);
+    return count;
+}
+
+static void print_report(double start, const PadReport *r)
+{
+    printf("  %11.3f  %-8s", (r->time - start) * 1000, devices[r->device].label);
+    for (int i = 0; i < PAD_REPORT_SIZE; i++) {
+        printf(" %02x", r->data[i]);
+    }
+    printf("  (tick at %.3f)\n", (r->tick - start) * 1000);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-c channels] [-r hz] [-t us] [-d ms] [-l ms] [-a ms:steps]\n"
+            "          [-D us] [-n] capture\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *names[7] = { "D0", "D1", "D2", "D3", "D4", "D5", "D6" };
+    char *channels = NULL;
+    double samplerate = 0, tick_us = 1000, debounce_ms = 12, long_press_ms = 655, dial_us = DIAL_SAMPLE_US;
+    double period, start, finish, written[PAD_DEVICES] = { 0, 0 };
+    double latency_sum = 0, latency_min = INFINITY, latency_max = 0;
+    double curve_ms[DIAL_CURVE_POINTS];
+    unsigned long ticks, dial_points = 0, input_events = 0;
+    int dry_run = 0, opt, fds[PAD_DEVICES], device_count = 0, node_count, tries;
+    Node nodes[MAX_NODES];
+    PadReport *reports;
+    size_t next, report_count;
+    PinLog log;
+
+    memset(&tuning, 0, sizeof(tuning));
+    tuning.version = TUNING_VERSION;
+
+    while ((opt = getopt(argc, argv, "c:r:t:d:l:a:D:n")) != -1) {
+        double ms;
+        unsigned steps;
+
+        switch (opt) {
+        case 'c': channels = optarg; break;
+        case 'r': samplerate = atof(optarg); break;
+        case 't': tick_us = atof(optarg); break;
+        case 'd': debounce_ms = atof(optarg); break;
+        case 'l': long_press_ms = atof(optarg); break;
+        case 'D': dial_us = atof(optarg); break;
+        case 'n': dry_run = 1; break;
+        case 'a':
+            if (dial_points == DIAL_CURVE_POINTS || sscanf(optarg, "%lf:%u", &ms, &steps) != 2 || steps > 255) {
+                usage(argv[0]);
+            }
+            curve_ms[dial_points] = ms;
+            tuning.dial_curve[dial_points].steps = steps;
+            dial_points++;
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc || tick_us <= 0 || dial_us < 0) {
+        usage(argv[0]);
+    }
+    if (channels) {
+        char *p = channels;
+        for (int i = 0; i < 7; i++) {
+            names[i] = p ? strsep(&p, ",") : "";
+        }
+    }
+
+    // Times in ticks, as in replay.
+    period = tick_us / 1e6;
+    tuning.tick_period_us = tick_us;
+    tuning.debounce_ticks = lround(debounce_ms * 1000 / tick_us);
+    tuning.long_press_ticks = lround(long_press_ms * 1000 / tick_us);
+    for (unsigned long i = 0; i < dial_points; i++) {
+        tuning.dial_curve[i].within_ticks = lround(curve_ms[i] * 1000 / tick_us);
+    }
+    if (debounce_ms * 1000 / tick_us > 255 || long_press_ms * 1000 / tick_us > 65535 ||
+        tuning.long_press_ticks <= tuning.debounce_ticks) {
+        fprintf(stderr, "%s: times don't fit in the tuning (see tuning_valid)\n", argv[0]);
+        return 2;
+    }
+
+    if (pinlog_read(argv[optind], names, samplerate, &log)) {
+        return 2;
+    }
+
+    // Work out every report first, the way run() in main.c does each
+    // tick; playing them back then only has to keep time.
+    ticks = (unsigned long)(log.end / period);
+    report_count = pad_run(&log, period, dial_us / 1e6, &reports);
+    pinlog_free(&log);
+
+    printf("# %s: %.3f s, %lu ticks of %g us, %zu reports",
+           argv[optind], log.end, ticks, tick_us, report_count);
+    if (pad_overwritten[PadKeyboard] || pad_overwritten[PadMedia]) {
+        printf(", %lu keyboard and %lu media lost to a full queue",
+               pad_overwritten[PadKeyboard], pad_overwritten[PadMedia]);
+    }
+    printf("\n");
+    printf("#    time_ms  report\n");
+
+    if (dry_run) {
+        for (next = 0; next < report_count; next++) {
+            print_report(0, &reports[next]);
+        }
+        free(reports);
+        return 0;
+    }
+
+    for (int i = 0; i < PAD_DEVICES; i++) {
+        fds[i] = -1;
+        if (!devices[i].desc) {
+            continue;
+        }
+        fds[i] = uhid_create(i);
+        if (fds[i] < 0) {
+            while (i--) if (fds[i] >= 0) uhid_destroy(fds[i]);
+            return 2;
+        }
+        device_count++;
+    }
+    // udev takes a moment to make the nodes.
+    node_count = 0;
+    for (tries = 0; tries < 40; tries++) {
+        for (int i = 0; i < node_count; i++) close(nodes[i].fd);
+        node_count = find_nodes(nodes);
+        if (node_count >= device_count) break;
+        usleep(50000);
+    }
+    if (!node_count) {
+        fprintf(stderr, "%s: no event nodes for the devices (are you root?)\n", argv[0]);
+    }
+    for (int i = 0; i < node_count; i++) {
+        printf("# %s: %s\n", nodes[i].path, devices[nodes[i].device].name);
+    }
+    printf("#    time_ms  evdev     type code value  latency_ms\n");
+
+    // Give anything listening a moment to open the devices too.
+    start = now() + 0.5;
+    finish = start + log.end;
+    if (report_count && reports[report_count - 1].time > log.end) {
+        finish = start + reports[report_count - 1].time;
+    }
+    finish += 0.1;
+    next = 0;
+    for (;;) {
+        struct pollfd pfds[MAX_NODES + PAD_DEVICES];
+        double t = now(), due;
+        int timeout, n = 0;
+
+        if (next < report_count && start + reports[next].time <= t) {
+            struct uhid_event ev;
+            const PadReport *r = &reports[next++];
+
+            memset(&ev, 0, sizeof(ev));
+            ev.type = UHID_INPUT2;
+            ev.u.input2.size = PAD_REPORT_SIZE;
+            memcpy(ev.u.input2.data, r->data, PAD_REPORT_SIZE);
+            written[r->device] = now();
+            if (uhid_write(fds[r->device], &ev)) break;
+            print_report(start, r);
+            continue;
+        }
+        // After the last report, wait a little for its events.
+        due = next < report_count ? start + reports[next].time : finish;
+        if (next == report_count && t >= due) break;
+        timeout = (int)ceil((due - t) * 1000);
+
+        for (int i = 0; i < node_count; i++) {
+            pfds[n].fd = nodes[i].fd;
+            pfds[n++].events = POLLIN;
+        }
+        // The uhid fds have to be read, or the kernel's queue fills.
+        // (poll() skips the -1 of a device we don't have.)
+        for (int i = 0; i < PAD_DEVICES; i++) {
+            pfds[n].fd = fds[i];
+            pfds[n++].events = POLLIN;
+        }
+        if (poll(pfds, n, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (!(pfds[i].revents & POLLIN)) continue;
+            if (i >= node_count) {
+                struct uhid_event ev;
+                if (read(pfds[i].fd, &ev, sizeof(ev)) < 0) perror("/dev/uhid");
+                continue;
+            }
+            struct input_event ie;
+            while (read(pfds[i].fd, &ie, sizeof(ie)) == sizeof(ie)) {
+                double when = ie.input_event_sec + ie.input_event_usec / 1e6;
+                double latency = when - written[nodes[i].device];
+
+                if (ie.type == EV_SYN) continue;
+                printf("  %11.3f  %-8s %4u %4u %5d  %10.3f\n", (when - start) * 1000,
+                       devices[nodes[i].device].label, ie.type, ie.code, ie.value,
+                       latency * 1000);
+                latency_sum += latency;
+                if (latency < latency_min) latency_min = latency;
+                if (latency > latency_max) latency_max = latency;
+                input_events++;
+            }
+        }
+    }
+
+    printf("# %zu reports, %lu input events", next, input_events);
+    if (input_events) {
+        printf(", latency %.3f min, %.3f avg, %.3f max (ms)",
+               latency_min * 1000, latency_sum / input_events * 1000, latency_max * 1000);
+    }
+    printf("\n");
+
+    for (int i = 0; i < node_count; i++) close(nodes[i].fd);
+    for (int i = 0; i < PAD_DEVICES; i++) if (fds[i] >= 0) uhid_destroy(fds[i]);
+    free(reports);
+    return 0;
+}
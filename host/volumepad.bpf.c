@@ -0,0 +1,224 @@
+// HID-BPF program that batches the volumepad's volume key reports in
+// the kernel, before they reach the input layer.
+//
+// Every dial detent arrives on the media interface as two reports, a
+// volume up or down press and its release, and each one wakes the
+// input layer, the compositor and the audio client.  A detent that
+// comes after a quiet spell goes straight through, so turning the dial
+// by one click is as quick as ever.  Detents that follow within
+// COALESCE_WINDOW_MS are held back, presses and releases both, and
+// counted (up minus down).  When the window closes, the count is played
+// into the input layer as that many press and release pairs, one
+// right after another.
+//
+// This is batching, not merging: a consumer key can't say "n steps",
+// so every step that's left is still two reports.  They arrive in one
+// burst per window, which a listener that drains its queue handles in
+// one go, and steps in opposite directions cancel out.
+//
+// Reports with any other key in them go through untouched.
+//
+// Built and loaded with udev-hid-bpf (see "Coalescing volume reports"
+// in README.md), which provides the headers included here and attaches
+// the program to the pad by VID/PID.  Needs a 6.11 or later kernel, for
+// bpf_wq and hid_bpf_input_report().
+
+#include "vmlinux.h"
+#include "hid_bpf.h"
+#include "hid_bpf_helpers.h"
+#include <bpf/bpf_tracing.h>
+
+// VENDOR_ID and PRODUCT_ID in usb_keyboard.c
+#define VOLUMEPAD_VID	0x16C0
+#define VOLUMEPAD_PID	0x047C
+
+HID_BPF_CONFIG(
+    HID_DEVICE(BUS_USB, HID_GROUP_GENERIC, VOLUMEPAD_VID, VOLUMEPAD_PID)
+);
+
+// The media interface's report: four 16-bit consumer usages, no report
+// ID (media_hid_report_desc in usb_report_desc.h).
+#define MEDIA_REPORT_SIZE	8
+#define MEDIA_RDESC_SIZE	25
+
+// KEY_VOLUME_UP and KEY_VOLUME_DOWN in keymap.h, without the MediaKey
+// flag.
+#define USAGE_VOLUME_UP		0xe9
+#define USAGE_VOLUME_DOWN	0xea
+
+// How long after a detent the next ones are held back.  The media
+// endpoint is polled every 8 ms, so a detent's press and release are
+// at least 16 ms apart on the wire.
+#define COALESCE_WINDOW_MS	40
+#define COALESCE_WINDOW_NS	(COALESCE_WINDOW_MS * 1000000ULL)
+
+// Most steps played back at the end of one window (a bound for the
+// verifier).  The rest are put back and played one window later.
+#define MAX_FLUSH_STEPS		32
+
+struct flush {
+    struct bpf_timer timer;	// fires when the window closes
+    struct bpf_wq work;		// plays the held-back steps back
+    __u32 hid;			// the device, for hid_bpf_allocate_context
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct flush);
+} flush_map SEC(".maps");
+
+// Held-back steps: positive for volume up, negative for down.
+static int pending_steps;
+// End of the current window, from bpf_ktime_get_ns().
+static __u64 window_end;
+// The volume usage the pad reports pressed, or 0, and whether that
+// press went through (if not, neither does its release).
+static __u16 held_usage;
+static bool held_passed;
+static bool flush_ready, flush_armed;
+// Set while the work item plays steps back, so they aren't coalesced
+// again on their way through.
+static bool replaying;
+
+static int flush_work(void *map, int *key, void *value)
+{
+    struct flush *f = value;
+    struct hid_bpf_ctx *ctx;
+    __u8 report[MEDIA_REPORT_SIZE] = {};
+    __u16 usage = USAGE_VOLUME_UP;
+    int steps, sign = 1, i;
+
+    flush_armed = false;
+    steps = __sync_lock_test_and_set(&pending_steps, 0);
+    if (!steps) {
+        return 0;
+    }
+    if (steps < 0) {
+        usage = USAGE_VOLUME_DOWN;
+        sign = -1;
+        steps = -steps;
+    }
+    if (steps > MAX_FLUSH_STEPS) {
+        // Put the rest back for the next window, which starts now
+        // whether or not more detents come.
+        __sync_fetch_and_add(&pending_steps, sign * (steps - MAX_FLUSH_STEPS));
+        steps = MAX_FLUSH_STEPS;
+        flush_armed = true;
+        bpf_timer_start(&f->timer, COALESCE_WINDOW_NS, 0);
+    }
+
+    ctx = hid_bpf_allocate_context(f->hid);
+    if (!ctx) {
+        return 0;
+    }
+    replaying = true;
+    for (i = 0; i < steps && i < MAX_FLUSH_STEPS; i++) {
+        report[0] = usage;
+        hid_bpf_input_report(ctx, HID_INPUT_REPORT, report, sizeof(report));
+        report[0] = 0;
+        hid_bpf_input_report(ctx, HID_INPUT_REPORT, report, sizeof(report));
+    }
+    replaying = false;
+    hid_bpf_release_context(ctx);
+
+    // Detents that keep coming are coalesced into the next window.
+    window_end = bpf_ktime_get_ns() + COALESCE_WINDOW_NS;
+    return 0;
+}
+
+// Timers can't sleep, and hid_bpf_input_report() does, so the timer
+// only hands over to the work item.
+static int flush_timer(void *map, int *key, struct bpf_timer *timer)
+{
+    struct flush *f = bpf_map_lookup_elem(map, key);
+
+    if (f) {
+        bpf_wq_start(&f->work, 0);
+    }
+    return 0;
+}
+
+static int flush_init(struct hid_bpf_ctx *hctx, struct flush *f)
+{
+    f->hid = hctx->hid->id;
+    if (bpf_timer_init(&f->timer, &flush_map, CLOCK_MONOTONIC) ||
+        bpf_timer_set_callback(&f->timer, flush_timer) ||
+        bpf_wq_init(&f->work, &flush_map, 0) ||
+        bpf_wq_set_callback(&f->work, flush_work, 0)) {
+        return -1;
+    }
+    flush_ready = true;
+    return 0;
+}
+
+SEC(HID_BPF_DEVICE_EVENT)
+int BPF_PROG(volumepad_coalesce_event, struct hid_bpf_ctx *hctx)
+{
+    __u8 *data = hid_bpf_get_data(hctx, 0, MEDIA_REPORT_SIZE);
+    __u32 key = 0;
+    struct flush *f;
+    __u16 usage = 0;
+    __u64 now;
+    int keys = 0, i;
+
+    if (!data || replaying) {
+        return 0;
+    }
+    for (i = 0; i < 4; i++) {
+        __u16 u = data[2 * i] | (data[2 * i + 1] << 8);
+        if (u) {
+            usage = u;
+            keys++;
+        }
+    }
+
+    if (!keys && held_usage) {
+        // a volume key's release
+        held_usage = 0;
+        return held_passed ? 0 : -1;
+    }
+    if (keys != 1 || (usage != USAGE_VOLUME_UP && usage != USAGE_VOLUME_DOWN)) {
+        held_usage = 0;
+        return 0;
+    }
+    if (usage == held_usage) {
+        // the same press again (the pad resending its state)
+        return held_passed ? 0 : -1;
+    }
+
+    held_usage = usage;
+    now = bpf_ktime_get_ns();
+    f = bpf_map_lookup_elem(&flush_map, &key);
+    if (!f || (!flush_ready && flush_init(hctx, f)) || now >= window_end) {
+        // After a quiet spell (or if the timer can't be set up), the
+        // detent goes straight through and opens a window.
+        held_passed = true;
+        window_end = now + COALESCE_WINDOW_NS;
+        return 0;
+    }
+
+    held_passed = false;
+    __sync_fetch_and_add(&pending_steps, usage == USAGE_VOLUME_UP ? 1 : -1);
+    if (!flush_armed) {
+        flush_armed = true;
+        bpf_timer_start(&f->timer, window_end - now, 0);
+    }
+    return -1;
+}
+
+HID_BPF_OPS(volumepad_coalesce) = {
+    .hid_device_event = (void *)volumepad_coalesce_event,
+};
+
+// The keyboard interface has the same VID/PID; only take the media one.
+SEC("syscall")
+int probe(struct hid_bpf_probe_args *ctx)
+{
+    ctx->retval = ctx->rdesc_size == MEDIA_RDESC_SIZE &&
+                  ctx->rdesc[0] == 0x05 && ctx->rdesc[1] == 0x0c ? 0 : -EINVAL;
+    return 0;
+}
+
+char _license[] SEC("license") = "GPL";
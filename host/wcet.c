@@ -0,0 +1,1189 @@
+// Static worst-case cycle counts for the firmware's interrupt handlers
+// and main loop, from its disassembly, checked against budgets.
+//
+// Usage: wcet [options] disassembly budgets
+//
+// The disassembly is the output of "avr-objdump -d -l main.elf" (make
+// wcet in src does this).  Each function reached from a root is split
+// into its instructions and the jumps between them, and its longest
+// path is worked out with the AVR's instruction timings: every branch
+// is taken to cost its most, and a call costs the call plus its
+// callee's worst case.
+//
+// Loops have to be bounded by hand.  A "// wcet: N" comment on a
+// loop's line in the source (the "for" or "while", or the "} while" of
+// a do-while) says it goes round at most N times.  The line numbers in
+// the disassembly tie each loop the compiler kept to its comment.
+// Loops in code with no source lines (libgcc) get their bound from
+// the budgets file instead.  A loop that's reached without a bound is
+// an error, as is any indirect jump or call, or recursion.
+//
+// One loop can instead be marked "// wcet: iteration", the main loop:
+// a root holding it is counted for one pass around it, rather than
+// from entry to return.
+//
+// The budgets file has one directive per line; # starts a comment:
+//
+//   budget SYMBOL CYCLES NAME...   a root, its budget, and what it is
+//   optional SYMBOL CYCLES NAME... the same, for a root that only some
+//                                  builds have; skipped if it's missing
+//   loop SYMBOL N                  bound for SYMBOL's loops without a
+//                                  comment
+//   ignore SYMBOL                  count calls to SYMBOL as the call
+//                                  instruction alone
+//
+// The output is a table of the roots' worst cases against their
+// budgets.  The exit status is 1 if any is over budget or couldn't be
+// worked out.
+//
+// Options:
+//   -f HZ         CPU clock, for the times (default 16000000)
+
+#include <ctype.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Cycles from an interrupt being taken to the first instruction of its
+// handler: the response itself, and the jmp in the vector table.
+#define VECTOR_ENTRY_CYCLES (5 + 3)
+
+#define NONE (-1L)		// no path
+#define UNKNOWN (-2L)		// not worked out yet
+#define BUSY (-3L)		// being worked out
+
+#define ITERATION (-1L)		// loop bound for "wcet: iteration"
+#define UNBOUNDED (-2L)		// loop without a bound
+
+enum { PLAIN, BRANCH, SKIP, JUMP, CALL, RET, INDIRECT, DATA };
+
+typedef struct {
+    uint32_t address;
+    int size;			// bytes
+    int kind;
+    int cycles;
+    uint32_t target;		// for branches, skips, jumps and calls
+    int has_target;
+    int file, line;		// source, or -1 and 0
+    char text[48];		// mnemonic and operands, for errors
+} Insn;
+
+typedef struct {
+    char *path;
+    int lines;
+    long *bounds;		// per line: 0, a bound, or ITERATION
+} Source;
+
+typedef struct {
+    int header;			// node
+    unsigned char *body;	// per node
+    int size;
+    int parent;			// loop, or -1
+    long bound;
+    int annotation_file, annotation_line;
+    int *exits;			// nodes outside the loop it leaves to, or -1 for returning
+    int exit_count;
+    long *memo[2];		// per node, for CYCLE and EXIT
+    long cost;
+} Loop;
+
+enum { CYCLE, EXIT };
+
+typedef struct {
+    int succ[2];		// nodes, or -1
+    int leaves;			// returns, or goes on into another function
+    uint32_t callee;		// called or jumped to, if has_callee
+    int has_callee;
+} Node;
+
+typedef struct {
+    char *name;
+    uint32_t start, end;
+    size_t first, count;	// instructions
+    int ignored;
+    long loop_bound;		// from the budgets file, or UNBOUNDED
+    int state;			// 0 not analysed, 1 analysing or failed, 2 done
+    Node *nodes;
+    int *inner;			// innermost loop of each node, or -1
+    Loop *loops;
+    int loop_count;
+    long *memo;			// per node, for the whole function
+    long cost;			// from entry to return
+    int calling;		// in the call chain being worked out
+} Func;
+
+typedef struct {
+    char *symbol;
+    long budget;
+    char *name;
+    int optional;
+} Budget;
+
+static Insn *insns;
+static size_t insn_count, insn_capacity;
+static Func *funcs;
+static size_t func_count, func_capacity;
+static Source *sources;
+static int source_count;
+static Budget *budgets;
+static int budget_count;
+
+static jmp_buf failed;
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-f hz] disassembly budgets\n", name);
+    exit(2);
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (!p) {
+        fprintf(stderr, "out of memory\n");
+        exit(2);
+    }
+    return p;
+}
+
+static void *xcalloc(size_t count, size_t size)
+{
+    void *p = calloc(count ? count : 1, size);
+
+    if (!p) {
+        fprintf(stderr, "out of memory\n");
+        exit(2);
+    }
+    return p;
+}
+
+// Give up on the root being worked out.
+static void fail(const char *format, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "wcet: ");
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    longjmp(failed, 1);
+}
+
+//
+// Sources and their annotations
+//
+
+static int source_index(const char *path)
+{
+    FILE *f;
+    char line[1024];
+    Source *s;
+
+    for (int i = 0; i < source_count; i++) {
+        if (!strcmp(sources[i].path, path)) {
+            return i;
+        }
+    }
+    sources = xrealloc(sources, (source_count + 1) * sizeof(Source));
+    s = &sources[source_count];
+    s->path = strdup(path);
+    s->lines = 0;
+    s->bounds = NULL;
+    // Sources that can't be read (libc headers, often) just have no
+    // annotations.
+    f = fopen(path, "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            char *c = strstr(line, "// wcet:");
+
+            s->bounds = xrealloc(s->bounds, (s->lines + 2) * sizeof(long));
+            s->lines++;
+            s->bounds[s->lines] = 0;
+            if (c) {
+                c += strlen("// wcet:");
+                while (isspace((unsigned char)*c)) c++;
+                if (!strncmp(c, "iteration", 9)) {
+                    s->bounds[s->lines] = ITERATION;
+                } else if (isdigit((unsigned char)*c)) {
+                    s->bounds[s->lines] = strtol(c, NULL, 10);
+                } else {
+                    fprintf(stderr, "%s:%d: bad wcet comment\n", path, s->lines);
+                    exit(2);
+                }
+            }
+        }
+        fclose(f);
+    }
+    return source_count++;
+}
+
+static long annotation(int file, int line)
+{
+    if (file < 0 || line < 1 || line > sources[file].lines) {
+        return 0;
+    }
+    return sources[file].bounds[line];
+}
+
+//
+// Reading the disassembly
+//
+
+// Worst-case cycles for the AT90USB1286 and ATmega32U4, which have a
+// 16-bit program counter.
+static int classify(const char *op, int *kind)
+{
+    static const struct {
+        const char *op;
+        int kind, cycles;
+    } table[] = {
+        { "rjmp", JUMP, 2 }, { "jmp", JUMP, 3 },
+        { "rcall", CALL, 3 }, { "call", CALL, 4 },
+        { "ret", RET, 4 }, { "reti", RET, 4 },
+        { "ijmp", INDIRECT, 2 }, { "eijmp", INDIRECT, 2 },
+        { "icall", INDIRECT, 3 }, { "eicall", INDIRECT, 4 },
+        { "cpse", SKIP, 1 }, { "sbrc", SKIP, 1 }, { "sbrs", SKIP, 1 },
+        { "sbic", SKIP, 1 }, { "sbis", SKIP, 1 },
+        { "ld", PLAIN, 2 }, { "ldd", PLAIN, 2 }, { "lds", PLAIN, 2 },
+        { "st", PLAIN, 2 }, { "std", PLAIN, 2 }, { "sts", PLAIN, 2 },
+        { "push", PLAIN, 2 }, { "pop", PLAIN, 2 },
+        { "lpm", PLAIN, 3 }, { "elpm", PLAIN, 3 }, { "spm", PLAIN, 4 },
+        { "adiw", PLAIN, 2 }, { "sbiw", PLAIN, 2 },
+        { "mul", PLAIN, 2 }, { "muls", PLAIN, 2 }, { "mulsu", PLAIN, 2 },
+        { "fmul", PLAIN, 2 }, { "fmuls", PLAIN, 2 }, { "fmulsu", PLAIN, 2 },
+        { "cbi", PLAIN, 2 }, { "sbi", PLAIN, 2 },
+        { ".word", DATA, 0 }, { ".byte", DATA, 0 }, { "(bad)", DATA, 0 },
+    };
+
+    for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+        if (!strcmp(op, table[i].op)) {
+            *kind = table[i].kind;
+            return table[i].cycles;
+        }
+    }
+    if (op[0] == 'b' && op[1] == 'r' && strcmp(op, "break")) {
+        // Every conditional branch: two cycles when taken.
+        *kind = BRANCH;
+        return 2;
+    }
+    *kind = PLAIN;
+    return 1;
+}
+
+static Func *new_func(const char *name, uint32_t start)
+{
+    Func *f;
+
+    if (func_count == func_capacity) {
+        func_capacity = func_capacity ? func_capacity * 2 : 256;
+        funcs = xrealloc(funcs, func_capacity * sizeof(Func));
+    }
+    f = &funcs[func_count++];
+    memset(f, 0, sizeof(*f));
+    f->name = strdup(name);
+    f->start = start;
+    f->first = insn_count;
+    f->loop_bound = UNBOUNDED;
+    return f;
+}
+
+static void read_disassembly(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[1024], name[256];
+    int file = -1, source_line = 0;
+    unsigned long address;
+
+    if (!f) {
+        perror(path);
+        exit(2);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *p, *q, op[16];
+        int bytes = 0, n;
+        Insn *insn;
+
+        line[strcspn(line, "\n")] = 0;
+        if (sscanf(line, "%lx <%255[^>]>:", &address, name) == 2 && line[0] != ' ') {
+            // A symbol: the start of a function (or of some data).
+            new_func(name, address);
+            file = -1;
+            source_line = 0;
+            continue;
+        }
+        p = strrchr(line, ':');
+        if (line[0] != ' ' && p && p > line && isdigit((unsigned char)p[1])) {
+            // file:line, maybe with " (discriminator N)" after it
+            *p = 0;
+            file = source_index(line);
+            source_line = atoi(p + 1);
+            continue;
+        }
+        if (line[0] != ' ' && (p = strstr(line, " (discriminator "))) {
+            *p = 0;
+            p = strrchr(line, ':');
+            if (p) {
+                *p = 0;
+                file = source_index(line);
+                source_line = atoi(p + 1);
+            }
+            continue;
+        }
+        if (sscanf(line, " %lx:%n", &address, &n) != 1 || !func_count || line[0] != ' ') {
+            continue;
+        }
+        // The bytes, then the mnemonic and operands, tab separated.
+        p = line + n;
+        while (*p == '\t' || *p == ' ') p++;
+        while (isxdigit((unsigned char)p[0]) && isxdigit((unsigned char)p[1]) && p[2] == ' ') {
+            bytes++;
+            p += 3;
+        }
+        while (*p == '\t' || *p == ' ') p++;
+        if (!bytes || !*p) {
+            continue;
+        }
+        if (insn_count == insn_capacity) {
+            insn_capacity = insn_capacity ? insn_capacity * 2 : 4096;
+            insns = xrealloc(insns, insn_capacity * sizeof(Insn));
+        }
+        insn = &insns[insn_count++];
+        memset(insn, 0, sizeof(*insn));
+        insn->address = address;
+        insn->size = bytes;
+        insn->file = file;
+        insn->line = source_line;
+        if (sscanf(p, "%15s", op) != 1) {
+            op[0] = 0;
+        }
+        insn->cycles = classify(op, &insn->kind);
+        snprintf(insn->text, sizeof(insn->text), "%s", p);
+        for (q = insn->text; *q; q++) {
+            if (*q == '\t') *q = ' ';
+        }
+        // The target, from objdump's comment ("; 0x1a4 <foo+0x4>"),
+        // or from the operand for jmp and call without one.
+        if ((q = strstr(p, "; 0x"))) {
+            insn->target = strtoul(q + 2, NULL, 16);
+            insn->has_target = 1;
+        } else if ((q = strstr(p, ".+")) || (q = strstr(p, ".-"))) {
+            insn->target = address + bytes + strtol(q + 1, NULL, 0);
+            insn->has_target = 1;
+        } else if ((q = strstr(p, "0x")) && (insn->kind == JUMP || insn->kind == CALL)) {
+            insn->target = strtoul(q, NULL, 16);
+            insn->has_target = 1;
+        }
+        if ((insn->kind == BRANCH || insn->kind == JUMP || insn->kind == CALL) &&
+            !insn->has_target) {
+            fprintf(stderr, "%s: no target for %s at 0x%lx\n", path, op, address);
+            exit(2);
+        }
+    }
+    fclose(f);
+    for (size_t i = 0; i < func_count; i++) {
+        funcs[i].count = (i + 1 < func_count ? funcs[i + 1].first : insn_count) - funcs[i].first;
+        funcs[i].end = i + 1 < func_count ? funcs[i + 1].start
+            : funcs[i].count ? insns[insn_count - 1].address + insns[insn_count - 1].size
+            : funcs[i].start;
+    }
+    // A skip costs one more cycle for each word it skips.
+    for (size_t i = 0; i + 1 < insn_count; i++) {
+        if (insns[i].kind == SKIP) {
+            insns[i].cycles = 1 + insns[i + 1].size / 2;
+            insns[i].target = insns[i + 1].address + insns[i + 1].size;
+            insns[i].has_target = 1;
+        }
+    }
+}
+
+static Func *find_func(const char *name)
+{
+    for (size_t i = 0; i < func_count; i++) {
+        if (!strcmp(funcs[i].name, name)) {
+            return &funcs[i];
+        }
+    }
+    return NULL;
+}
+
+// The function an address is in.
+static Func *func_at(uint32_t address)
+{
+    size_t lo = 0, hi = func_count;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (funcs[mid].start <= address) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (!lo || address >= funcs[lo - 1].end) {
+        return NULL;
+    }
+    // Several symbols can share an address; take the one with code.
+    while (lo > 1 && funcs[lo - 1].start == funcs[lo - 2].start && !funcs[lo - 1].count) {
+        lo--;
+    }
+    return &funcs[lo - 1];
+}
+
+// The node for an address in f, or -1.
+static int node_at(const Func *f, uint32_t address)
+{
+    for (size_t i = 0; i < f->count; i++) {
+        if (insns[f->first + i].address == address) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+//
+// Control flow and loops
+//
+
+static long func_cost_from(Func *g, uint32_t address);
+
+static void build_nodes(Func *f)
+{
+    int n = (int)f->count;
+
+    f->nodes = xcalloc(n, sizeof(Node));
+    for (int i = 0; i < n; i++) {
+        Insn *insn = &insns[f->first + i];
+        Node *node = &f->nodes[i];
+        uint32_t next = insn->address + insn->size;
+        uint32_t flow[2];
+        int flows = 0;
+
+        node->succ[0] = node->succ[1] = -1;
+        switch (insn->kind) {
+        case RET:
+        case INDIRECT:
+        case DATA:
+            break;
+        case JUMP:
+            flow[flows++] = insn->target;
+            break;
+        case BRANCH:
+        case SKIP:
+            flow[flows++] = next;
+            flow[flows++] = insn->target;
+            break;
+        case CALL:
+            node->callee = insn->target;
+            node->has_callee = 1;
+            flow[flows++] = next;
+            break;
+        default:
+            flow[flows++] = next;
+            break;
+        }
+        if (insn->kind == RET) {
+            node->leaves = 1;
+        }
+        for (int k = 0; k < flows; k++) {
+            if (flow[k] >= f->start && flow[k] < f->end) {
+                node->succ[k] = node_at(f, flow[k]);
+                if (node->succ[k] < 0) {
+                    fprintf(stderr, "wcet: %s: 0x%x jumps into the middle of an instruction\n",
+                            f->name, (unsigned)insn->address);
+                    exit(2);
+                }
+            } else if (insn->kind == CALL) {
+                // Falling off the end after a call that doesn't return.
+                node->succ[k] = -1;
+            } else {
+                // A tail call, or falling through into the next
+                // function.
+                node->callee = flow[k];
+                node->has_callee = 1;
+                node->leaves = 1;
+            }
+        }
+    }
+}
+
+static int dominates(unsigned char *const *dom, int a, int b)
+{
+    return dom[b][a];
+}
+
+static void find_loops(Func *f)
+{
+    int n = (int)f->count;
+    unsigned char **dom = xcalloc(n, sizeof(unsigned char *));
+    unsigned char *reached = xcalloc(n, 1), *tmp = xcalloc(n, 1);
+    int **preds = xcalloc(n, sizeof(int *)), *pred_count = xcalloc(n, sizeof(int));
+    int *stack = xcalloc(n, sizeof(int)), depth = 0;
+    int changed;
+
+    for (int i = 0; i < n; i++) {
+        for (int k = 0; k < 2; k++) {
+            int s = f->nodes[i].succ[k];
+
+            if (s >= 0) {
+                preds[s] = xrealloc(preds[s], (pred_count[s] + 1) * sizeof(int));
+                preds[s][pred_count[s]++] = i;
+            }
+        }
+    }
+    // Everything reachable from the entry, or from code that nothing
+    // jumps to (entered from elsewhere, as libgcc's epilogues are).
+    for (int i = 0; i < n; i++) {
+        if (i == 0 || !pred_count[i]) {
+            reached[i] = 1;
+            stack[depth++] = i;
+        }
+    }
+    while (depth) {
+        int i = stack[--depth];
+
+        for (int k = 0; k < 2; k++) {
+            int s = f->nodes[i].succ[k];
+
+            if (s >= 0 && !reached[s]) {
+                reached[s] = 1;
+                stack[depth++] = s;
+            }
+        }
+    }
+
+    // Dominators, the simple way: each node's are itself plus those
+    // common to all its predecessors.
+    for (int i = 0; i < n; i++) {
+        dom[i] = xcalloc(n, 1);
+        if (reached[i] && (i == 0 || !pred_count[i])) {
+            dom[i][i] = 1;
+        } else {
+            memset(dom[i], 1, n);
+        }
+    }
+    do {
+        changed = 0;
+        for (int i = 0; i < n; i++) {
+            int first = 1;
+
+            if (!reached[i] || i == 0 || !pred_count[i]) {
+                continue;
+            }
+            for (int p = 0; p < pred_count[i]; p++) {
+                if (!reached[preds[i][p]]) {
+                    continue;
+                }
+                if (first) {
+                    memcpy(tmp, dom[preds[i][p]], n);
+                    first = 0;
+                } else {
+                    for (int j = 0; j < n; j++) {
+                        tmp[j] &= dom[preds[i][p]][j];
+                    }
+                }
+            }
+            tmp[i] = 1;
+            if (memcmp(tmp, dom[i], n)) {
+                memcpy(dom[i], tmp, n);
+                changed = 1;
+            }
+        }
+    } while (changed);
+
+    // A natural loop for each node that a back edge goes to.
+    for (int h = 0; h < n; h++) {
+        Loop *loop = NULL;
+
+        if (!reached[h]) {
+            continue;
+        }
+        for (int p = 0; p < pred_count[h]; p++) {
+            int u = preds[h][p];
+
+            if (!reached[u] || !dominates(dom, h, u)) {
+                continue;
+            }
+            if (!loop) {
+                f->loops = xrealloc(f->loops, (f->loop_count + 1) * sizeof(Loop));
+                loop = &f->loops[f->loop_count++];
+                memset(loop, 0, sizeof(*loop));
+                loop->header = h;
+                loop->body = xcalloc(n, 1);
+                loop->body[h] = 1;
+                loop->size = 1;
+                loop->cost = UNKNOWN;
+                loop->bound = UNBOUNDED;
+                loop->annotation_file = -1;
+            }
+            depth = 0;
+            if (!loop->body[u]) {
+                loop->body[u] = 1;
+                loop->size++;
+                stack[depth++] = u;
+            }
+            while (depth) {
+                int i = stack[--depth];
+
+                for (int q = 0; q < pred_count[i]; q++) {
+                    int j = preds[i][q];
+
+                    if (reached[j] && !loop->body[j]) {
+                        loop->body[j] = 1;
+                        loop->size++;
+                        stack[depth++] = j;
+                    }
+                }
+            }
+        }
+    }
+
+    // Nesting: each loop's parent is the smallest other loop around its
+    // header, and each node's innermost loop the smallest around it.
+    f->inner = xcalloc(n, sizeof(int));
+    for (int i = 0; i < n; i++) {
+        f->inner[i] = -1;
+    }
+    for (int l = 0; l < f->loop_count; l++) {
+        Loop *loop = &f->loops[l];
+
+        loop->parent = -1;
+        for (int m = 0; m < f->loop_count; m++) {
+            if (m != l && f->loops[m].body[loop->header] && f->loops[m].size >= loop->size &&
+                (loop->parent < 0 || f->loops[m].size < f->loops[loop->parent].size)) {
+                loop->parent = m;
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            if (loop->body[i] && (f->inner[i] < 0 || f->loops[f->inner[i]].size > loop->size)) {
+                f->inner[i] = l;
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        free(dom[i]);
+        free(preds[i]);
+    }
+    free(dom);
+    free(preds);
+    free(pred_count);
+    free(reached);
+    free(tmp);
+    free(stack);
+}
+
+static int inside(const Func *f, int l, int outer)
+{
+    for (; l >= 0; l = f->loops[l].parent) {
+        if (l == outer) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether an annotation has been taken by a loop inside l.
+static int claimed_inside(const Func *f, int l, int file, int line)
+{
+    for (int m = 0; m < f->loop_count; m++) {
+        if (m != l && inside(f, m, l) && f->loops[m].annotation_file == file &&
+            f->loops[m].annotation_line == line) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void take_annotation(Loop *loop, int file, int line)
+{
+    loop->bound = annotation(file, line);
+    loop->annotation_file = file;
+    loop->annotation_line = line;
+}
+
+// Find each loop's bound, innermost loops first so that an outer loop
+// doesn't take an inner one's.  The comment is looked for on the lines
+// of the loop's header and of the jumps back to it, and failing that,
+// on the nearest line to the header's within the loop's lines (or just
+// before them, for the "do").
+static void bound_loops(Func *f)
+{
+    int n = (int)f->count;
+    int *order = xcalloc(f->loop_count, sizeof(int));
+
+    for (int l = 0; l < f->loop_count; l++) {
+        order[l] = l;
+    }
+    for (int a = 0; a < f->loop_count; a++) {
+        for (int b = a + 1; b < f->loop_count; b++) {
+            if (f->loops[order[b]].size < f->loops[order[a]].size) {
+                int t = order[a];
+
+                order[a] = order[b];
+                order[b] = t;
+            }
+        }
+    }
+    for (int o = 0; o < f->loop_count; o++) {
+        int l = order[o];
+        Loop *loop = &f->loops[l];
+        Insn *header = &insns[f->first + loop->header];
+        int best_file = -1, best_line = 0, best_distance = 0;
+
+        if (annotation(header->file, header->line) &&
+            !claimed_inside(f, l, header->file, header->line)) {
+            take_annotation(loop, header->file, header->line);
+            continue;
+        }
+        for (int i = 0; i < n && loop->annotation_file < 0; i++) {
+            Insn *latch = &insns[f->first + i];
+
+            if (loop->body[i] && (f->nodes[i].succ[0] == loop->header ||
+                                  f->nodes[i].succ[1] == loop->header) &&
+                annotation(latch->file, latch->line) &&
+                !claimed_inside(f, l, latch->file, latch->line)) {
+                take_annotation(loop, latch->file, latch->line);
+            }
+        }
+        if (loop->annotation_file >= 0) {
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            Insn *insn = &insns[f->first + i];
+
+            if (!loop->body[i] || insn->file < 0) {
+                continue;
+            }
+            for (int line = insn->line - 1; line <= insn->line; line++) {
+                int distance = abs(line - header->line) + (insn->file != header->file) * 100000;
+
+                if (annotation(insn->file, line) && !claimed_inside(f, l, insn->file, line) &&
+                    (best_file < 0 || distance < best_distance)) {
+                    best_file = insn->file;
+                    best_line = line;
+                    best_distance = distance;
+                }
+            }
+        }
+        if (best_file >= 0) {
+            take_annotation(loop, best_file, best_line);
+        } else if (f->loop_bound != UNBOUNDED) {
+            loop->bound = f->loop_bound;
+        }
+    }
+    free(order);
+
+    // Where each loop can be left for.
+    for (int l = 0; l < f->loop_count; l++) {
+        Loop *loop = &f->loops[l];
+
+        loop->exits = xcalloc(2 * n + 1, sizeof(int));
+        for (int i = 0; i < n; i++) {
+            if (!loop->body[i]) {
+                continue;
+            }
+            for (int k = 0; k < 2; k++) {
+                int s = f->nodes[i].succ[k], seen = 0;
+
+                if (s < 0 || loop->body[s]) {
+                    continue;
+                }
+                for (int e = 0; e < loop->exit_count; e++) {
+                    seen |= loop->exits[e] == s;
+                }
+                if (!seen) {
+                    loop->exits[loop->exit_count++] = s;
+                }
+            }
+            if (f->nodes[i].leaves) {
+                int seen = 0;
+
+                for (int e = 0; e < loop->exit_count; e++) {
+                    seen |= loop->exits[e] == -1;
+                }
+                if (!seen) {
+                    loop->exits[loop->exit_count++] = -1;
+                }
+            }
+        }
+        loop->memo[CYCLE] = xcalloc(n, sizeof(long));
+        loop->memo[EXIT] = xcalloc(n, sizeof(long));
+        for (int i = 0; i < n; i++) {
+            loop->memo[CYCLE][i] = loop->memo[EXIT][i] = UNKNOWN;
+        }
+    }
+}
+
+//
+// Longest paths
+//
+
+// Describe where a node is, for errors.
+static const char *where(const Func *f, int node)
+{
+    static char buffer[512];
+    Insn *insn = &insns[f->first + node];
+
+    if (insn->file >= 0) {
+        snprintf(buffer, sizeof(buffer), "%s (0x%x, %s:%d)", f->name, (unsigned)insn->address,
+                 sources[insn->file].path, insn->line);
+    } else {
+        snprintf(buffer, sizeof(buffer), "%s (0x%x)", f->name, (unsigned)insn->address);
+    }
+    return buffer;
+}
+
+static long loop_cost(Func *f, int l);
+
+// The cost of a node's own instruction, and of anything it calls.
+static long node_cost(Func *f, int i)
+{
+    Insn *insn = &insns[f->first + i];
+    Node *node = &f->nodes[i];
+    long cost = insn->cycles;
+
+    if (insn->kind == INDIRECT) {
+        fail("%s: indirect %s", where(f, i), insn->text);
+    }
+    if (insn->kind == DATA) {
+        fail("%s: runs into data", where(f, i));
+    }
+    if (node->has_callee) {
+        Func *g = func_at(node->callee);
+        long callee;
+
+        if (!g) {
+            fail("%s: %s goes outside the code", where(f, i), insn->text);
+        }
+        callee = func_cost_from(g, node->callee);
+        if (callee == NONE) {
+            return NONE;
+        }
+        cost += callee;
+    }
+    return cost;
+}
+
+// Longest path from a node to the end of a region: the whole function
+// (r = -1), or loop r.  The end is returning from the function, or for
+// a loop, going round once (CYCLE) or leaving it (EXIT).  Loops inside
+// the region count as a single node, costing their worst case.
+static long region_path(Func *f, int r, int mode, int i)
+{
+    long *memo = r < 0 ? f->memo : f->loops[r].memo[mode];
+    int c = f->inner[i];
+    long cost, best = NONE;
+    int next[2 * 64], next_count = 0;
+
+    if (memo[i] == BUSY) {
+        fail("%s: control flow the loop finder can't follow", where(f, i));
+    }
+    if (memo[i] != UNKNOWN) {
+        return memo[i];
+    }
+    memo[i] = BUSY;
+
+    // The outermost loop inside this region that holds the node.
+    if (c == r) {
+        c = -1;
+    }
+    while (c >= 0 && f->loops[c].parent != r) {
+        c = f->loops[c].parent;
+    }
+    if (c >= 0) {
+        Loop *loop = &f->loops[c];
+
+        if (loop->header != i) {
+            fail("%s: jumps into the middle of a loop", where(f, i));
+        }
+        cost = loop_cost(f, c);
+        if (loop->exit_count > (int)(sizeof(next) / sizeof(next[0]))) {
+            fail("%s: loop with too many exits", where(f, i));
+        }
+        for (int e = 0; e < loop->exit_count; e++) {
+            next[next_count++] = loop->exits[e];
+        }
+    } else {
+        cost = node_cost(f, i);
+        for (int k = 0; k < 2; k++) {
+            if (f->nodes[i].succ[k] >= 0) {
+                next[next_count++] = f->nodes[i].succ[k];
+            }
+        }
+        if (f->nodes[i].leaves) {
+            next[next_count++] = -1;
+        }
+    }
+
+    if (cost != NONE) {
+        for (int k = 0; k < next_count; k++) {
+            int s = next[k];
+            long rest;
+
+            if (s < 0) {
+                rest = mode == EXIT ? 0 : NONE;
+            } else if (r >= 0 && s == f->loops[r].header) {
+                rest = mode == CYCLE ? 0 : NONE;
+            } else if (r >= 0 && !f->loops[r].body[s]) {
+                rest = mode == EXIT ? 0 : NONE;
+            } else {
+                rest = region_path(f, r, mode, s);
+            }
+            if (rest != NONE && cost + rest > best) {
+                best = cost + rest;
+            }
+        }
+    }
+    memo[i] = best;
+    return best;
+}
+
+// A loop's worst case, from entering its header to leaving it.
+static long loop_cost(Func *f, int l)
+{
+    Loop *loop = &f->loops[l];
+    long cycle, exit;
+
+    if (loop->cost != UNKNOWN) {
+        return loop->cost;
+    }
+    if (loop->bound == ITERATION) {
+        fail("%s: the main loop is reached from another root", where(f, loop->header));
+    }
+    if (loop->bound == UNBOUNDED) {
+        fail("%s: loop with no bound (add a \"// wcet: N\" comment)", where(f, loop->header));
+    }
+    cycle = region_path(f, l, CYCLE, loop->header);
+    exit = region_path(f, l, EXIT, loop->header);
+    if (exit == NONE) {
+        loop->cost = NONE;
+    } else if (cycle == NONE) {
+        loop->cost = exit;
+    } else {
+        loop->cost = loop->bound * cycle + exit;
+    }
+    return loop->cost;
+}
+
+static void analyse(Func *f)
+{
+    if (f->state == 1) {
+        fail("%s: already failed", f->name);
+    }
+    if (f->state) {
+        return;
+    }
+    f->state = 1;
+    if (!f->count) {
+        fail("%s: no code", f->name);
+    }
+    build_nodes(f);
+    find_loops(f);
+    bound_loops(f);
+    f->memo = xcalloc(f->count, sizeof(long));
+    for (size_t i = 0; i < f->count; i++) {
+        f->memo[i] = UNKNOWN;
+    }
+    f->cost = UNKNOWN;
+    f->state = 2;
+}
+
+// The worst case of g from an address in it until it returns, or NONE
+// if it never does.
+static long func_cost_from(Func *g, uint32_t address)
+{
+    int entry;
+    long cost;
+
+    if (g->ignored) {
+        return 0;
+    }
+    analyse(g);
+    entry = node_at(g, address);
+    if (entry < 0) {
+        fail("%s: entered at 0x%x, not an instruction", g->name, (unsigned)address);
+    }
+    if (g->calling) {
+        fail("%s: recursion", g->name);
+    }
+    g->calling = 1;
+    cost = region_path(g, -1, EXIT, entry);
+    g->calling = 0;
+    return cost;
+}
+
+// A root's worst case: one pass of its main loop if it has one,
+// otherwise from entry to return.
+static long root_cost(Func *f, int *iteration)
+{
+    long cost;
+
+    analyse(f);
+    f->calling = 1;
+    *iteration = 0;
+    for (int l = 0; l < f->loop_count; l++) {
+        if (f->loops[l].bound == ITERATION) {
+            *iteration = 1;
+            cost = region_path(f, l, CYCLE, f->loops[l].header);
+            f->calling = 0;
+            return cost;
+        }
+    }
+    cost = region_path(f, -1, EXIT, 0);
+    f->calling = 0;
+    return cost;
+}
+
+//
+// Budgets
+//
+
+static void read_budgets(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[512];
+    int number = 0;
+
+    if (!f) {
+        perror(path);
+        exit(2);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char directive[32], symbol[256];
+        long value;
+        int n;
+        Func *func;
+
+        number++;
+        line[strcspn(line, "#\n")] = 0;
+        if (sscanf(line, "%31s", directive) != 1) {
+            continue;
+        }
+        if (sscanf(line, "%31s %255s%n", directive, symbol, &n) != 2) {
+            fprintf(stderr, "%s:%d: no symbol\n", path, number);
+            exit(2);
+        }
+        func = find_func(symbol);
+        if (!strcmp(directive, "budget") || !strcmp(directive, "optional")) {
+            char *name = line + n;
+            int m;
+
+            if (sscanf(name, "%ld%n", &value, &m) != 1 || value <= 0) {
+                fprintf(stderr, "%s:%d: bad budget\n", path, number);
+                exit(2);
+            }
+            name += m;
+            while (isspace((unsigned char)*name)) name++;
+            budgets = xrealloc(budgets, (budget_count + 1) * sizeof(Budget));
+            budgets[budget_count].symbol = strdup(symbol);
+            budgets[budget_count].budget = value;
+            budgets[budget_count].name = strdup(name);
+            budgets[budget_count].optional = !strcmp(directive, "optional");
+            budget_count++;
+        } else if (!strcmp(directive, "loop")) {
+            if (sscanf(line + n, "%ld", &value) != 1 || value < 0) {
+                fprintf(stderr, "%s:%d: bad loop bound\n", path, number);
+                exit(2);
+            }
+            if (func) {
+                func->loop_bound = value;
+            }
+        } else if (!strcmp(directive, "ignore")) {
+            if (func) {
+                func->ignored = 1;
+            }
+        } else {
+            fprintf(stderr, "%s:%d: unknown directive %s\n", path, number, directive);
+            exit(2);
+        }
+    }
+    fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+    double hz = 16000000;
+    int opt, status = 0, ignored = 0, skipped = 0;
+
+    while ((opt = getopt(argc, argv, "f:")) != -1) {
+        switch (opt) {
+        case 'f': hz = atof(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || hz <= 0) {
+        usage(argv[0]);
+    }
+    read_disassembly(argv[optind]);
+    read_budgets(argv[optind + 1]);
+
+    printf("%-16s %-28s %8s %9s %8s %5s\n", "symbol", "", "cycles", "us", "budget", "used");
+    for (int b = 0; b < budget_count; b++) {
+        Budget *budget = &budgets[b];
+        Func *f = find_func(budget->symbol);
+        long cost = NONE;
+        int iteration = 0;
+
+        if (!f && budget->optional) {
+            continue;
+        } else if (!f) {
+            fprintf(stderr, "wcet: no symbol %s\n", budget->symbol);
+        } else if (!setjmp(failed)) {
+            cost = root_cost(f, &iteration);
+            if (cost == NONE) {
+                fprintf(stderr, "wcet: %s never returns\n", f->name);
+            }
+        }
+        // Forget whatever a failure left half done.
+        for (size_t i = 0; i < func_count; i++) {
+            Func *g = &funcs[i];
+
+            g->calling = 0;
+            for (size_t n = 0; g->memo && n < g->count; n++) {
+                if (g->memo[n] == BUSY) g->memo[n] = UNKNOWN;
+                for (int l = 0; l < g->loop_count; l++) {
+                    if (g->loops[l].memo[CYCLE][n] == BUSY) g->loops[l].memo[CYCLE][n] = UNKNOWN;
+                    if (g->loops[l].memo[EXIT][n] == BUSY) g->loops[l].memo[EXIT][n] = UNKNOWN;
+                }
+            }
+        }
+        if (cost == NONE) {
+            printf("%-16s %-28s %8s %9s %8ld %5s  FAILED\n", budget->symbol, budget->name,
+                   "-", "-", budget->budget, "-");
+            status = 1;
+            continue;
+        }
+        if (!strncmp(budget->symbol, "__vector_", 9)) {
+            cost += VECTOR_ENTRY_CYCLES;
+        }
+        printf("%-16s %-28s %8ld %9.1f %8ld %4ld%%%s\n", budget->symbol, budget->name,
+               cost, cost * 1e6 / hz, budget->budget, cost * 100 / budget->budget,
+               cost > budget->budget ? "  OVER" : "");
+        if (cost > budget->budget) {
+            status = 1;
+        }
+    }
+    for (size_t i = 0; i < func_count; i++) {
+        if (funcs[i].ignored) {
+            printf("%s%s", ignored++ ? ", " : "not counted: ", funcs[i].name);
+        }
+    }
+    if (ignored) {
+        printf("\n");
+    }
+    for (int b = 0; b < budget_count; b++) {
+        if (budgets[b].optional && !find_func(budgets[b].symbol)) {
+            printf("%s%s", skipped++ ? ", " : "not in this build: ", budgets[b].symbol);
+        }
+    }
+    if (skipped) {
+        printf("\n");
+    }
+    return status;
+}
@@ -0,0 +1,632 @@
+// Switch and dial actions; see actions.h.
+
+#include <stdint.h>
+
+#include "actions.h"
+#include "input.h"
+#include "keymap.h"
+#include "keymap_features.h"
+#include "tuning.h"
+#include "usb_keyboard.h"
+
+#define IsMediaKey(scancode) (0x1000 & scancode)
+
+// Debounced and long-press switch states as of the last tick that
+// changed anything.
+static uint8_t last_pressed_keys = 0x7f;
+static uint8_t last_long_pressed_keys = 0x7f;
+
+// Switches configured as TapHold in SwitchActionMap.
+static uint8_t tap_hold_switches = 0;
+
+// Reports whose keys have changed since they were last sent, and of
+// those, the ones with keys pressed and released.  All the switches
+// and the dial change keys first, and actions_run() sends each
+// changed report once at the end of the tick.
+#define KeyboardReport 0x01
+#define MediaReport 0x02
+static uint8_t dirty_reports;
+static uint8_t pressed_reports;
+static uint8_t released_reports;
+// Reports sent so far this tick.
+static uint8_t tick_reports;
+
+#if KEYMAP_TEXT
+// Text being typed out (see SwitchAction.text): the next character,
+// or NULL when there's none, and the key and shift state in the last
+// report it sent.
+static char const *text_next;
+static uint8_t text_key;
+static uint8_t text_shift;
+// For text_rate: when the text started, characters typed so far, and
+// the room in the keyboard queue before it started.  Once the last
+// report is queued, text_draining is set until the queue is back to
+// that, so the rate is up to when the host has taken everything.
+static uint16_t text_start_tick;
+static uint16_t text_chars;
+static uint8_t text_idle_space;
+static uint8_t text_draining;
+// Characters per second of the last text typed.
+static uint16_t text_rate;
+#endif
+
+// Rate limiting (see RateLimits in keymap.h): each bucket's saved up
+// time, in microseconds, by action class and report.
+static uint32_t bucket_level[2][2];
+// Switches whose press, or tap, is waiting for the rate limit, and
+// dial steps waiting for it (positive clockwise).
+static uint8_t held_back_presses;
+static uint8_t held_back_taps;
+static int8_t held_back_steps;
+// Switch presses and taps, and dial steps, that had to wait or were
+// merged away.
+static uint16_t throttled_presses;
+static uint16_t throttled_steps;
+
+#if KEYMAP_TEXT
+// Keys for typing ASCII on a US layout, with Shifted set when they
+// need shift.  Letters and digits are worked out in text_key_code().
+#define Shifted(key) (0x80 | (key))
+static uint8_t const PROGMEM ascii_keys[128] = {
+    ['\t'] = KEY_TAB, ['\n'] = KEY_ENTER, [' '] = KEY_SPACE,
+    ['!'] = Shifted(KEY_1), ['"'] = Shifted(KEY_QUOTE), ['#'] = Shifted(KEY_3),
+    ['$'] = Shifted(KEY_4), ['%'] = Shifted(KEY_5), ['&'] = Shifted(KEY_7),
+    ['\''] = KEY_QUOTE, ['('] = Shifted(KEY_9), [')'] = Shifted(KEY_0),
+    ['*'] = Shifted(KEY_8), ['+'] = Shifted(KEY_EQUAL), [','] = KEY_COMMA,
+    ['-'] = KEY_MINUS, ['.'] = KEY_PERIOD, ['/'] = KEY_SLASH,
+    [':'] = Shifted(KEY_SEMICOLON), [';'] = KEY_SEMICOLON, ['<'] = Shifted(KEY_COMMA),
+    ['='] = KEY_EQUAL, ['>'] = Shifted(KEY_PERIOD), ['?'] = Shifted(KEY_SLASH),
+    ['@'] = Shifted(KEY_2), ['['] = KEY_LEFT_BRACE, ['\\'] = KEY_BACKSLASH,
+    [']'] = KEY_RIGHT_BRACE, ['^'] = Shifted(KEY_6), ['_'] = Shifted(KEY_MINUS),
+    ['`'] = KEY_TILDE, ['{'] = Shifted(KEY_LEFT_BRACE), ['|'] = Shifted(KEY_BACKSLASH),
+    ['}'] = Shifted(KEY_RIGHT_BRACE), ['~'] = Shifted(KEY_TILDE),
+};
+#endif
+
+uint8_t actions_tap_hold_switches(void) {
+    uint8_t switches = 0;
+
+    for (uint8_t i = 0; i < 7; i++) { // wcet: 7
+        if (SwitchActionMap[i].flags & TapHold) {
+            switches |= (0x01 << i);
+        }
+    }
+    return switches;
+}
+
+void actions_init(void) {
+    tap_hold_switches = actions_tap_hold_switches();
+    last_pressed_keys = 0x7f;
+    last_long_pressed_keys = 0x7f;
+    dirty_reports = 0;
+    pressed_reports = 0;
+    released_reports = 0;
+    tick_reports = 0;
+#if KEYMAP_TEXT
+    text_next = NULL;
+    text_key = 0;
+    text_shift = 0;
+    text_draining = 0;
+    text_rate = 0;
+#endif
+    for (uint8_t c = 0; c < 2; c++) { // wcet: 2
+        for (uint8_t r = 0; r < 2; r++) { // wcet: 2
+            bucket_level[c][r] = RateLimits[c][r].capacity_us;
+        }
+    }
+    held_back_presses = 0;
+    held_back_taps = 0;
+    held_back_steps = 0;
+    throttled_presses = 0;
+    throttled_steps = 0;
+}
+
+uint16_t actions_text_rate(void) {
+#if KEYMAP_TEXT
+    return text_rate;
+#else
+    return 0;
+#endif
+}
+
+uint8_t actions_long_press_switches(void) {
+    return KEYMAP_LONG_PRESS_SWITCHES;
+}
+
+uint16_t actions_throttled_presses(void) {
+    return throttled_presses;
+}
+
+uint16_t actions_throttled_steps(void) {
+    return throttled_steps;
+}
+
+static void media_key_change(uint16_t const key, uint8_t const pressed) {
+    uint8_t i, free_index = 255;
+
+    for(i = 0; i < 4; i++) { // wcet: 4
+        if (media_keys[i] == key) {
+            if (pressed) {
+                // The key is already on; we can stop altogether
+                free_index = 255;
+                break;
+            } else {
+                media_keys[i] = 0;
+            }
+        }
+        if (pressed && !media_keys[i] && free_index == 255) {
+            free_index = i;
+        }
+    }
+
+    if (pressed && free_index < 4) {
+        // If pressed but free_index == 255, then we either don't
+        // have room in the buffer for the new key, or the key is
+        // already pressed.  Either way we have no action to take.
+        //
+        // This path, however, is when we found an empty slot in the
+        // key buffer, so we put the key into it.
+
+        media_keys[free_index] = key;
+    }
+}
+
+#if KEYMAP_KEYBOARD
+static void basic_key_change(uint8_t const key, uint8_t const pressed) {
+    uint8_t i, free_index = 255;
+
+    if (key >= MODIFIER_KEYS_START && key <= MODIFIER_KEYS_END) {
+        // modifier keys are stored as bitfields
+        uint8_t affected_field = key & 0x07; // 0b00000xxx: 227 (KEY_GUI) => 0b00000011 (3)
+        uint8_t mask = (pressed ? 0x01 : 0) << affected_field; // 1 << 3 => 0b00001000 (or 0 if turning off)
+
+        keyboard_modifier_keys &= ~(0x01 << affected_field);
+        keyboard_modifier_keys |= mask;
+        
+        return;
+    }
+    
+    for(i = 0; i < 6; i++) { // wcet: 6
+        if (keyboard_keys[i] == key) {
+            if (pressed) {
+                // The key is already on; we can stop altogether
+                free_index = 255;
+                break;
+            } else {
+                keyboard_keys[i] = 0;
+            }
+        }
+        if (pressed && !keyboard_keys[i] && free_index == 255) {
+            free_index = i;
+        }
+    }
+
+    if (pressed && free_index < 6) {
+        // If pressed but free_index == 255, then we either don't
+        // have room in the buffer for the new key, or the key is
+        // already pressed.  Either way we have no action to take.
+        //
+        // This path, however, is when we found an empty slot in the
+        // key buffer, so we put the key into it.
+        //
+        // (Actually, when we have no buffer space left, the HID spec
+        // says we're supposed to send something else in the buffer to
+        // indicate that more keys are pressed than we can indicate.
+        // Let's not, though.)
+
+        keyboard_keys[free_index] = key;
+    }
+}
+#endif
+
+// Send the keyboard and media reports that have changed since they
+// were last sent.
+static void flush_reports(void) {
+#if KEYMAP_KEYBOARD
+    if (dirty_reports & KeyboardReport) {
+        usb_keyboard_send();
+        tick_reports++;
+    }
+#endif
+    if (dirty_reports & MediaReport) {
+        usb_media_send();
+        tick_reports++;
+    }
+    dirty_reports = 0;
+    pressed_reports = 0;
+    released_reports = 0;
+}
+
+// The reports a key array has keys on.
+static uint8_t key_reports(uint16_t const *const keys) {
+    uint8_t i, reports = 0;
+
+    for (i = 0; keys[i]; i++) { // wcet: 8
+        reports |= IsMediaKey(keys[i]) ? MediaReport : KeyboardReport;
+    }
+    return reports;
+}
+
+// Save up another tick's worth of time in every rate limit bucket.
+static void fill_buckets(void) {
+    for (uint8_t c = 0; c < 2; c++) { // wcet: 2
+        for (uint8_t r = 0; r < 2; r++) { // wcet: 2
+            uint32_t level = bucket_level[c][r] + tuning.tick_period_us;
+
+            bucket_level[c][r] = level < RateLimits[c][r].capacity_us ?
+                level : RateLimits[c][r].capacity_us;
+        }
+    }
+}
+
+// Take an action's worth, a press and a release, from the buckets for
+// an action class and the given reports, if every one of them has it.
+// Returns 0 if not.
+static uint8_t take_rate(uint8_t const class, uint8_t const reports) {
+    uint8_t r;
+
+    for (r = 0; r < 2; r++) { // wcet: 2
+        if (((reports >> r) & 0x01) &&
+            bucket_level[class][r] < 2 * (uint32_t)RateLimits[class][r].interval_us) {
+            return 0;
+        }
+    }
+    for (r = 0; r < 2; r++) { // wcet: 2
+        if ((reports >> r) & 0x01) {
+            bucket_level[class][r] -= 2 * (uint32_t)RateLimits[class][r].interval_us;
+        }
+    }
+    return 1;
+}
+
+// Change keys in the reports.  They're sent by flush_reports(), except
+// that a press followed by a release in the same report (or the other
+// way around) sends the report in between, so the host sees both.
+static void send_keys(uint16_t const *const keys, uint8_t const pressed) {
+    uint8_t i, reports = key_reports(keys);
+
+    if (reports & (pressed ? released_reports : pressed_reports)) {
+        flush_reports();
+    }
+    
+    for (i = 0; keys[i]; i++) { // wcet: 8
+        uint16_t encoded_key = keys[i];
+        
+        if (IsMediaKey(encoded_key)) {
+            media_key_change(encoded_key & 0xfff, pressed);
+        }
+#if KEYMAP_KEYBOARD
+        else {
+            basic_key_change(encoded_key & 0xff, pressed);
+        }
+#endif
+    }
+    dirty_reports |= reports;
+    if (pressed) {
+        pressed_reports |= reports;
+    } else {
+        released_reports |= reports;
+    }
+}
+
+static void press_keys(uint16_t const *const keys) {
+    send_keys(keys, 1);
+}
+
+static void release_keys(uint16_t const *const keys) {
+    send_keys(keys, 0);
+}
+
+#if KEYMAP_TEXT
+// The key for an ASCII character, with Shifted if it needs shift, or
+// 0 if it can't be typed.
+static uint8_t text_key_code(uint8_t const c) {
+    if (c >= 'a' && c <= 'z') {
+        return KEY_A + (c - 'a');
+    }
+    if (c >= 'A' && c <= 'Z') {
+        return Shifted(KEY_A + (c - 'A'));
+    }
+    if (c >= '1' && c <= '9') {
+        return KEY_1 + (c - '1');
+    }
+    if (c == '0') {
+        return KEY_0;
+    }
+    return c < 128 ? pgm_read_byte(&ascii_keys[c]) : 0;
+}
+
+static void start_text(char const *const text, uint16_t const tick) {
+    if (text_next) {
+        return;
+    }
+    text_next = text;
+    text_start_tick = tick;
+    text_chars = 0;
+    text_idle_space = usb_keyboard_queue_space();
+    text_draining = 0;
+}
+#endif
+
+// Press a switch's press keys and start its text, if the rate limit
+// allows.  Returns 0 if it didn't.
+static uint8_t press_switch(uint8_t const i, uint16_t const tick) {
+    uint16_t *action_keys = SwitchActionMap[i].press_keys;
+
+    if (action_keys) {
+        if (!take_rate(SwitchClass, key_reports(action_keys))) {
+            return 0;
+        }
+        press_keys(action_keys);
+    }
+#if KEYMAP_TEXT
+    if (SwitchActionMap[i].text) {
+        start_text(SwitchActionMap[i].text, tick);
+    }
+#else
+    (void)tick;
+#endif
+    return 1;
+}
+
+// A single quick press and release of a switch's press keys, and its
+// text, if the rate limit allows.  Returns 0 if it didn't.
+static uint8_t tap_switch(uint8_t const i, uint16_t const tick) {
+    if (!press_switch(i, tick)) {
+        return 0;
+    }
+    if (SwitchActionMap[i].press_keys) {
+        release_keys(SwitchActionMap[i].press_keys);
+    }
+    return 1;
+}
+
+#if KEYMAP_TEXT
+// Type as much of the text as fits in the keyboard queue, one
+// character per report, so that the queue stays topped up and the
+// host gets a character every time it polls.  Shift only changes
+// when the next character needs it to, and a release goes in between
+// only when a key repeats, as the host wouldn't see it pressed again
+// otherwise.
+static void type_text(uint16_t const tick) {
+    uint8_t space = usb_keyboard_queue_space();
+
+    while (text_next && space) { // wcet: 8
+        uint8_t c = pgm_read_byte(text_next);
+        uint8_t code = text_key_code(c);
+        uint8_t key = code & 0x7f;
+        uint8_t shift = code >> 7;
+
+        if (c && !code) {
+            // Skipped, but still taking a turn, so that a run of
+            // them can't hold up the tick.
+            text_next++;
+            space--;
+            continue;
+        }
+        if (c && key == text_key) {
+            // Let go of it first, keeping shift as it is.
+            basic_key_change(text_key, 0);
+            text_key = 0;
+        } else {
+            if (text_key) {
+                basic_key_change(text_key, 0);
+            }
+            if (c) {
+                basic_key_change(key, 1);
+                text_chars++;
+                text_next++;
+            } else {
+                // The end: let go of everything.
+                shift = 0;
+                text_next = NULL;
+                text_draining = 1;
+            }
+            if (shift != text_shift) {
+                basic_key_change(KEY_LEFT_SHIFT, shift);
+                text_shift = shift;
+            }
+            text_key = key;
+        }
+        usb_keyboard_send();
+        tick_reports++;
+        space--;
+    }
+}
+#endif
+
+// Type any text after the tick's other reports, and return the number
+// of reports sent in the tick.
+static uint8_t end_tick(uint16_t const tick) {
+    uint8_t reports;
+
+#if KEYMAP_TEXT
+    if (text_next) {
+        type_text(tick);
+    } else if (text_draining && usb_keyboard_queue_space() >= text_idle_space) {
+        text_draining = 0;
+        text_rate = (uint32_t)text_chars * 1000000UL /
+            ((uint32_t)(uint16_t)(tick - text_start_tick + 1) * tuning.tick_period_us);
+    }
+#else
+    (void)tick;
+#endif
+    reports = tick_reports;
+    tick_reports = 0;
+    return reports;
+}
+
+uint8_t actions_run(uint16_t tick) {
+    uint8_t changed_keys = last_pressed_keys ^ debounced_switches;
+    uint8_t changed_long_keys = last_long_pressed_keys ^ long_press_switches;
+
+    fill_buckets();
+    if (!(changed_keys | changed_long_keys | held_back_presses | held_back_taps | held_back_steps) &&
+        !input_dial_pending()) {
+        // Nothing was pressed, released or long-pressed this
+        // tick, and no sampled detent or held-back action is
+        // waiting, so there's nothing for the switches or the
+        // dial to do.
+        return end_tick(tick);
+    }
+
+    //
+    // Process normal switches
+    //
+
+#if KEYMAP_LONG_PRESS_SWITCHES
+    // Tap-hold switches that were just resolved as held go
+    // first, so their keys (typically modifiers) are down
+    // before those of whatever resolved them.
+    uint8_t newly_held = tap_hold_switches & changed_long_keys & ~long_press_switches;
+    for(int i = 0; i < 7; i++) { // wcet: 7
+        if (((newly_held >> i) & 0x01) && SwitchActionMap[i].long_press_keys) {
+            press_keys(SwitchActionMap[i].long_press_keys);
+        }
+    }
+    changed_long_keys &= ~newly_held;
+#endif
+
+    // Presses and taps held back by the rate limit go before new
+    // ones.
+    for(uint8_t i = 0; i < 7; i++) { // wcet: 7
+        if (((held_back_presses >> i) & 0x01) && press_switch(i, tick)) {
+            held_back_presses &= ~(0x01 << i);
+        }
+        if (((held_back_taps >> i) & 0x01) && tap_switch(i, tick)) {
+            held_back_taps &= ~(0x01 << i);
+        }
+    }
+    
+    for(int i = 0; i < 7; i++) { // wcet: 7
+        // A switch is pressed if it's logic low.
+
+        if (!((KEYMAP_SWITCHES >> i) & 0x01)) {
+            // No actions, so nothing to do.
+            continue;
+        }
+        
+        uint16_t *action_keys = SwitchActionMap[i].press_keys;
+#if KEYMAP_LONG_PRESS_SWITCHES
+        uint16_t *action_long_keys = SwitchActionMap[i].long_press_keys;
+#else
+        // Without any, every branch for them compiles out.
+        uint16_t *action_long_keys = NULL;
+#endif
+            
+        if ((((debounced_switches >> i) & 0x01) == 0) &&
+            ((changed_keys >> i) & 0x01)) {
+            // Switch became newly-pressed.  If there are no
+            // long-press actions for this key, we want to
+            // start pressing it.
+            
+            if (!action_long_keys) {
+                // The press takes the place of any tap still
+                // waiting.
+                held_back_taps &= ~(0x01 << i);
+                if (!press_switch(i, tick)) {
+                    held_back_presses |= (0x01 << i);
+                    throttled_presses++;
+                }
+            }
+        }
+
+        if ((((long_press_switches >> i) & 0x01) == 0) &&
+            ((changed_long_keys >> i) & 0x01)) {
+            // Switch became newly-long-pressed.
+            
+            if (action_long_keys) {
+                press_keys(action_long_keys);
+            }
+        }
+        
+        if ((((debounced_switches >> i) & 0x01) == 1) &&
+            ((changed_keys >> i) & 0x01)) {
+            // Switch was released.
+
+            if (action_long_keys) {
+                if ((((long_press_switches >> i) & 0x01) == 1) &&
+                    ((changed_long_keys >> i) & 0x01)) {
+                    // Switch was released from a long-press
+                    // action.
+                    //
+                    // NB. long_press_switches must always be
+                    // 1 here if debounced_switches is 1,
+                    // because both fields should be cleared
+                    // when a key is released.  If not,
+                    // there's a bug.
+                    
+                    release_keys(action_long_keys);
+                } else {
+                    // Switch was released before the
+                    // long-press action triggered.  We'll
+                    // trigger a single quick press and
+                    // release of the short-press keys.
+                    if (!tap_switch(i, tick)) {
+                        held_back_taps |= (0x01 << i);
+                        throttled_presses++;
+                    }
+                }
+            } else if ((held_back_presses >> i) & 0x01) {
+                // Released before its press went out, so the two
+                // go out together as a tap.
+                held_back_presses &= ~(0x01 << i);
+                held_back_taps |= (0x01 << i);
+            } else {
+                if (action_keys) {
+                    // Release the short press keys.
+                    release_keys(action_keys);
+                }
+            }
+        }
+    }
+
+    //
+    // Process dial
+    //
+    
+    int16_t steps = input_update_dial(tick);
+#ifdef USB_ABSOLUTE_VOLUME
+    if (steps && usb_volume_adjust(steps) == 0) {
+        steps = 0;
+    }
+#endif
+    if (steps | held_back_steps) {
+        // Steps add up with any still waiting, to at most
+        // DIAL_MAX_STEPS either way.
+        int16_t waiting = held_back_steps + steps;
+
+        if (waiting > DIAL_MAX_STEPS) {
+            throttled_steps += waiting - DIAL_MAX_STEPS;
+            steps -= waiting - DIAL_MAX_STEPS;
+            waiting = DIAL_MAX_STEPS;
+        } else if (waiting < -DIAL_MAX_STEPS) {
+            throttled_steps += -DIAL_MAX_STEPS - waiting;
+            steps += -DIAL_MAX_STEPS - waiting;
+            waiting = -DIAL_MAX_STEPS;
+        }
+        for (; waiting > 0 && take_rate(DialClass, key_reports(DialCWKeys)); waiting--) { // wcet: 16
+            press_keys(DialCWKeys);
+            release_keys(DialCWKeys);
+        }
+        for (; waiting < 0 && take_rate(DialClass, key_reports(DialCCWKeys)); waiting++) { // wcet: 16
+            press_keys(DialCCWKeys);
+            release_keys(DialCCWKeys);
+        }
+        // This tick's steps that are left waiting.  Those merged
+        // away above were taken off already.
+        if ((waiting > 0 && steps > 0) || (waiting < 0 && steps < 0)) {
+            int16_t waiting_abs = waiting < 0 ? -waiting : waiting;
+            int16_t steps_abs = steps < 0 ? -steps : steps;
+
+            throttled_steps += waiting_abs < steps_abs ? waiting_abs : steps_abs;
+        }
+        held_back_steps = waiting;
+    }
+
+    flush_reports();
+    last_pressed_keys = debounced_switches;
+    last_long_pressed_keys = long_press_switches;
+
+    return end_tick(tick);
+}
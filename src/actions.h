@@ -0,0 +1,30 @@
+#ifndef actions_h__
+#define actions_h__
+
+#include <stdint.h>
+
+// Turning debounced switch and dial changes into keyboard and media
+// reports, using the keymap in keymap.h.  Like input.c this doesn't
+// touch the hardware: reports go out through usb_keyboard_send() and
+// usb_media_send(), so the host tools can build it with their own.
+
+// Switches configured as TapHold in the keymap, and switches with
+// long-press keys, for input_init().
+uint8_t actions_tap_hold_switches(void);
+uint8_t actions_long_press_switches(void);
+// Start with no switches pressed.
+void actions_init(void);
+// Press and release keys for whatever input_update() changed this
+// tick, and send each changed report once, then type as much of any
+// text as the keyboard queue has room for.  Returns the number of
+// reports sent.
+uint8_t actions_run(uint16_t tick);
+// Characters per second of the last text typed out, or 0 if none has
+// been.
+uint16_t actions_text_rate(void);
+// Switch presses and taps, and dial steps, that the rate limits in
+// keymap.h held back or merged away since actions_init().
+uint16_t actions_throttled_presses(void);
+uint16_t actions_throttled_steps(void);
+
+#endif
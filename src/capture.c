@@ -0,0 +1,79 @@
+// Raw pin change log for RAW_CAPTURE; see capture.h.
+//
+// The log is a ring buffer written by the tick interrupt and read by
+// the USB interrupt.  Interrupts don't nest, so neither side needs to
+// lock.
+
+#include "capture.h"
+
+#ifdef RAW_CAPTURE
+
+// Must be a power of two.
+#define CAPTURE_BUFFER_SIZE 64
+
+typedef struct {
+    uint16_t tick;
+    uint8_t pins;
+} CaptureRecord;
+
+static CaptureRecord capture_buffer[CAPTURE_BUFFER_SIZE];
+static uint8_t capture_head = 0;
+static uint8_t capture_tail = 0;
+static uint8_t capture_lost = 0;
+static uint16_t capture_tick_rate = 0;
+
+// Start with a value PINB & 0x7f can't have, so the first sample is
+// always recorded.
+static uint8_t capture_last_pins = 0xff;
+static uint16_t capture_last_tick = 0;
+
+void capture_init(uint16_t ticks_per_second)
+{
+    capture_tick_rate = ticks_per_second;
+}
+
+void capture_pins(uint8_t pins, uint16_t tick)
+{
+    uint8_t next;
+
+    if (pins == capture_last_pins && (uint16_t)(tick - capture_last_tick) < 0x8000) {
+        return;
+    }
+
+    next = (capture_head + 1) & (CAPTURE_BUFFER_SIZE - 1);
+    if (next == capture_tail) {
+        if (capture_lost < 255) capture_lost++;
+        return;
+    }
+    capture_buffer[capture_head].tick = tick;
+    capture_buffer[capture_head].pins = pins;
+    capture_head = next;
+    capture_last_pins = pins;
+    capture_last_tick = tick;
+}
+
+uint8_t capture_pending(void)
+{
+    return (capture_head - capture_tail) & (CAPTURE_BUFFER_SIZE - 1);
+}
+
+uint16_t capture_ticks_per_second(void)
+{
+    return capture_tick_rate;
+}
+
+uint8_t capture_take_lost(void)
+{
+    uint8_t lost = capture_lost;
+    capture_lost = 0;
+    return lost;
+}
+
+void capture_pop(uint16_t *tick, uint8_t *pins)
+{
+    *tick = capture_buffer[capture_tail].tick;
+    *pins = capture_buffer[capture_tail].pins;
+    capture_tail = (capture_tail + 1) & (CAPTURE_BUFFER_SIZE - 1);
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef capture_h__
+#define capture_h__
+
+#include <stdint.h>
+
+// Uncomment to log every change of the raw switch pins, as seen by the
+// tick interrupt, and stream the log to the host as report 3 on the
+// vendor interface (see usb_keyboard.c).  host/capture_dump turns the
+// stream into a trace file that the host tools replay tick for tick.
+// This turns off DIAL_FAST_SAMPLING (see main.c), so that the dial is
+// only sampled by the tick too.
+//#define RAW_CAPTURE
+
+#ifdef RAW_CAPTURE
+
+// Capture reports are 64 bytes:
+//
+//   byte 0      report ID (3)
+//   byte 1      sequence number, incremented for every report
+//   byte 2      number of records in this report
+//   byte 3      records lost to a full buffer since the last report
+//               (saturates at 255)
+//   byte 4, 5   ticks per second (LE16)
+//   byte 6...   records, CAPTURE_RECORD_SIZE bytes each:
+//                 tick (LE16), raw pins (PINB & 0x7f)
+//
+// A record means "from this tick on, the pins read like this".  If the
+// pins don't change for half the tick counter's range, the same pins
+// are recorded again so the host can keep track of time.
+#define CAPTURE_RECORD_SIZE		3
+#define CAPTURE_RECORDS_PER_REPORT	19
+
+// Called at startup with the tick rate, which goes into every report.
+void capture_init(uint16_t ticks_per_second);
+
+// Called from the tick interrupt with every sample.
+void capture_pins(uint8_t pins, uint16_t tick);
+
+// Called from the USB interrupt to drain the log.
+uint8_t capture_pending(void);
+uint16_t capture_ticks_per_second(void);
+uint8_t capture_take_lost(void);
+void capture_pop(uint16_t *tick, uint8_t *pins);
+
+#endif
+
+#endif
@@ -0,0 +1,96 @@
+// Writing EEPROM from the EE_READY interrupt; see eeprom_queue.h.
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "eeprom_queue.h"
+#include "stats.h"
+
+typedef struct {
+    uint8_t *dst;		// EEPROM
+    uint8_t const *src;		// RAM
+    uint8_t size;		// 0 if the slot is free
+    uint8_t done;		// bytes checked so far
+} Block;
+
+static Block blocks[EEPROM_QUEUE_BLOCKS];
+
+int8_t eeprom_queue(void *dst, void const *src, uint8_t size)
+{
+    uint8_t intr_state, i, free_slot = EEPROM_QUEUE_BLOCKS;
+    int8_t r = 0;
+
+    if (!size) return 0;
+    intr_state = SREG;
+    cli();
+    for (i = 0; i < EEPROM_QUEUE_BLOCKS; i++) { // wcet: 4
+        if (blocks[i].size && blocks[i].dst == dst && blocks[i].src == src) {
+            // Already queued: check it all again, for the new values.
+            blocks[i].size = size;
+            blocks[i].done = 0;
+            break;
+        }
+        if (!blocks[i].size && free_slot == EEPROM_QUEUE_BLOCKS) {
+            free_slot = i;
+        }
+    }
+    if (i == EEPROM_QUEUE_BLOCKS) {
+        if (free_slot == EEPROM_QUEUE_BLOCKS) {
+            r = -1;
+        } else {
+            blocks[free_slot].dst = dst;
+            blocks[free_slot].src = src;
+            blocks[free_slot].done = 0;
+            blocks[free_slot].size = size;
+        }
+    }
+    if (!r) {
+        // The interrupt fires as soon as the EEPROM isn't busy.
+        EECR |= (1<<EERIE);
+    }
+    SREG = intr_state;
+    return r;
+}
+
+uint8_t eeprom_queue_pending(void)
+{
+    // The interrupt turns itself off once everything is written.
+    return (EECR & (1<<EERIE)) != 0;
+}
+
+// Runs whenever the EEPROM is ready for another byte.  Reading a byte
+// takes a few cycles, so it skips straight past unchanged bytes, and
+// starts programming the first changed one.
+ISR(EE_READY_vect)
+{
+    uint8_t i;
+
+    for (i = 0; i < EEPROM_QUEUE_BLOCKS; i++) { // wcet: 4
+        Block *b = &blocks[i];
+
+        // The largest block queued is the tuning, 19 bytes.
+        while (b->done < b->size) { // wcet: 19
+            uint8_t *address = b->dst + b->done;
+            uint8_t value = b->src[b->done];
+
+            b->done++;
+            EEAR = (uintptr_t)address;
+            EECR |= (1<<EERE);
+            if (EEDR == value) {
+                STATS_COUNT(eeprom_skips);
+                continue;
+            }
+            // Erase and write in one operation; EEPE has to be set
+            // within four cycles of EEMPE.
+            EEDR = value;
+            EECR = (1<<EEMPE) | (1<<EERIE);
+            EECR |= (1<<EEPE);
+            STATS_COUNT(eeprom_writes);
+            return;
+        }
+        b->size = 0;
+    }
+    // Nothing left to write.
+    EECR &= ~(1<<EERIE);
+}
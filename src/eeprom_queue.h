@@ -0,0 +1,30 @@
+#ifndef eeprom_queue_h__
+#define eeprom_queue_h__
+
+#include <stdint.h>
+
+// Writing EEPROM without waiting for it.  Each byte takes about 3.4 ms
+// to program, nearly a whole tick, so eeprom_write_byte() and friends
+// would hold up the main loop for as long as a save takes.  Instead,
+// blocks of RAM are queued to be mirrored into EEPROM, and the
+// EE_READY interrupt programs them one byte at a time while the main
+// loop carries on.
+//
+// The bytes are read from RAM when they're written, not when they're
+// queued, so the RAM has to stay put until eeprom_queue_pending()
+// says it's done.  Queueing a block that's already queued starts it
+// again from its first byte instead of adding it twice, so a setting
+// that changes several times before it's saved is only written once,
+// with its latest value.  Bytes that already hold their value aren't
+// programmed at all.
+
+// Blocks that can be queued at once.
+#define EEPROM_QUEUE_BLOCKS 4
+
+// Mirror size bytes of RAM at src into EEPROM at dst (an EEMEM
+// address).  Returns 0, or -1 if there's no room in the queue.
+int8_t eeprom_queue(void *dst, void const *src, uint8_t size);
+// Whether any queued bytes are still to be written.
+uint8_t eeprom_queue_pending(void);
+
+#endif
@@ -0,0 +1,291 @@
+// Switch debouncing and dial decoding; see input.h.
+
+#include <stdint.h>
+
+#include "input.h"
+#include "tuning.h"
+
+typedef struct {
+    uint8_t state; // pin state
+    uint16_t count; // how many ticks it has been in this state
+    uint8_t bounces; // raw changes since the last debounced change
+} PinState;
+
+typedef enum {
+    DirectionCCW,
+    DirectionCW
+} Direction;
+
+// Switches that represent the dial.
+static uint8_t const DialA = 1; // PORTB1
+static uint8_t const DialB = 5; // PORTB5
+
+// Switch debounce states count how long a switch has been in a given
+// state.  Its calculated state (stored in debounced_switches and
+// long_press_switches) is updated after it has been in a given state
+// for tuning.debounce_ticks ticks, and then again after
+// tuning.long_press_ticks ticks.
+static PinState switch_debounce_states[7];
+
+// Switch states.  There are seven switches, with their states stored
+// in the 7 LSBs of these fields.  Logic 1 means the switch is NOT
+// pressed.
+uint8_t debounced_switches = 0x7f;
+uint8_t long_press_switches = 0x7f;
+
+// Raw switch states from the previous tick, and a mask of switches
+// whose debounce count is still running.  When the raw states haven't
+// changed and no switch is counting, there's no debouncing to do,
+// which at fast tick rates is true for almost every tick.
+static uint8_t last_raw_switches_state = 0x7f;
+static uint8_t counting_switches = 0x7f;
+
+// Switches configured as TapHold.
+static uint8_t tap_hold_switches = 0;
+
+// Switches that need a long press: the rest stop counting once
+// they're debounced, and never report one.
+static uint8_t long_press_tracked = 0x7f;
+
+// Dial decoding state: whether it's between detents, which way it's
+// going, and where (the A pin) it was at the last detent.
+typedef struct {
+    uint8_t moving;
+    uint8_t position;
+    Direction direction;
+} DialState;
+
+// The dial as seen through debounced_switches, and as sampled raw by
+// input_sample_dial().
+static DialState debounced_dial = { 0, 1, DirectionCCW };
+static DialState sampled_dial = { 0, 1, DirectionCCW };
+static uint16_t last_detent_tick = 0;
+
+// Detents from input_sample_dial() that input_update_dial() hasn't
+// reported yet (positive clockwise).
+static int8_t pending_detents = 0;
+
+void input_init(uint8_t tap_hold, uint8_t long_press, uint8_t raw_pins) {
+    for (uint8_t i = 0; i < 7; i++) { // wcet: 7
+        switch_debounce_states[i].state = 1;
+        switch_debounce_states[i].count = 0;
+        switch_debounce_states[i].bounces = 0;
+    }
+    debounced_switches = 0x7f;
+    long_press_switches = 0x7f;
+    last_raw_switches_state = 0x7f;
+    counting_switches = 0x7f;
+    tap_hold_switches = tap_hold;
+    // Tap-hold switches resolve as held after a long press, too.
+    long_press_tracked = long_press | tap_hold;
+
+    debounced_dial.moving = 0;
+    debounced_dial.position = (raw_pins >> DialA) & 0x01;
+    debounced_dial.direction = DirectionCCW;
+    sampled_dial = debounced_dial;
+    last_detent_tick = 0;
+    pending_detents = 0;
+}
+
+void input_restart_debounce(void) {
+    // Counts taken with the old times may already be past the new
+    // ones, so every switch starts debouncing again from its current
+    // state.
+    for (uint8_t i = 0; i < 7; i++) { // wcet: 7
+        switch_debounce_states[i].count = 0;
+    }
+    counting_switches = 0x7f;
+}
+
+// Resolve tap-hold switches as held, with a long press.
+static void resolve_held(uint8_t switches, uint16_t tick) {
+    long_press_switches &= ~switches;
+    for (uint8_t i = 0; i < 7; i++) { // wcet: 7
+        if ((switches >> i) & 0x01) {
+            input_event(EVENT_LONG_PRESS | i, 0, tick);
+        }
+    }
+}
+
+uint8_t input_update(uint8_t raw_switches_state, uint16_t tick) {
+    if (raw_switches_state == last_raw_switches_state && !counting_switches) {
+        return 0;
+    }
+    last_raw_switches_state = raw_switches_state;
+
+    // Tap-hold switches that are down but not yet resolved as held.
+    // Any other switch being pressed, or the dial moving, resolves
+    // them as held.
+    uint8_t undecided_switches = tap_hold_switches & ~debounced_switches & long_press_switches;
+    uint8_t other_activity = 0;
+
+    for(int i = 0; i < 7; i++) { // wcet: 7
+        uint8_t key_val = (raw_switches_state >> i) & 0x01;
+        if (key_val != switch_debounce_states[i].state) {
+            // Any time the read value doesn't match our debounce
+            // state, we reset the count.
+
+            switch_debounce_states[i].count = 0;
+            switch_debounce_states[i].state = key_val;
+            if (switch_debounce_states[i].bounces < 255) {
+                switch_debounce_states[i].bounces++;
+            }
+            counting_switches |= (0x01 << i);
+
+        } else if ((counting_switches >> i) & 0x01) {
+            // If it DOES match and we haven't reached the debounce
+            // tick limit, we increment it.
+
+            switch_debounce_states[i].count++;
+
+            if (switch_debounce_states[i].count == tuning.debounce_ticks) {
+                // Once we've hit the tick limit, we register that as
+                // a keypress state change.
+
+                // Clear the bit for this switch, and then set it to
+                // the new, debounced value.
+
+                if (((debounced_switches >> i) & 0x01) != key_val) {
+                    // The first raw change is the press or release
+                    // itself, not a bounce.
+                    input_event((key_val ? EVENT_RELEASE : EVENT_PRESS) | i,
+                                switch_debounce_states[i].bounces - 1,
+                                tick);
+                }
+                switch_debounce_states[i].bounces = 0;
+
+                if (((debounced_switches >> i) & 0x01) != key_val &&
+                    (key_val == 0 || i == DialA || i == DialB)) {
+                    other_activity |= (0x01 << i);
+                }
+
+                debounced_switches &= ~(0x01 << i);
+                debounced_switches |= (key_val << i);
+
+                if (key_val == 1) {
+                    // We need to release the long press for this
+                    // switch immediately upon release.
+                    long_press_switches |= (key_val << i);
+
+                    // Released switches have no long press to wait
+                    // for, so we can stop counting.
+                    counting_switches &= ~(0x01 << i);
+                } else if (!((long_press_tracked >> i) & 0x01)) {
+                    counting_switches &= ~(0x01 << i);
+                }
+            }
+
+            if (switch_debounce_states[i].count == tuning.long_press_ticks) {
+                if (key_val == 0) {
+                    // The tick limit for a long press has been
+                    // reached, so we register this as a long button
+                    // press.
+
+                    long_press_switches &= ~(0x01 << i);
+                    input_event(EVENT_LONG_PRESS | i, 0, tick);
+                }
+                counting_switches &= ~(0x01 << i);
+            }
+        }
+    }
+
+    // A switch released this tick was a tap, whatever else happened.
+    undecided_switches &= ~debounced_switches;
+    if (undecided_switches && (other_activity & ~undecided_switches)) {
+        resolve_held(undecided_switches, tick);
+    }
+    return 1;
+}
+
+// Number of steps a dial detent counts as, when it came `ticks` after
+// the previous one.
+static uint8_t dial_steps(uint16_t ticks) {
+    for (uint8_t i = 0; i < DIAL_CURVE_POINTS; i++) { // wcet: 4
+        if (tuning.dial_curve[i].steps && ticks <= tuning.dial_curve[i].within_ticks) {
+            return tuning.dial_curve[i].steps;
+        }
+    }
+    return 1;
+}
+
+// Follow the dial's A and B pins.  Returns 1 for a clockwise detent,
+// -1 for an anticlockwise one, and 0 otherwise.
+static int8_t decode_dial(DialState *dial, uint8_t a, uint8_t b) {
+    if (a != b) {
+        // The dial inputs are different from one another, so
+        // it's moving now.
+        dial->moving = 1;
+        dial->direction = (a != dial->position) ? DirectionCW : DirectionCCW;
+    } else if (dial->moving) {
+        // Dial was moving but now has stopped, as indicated
+        // by the fact that the two inputs now have the same
+        // value.
+        dial->moving = 0;
+        if (a != dial->position) {
+            // Dial moved to new position.
+            dial->position = a;
+            return dial->direction == DirectionCW ? 1 : -1;
+        } else {
+            // Dial returned to old position.  (Nothing to
+            // do.)
+        }
+    } else if (a != dial->position) {
+        // Dial isn't moving, and A and B positions match, but
+        // they don't match what we expect so we missed a full
+        // click and need to update our internal state to
+        // match.
+        dial->position = a;
+    }
+    return 0;
+}
+
+int8_t input_sample_dial(uint8_t raw_pins) {
+    return decode_dial(&sampled_dial, (raw_pins >> DialA) & 0x01, (raw_pins >> DialB) & 0x01);
+}
+
+void input_add_detents(int8_t detents, uint16_t tick) {
+    if (!detents) {
+        return;
+    }
+    // The dial turning resolves tap-hold switches as held, as its
+    // debounced pins changing does in input_update().
+    uint8_t undecided_switches = tap_hold_switches & ~debounced_switches & long_press_switches;
+    if (undecided_switches) {
+        resolve_held(undecided_switches, tick);
+    }
+
+    int16_t pending = pending_detents + detents;
+    if (pending > DIAL_MAX_STEPS) {
+        pending = DIAL_MAX_STEPS;
+    } else if (pending < -DIAL_MAX_STEPS) {
+        pending = -DIAL_MAX_STEPS;
+    }
+    pending_detents = pending;
+}
+
+uint8_t input_dial_pending(void) {
+    return pending_detents != 0;
+}
+
+int16_t input_update_dial(uint16_t tick) {
+    int8_t detent;
+
+    if (pending_detents) {
+        // One sampled detent per tick, so each gets its own event
+        // and its own place on the dial curve.
+        detent = pending_detents > 0 ? 1 : -1;
+        pending_detents -= detent;
+    } else {
+        detent = decode_dial(&debounced_dial,
+                             (debounced_switches >> DialA) & 0x01,
+                             (debounced_switches >> DialB) & 0x01);
+    }
+    if (!detent) {
+        return 0;
+    }
+
+    input_event(detent > 0 ? EVENT_DIAL_CW : EVENT_DIAL_CCW, 0, tick);
+    int16_t steps = dial_steps(tick - last_detent_tick);
+    last_detent_tick = tick;
+    return detent > 0 ? steps : -steps;
+}
@@ -0,0 +1,76 @@
+#ifndef input_h__
+#define input_h__
+
+#include <stdint.h>
+
+// Debouncing, long presses and dial decoding for the seven switch
+// pins (PINB & 0x7f; 1 = open, 0 = pressed).  Nothing in here touches
+// the hardware, so the host tools in host/ build the same file and
+// replay recorded pins through exactly the code the firmware runs.
+// Times come from the current tuning (see tuning.h), in ticks.
+
+// Post-debouncing switch states: 0 = pressed and 1 = not pressed.
+extern uint8_t debounced_switches;
+// Long-press states: 0 = pressed for a long time and 1 = not pressed
+// for a long time yet.  When a bit is set 1 in debounced_switches, it
+// is also set 1 here, so long presses are only counted for button
+// presses.
+extern uint8_t long_press_switches;
+
+// Event types passed to input_event(), which are also the event types
+// of the vendor interface's event stream.  Switch events carry the
+// switch number (PORTB bit) in the low nibble and the number of
+// bounces seen while debouncing as their value.  Hold durations and
+// dial timing come from the events' timestamps.
+#define EVENT_PRESS         0x10
+#define EVENT_RELEASE       0x20
+#define EVENT_LONG_PRESS    0x30
+#define EVENT_DIAL_CW       0x40
+#define EVENT_DIAL_CCW      0x50
+// Pin change made by the synthetic input generator; the value is the
+// new raw pin state.  Comparing these with the events above gives
+// press-to-event latency.
+#define EVENT_SYNTH_EDGE    0x60
+
+// Start with every switch released.  tap_hold is a mask of the
+// switches that resolve as held as soon as something else happens
+// (TapHold in main.c), long_press is a mask of the switches that report
+// long presses at all, and raw_pins gives the dial's starting position.
+void input_init(uint8_t tap_hold, uint8_t long_press, uint8_t raw_pins);
+// Start every switch's debounce count again, eg. after the tuning
+// changed.
+void input_restart_debounce(void);
+// Debounce one tick's raw pins.  tick is only used for timestamps.
+// Returns 0 if there was nothing to do: the pins hadn't changed and no
+// switch was counting.
+uint8_t input_update(uint8_t raw_pins, uint16_t tick);
+// Follow the dial after input_update changed debounced_switches, or
+// report a detent left by input_add_detents().  Returns the steps the
+// dial moved by (positive clockwise), with the dial curve applied, or
+// 0 if it didn't finish a detent.
+int16_t input_update_dial(uint16_t tick);
+
+// The dial's pins (PB1 and PB5), for masking out of input_update()'s
+// raw pins when they're sampled with input_sample_dial() instead.
+#define DIAL_PINS 0x22
+
+// Decode the dial straight from raw pins, without debouncing; for
+// sampling them many times per tick (DIAL_FAST_SAMPLING in main.c).
+// A quadrature dial's pins never change together, so a bounce only
+// steps back and forth between neighbouring states and can't make a
+// detent by itself.  Returns 1 for a clockwise detent, -1 for an
+// anticlockwise one, and 0 otherwise.
+int8_t input_sample_dial(uint8_t raw_pins);
+// Hand over the detents input_sample_dial() counted since the last
+// tick, after input_update().  Any detent resolves tap-hold switches
+// as held.  input_update_dial() reports them one per tick; up to
+// DIAL_MAX_STEPS either way are kept.
+void input_add_detents(int8_t detents, uint16_t tick);
+// Whether input_add_detents() left detents for input_update_dial().
+uint8_t input_dial_pending(void);
+
+// Called by the above for each event.  The firmware sends them on the
+// vendor interface; the host tools record them.
+void input_event(uint8_t type, uint8_t value, uint16_t tick);
+
+#endif
@@ -0,0 +1,266 @@
+#ifndef keymap_h__
+#define keymap_h__
+
+// What each switch and the dial send.  This is only included by
+// actions.c, which the host tools in host/ build too, so they send
+// exactly the keys the firmware would.
+
+#include <stdint.h>
+
+#include "usb_keyboard.h"
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#else
+// The host tools keep text in RAM.
+#define PROGMEM
+#define pgm_read_byte(address) (*(uint8_t const *)(address))
+#endif
+
+// Multimedia keys aren't listed in usb_keyboard.h.
+// 
+// The ones used here are from usb_hid_usages.txt, from
+// http://www.freebsddiary.org/APC/usb_hid_usages
+// 
+// Translate.pdf is also included, from:
+//
+// http://download.microsoft.com/download/1/6/1/161ba512-40e2-4cc9-843a-923143f3456c/translate.pdf
+// mirror: http://www.hiemalis.org/~keiji/PC/scancode-translate.pdf
+//
+// It has some extra keys that are missing from usb_hid_usages, most
+// notably play/pause.
+//
+// Add more to this list if you need them, and then add them to
+// SwitchActionMap.
+
+#define MediaKey(scancode) (0x1000 | scancode)
+
+#define MODIFIER_KEYS_START 224
+#define MODIFIER_KEYS_END 231
+
+#define KEY_CTRL	224
+#define KEY_SHIFT	225
+#define KEY_ALT		226
+#define KEY_GUI		227
+#define KEY_LEFT_CTRL   224
+#define KEY_LEFT_SHIFT	225
+#define KEY_LEFT_ALT	226
+#define KEY_LEFT_GUI	227
+#define KEY_RIGHT_CTRL	228
+#define KEY_RIGHT_SHIFT	229
+#define KEY_RIGHT_ALT	230
+#define KEY_RIGHT_GUI	231
+
+// Wrapping a key in MediaKey makes it send as a "consumer" key (0x0C / 12
+// in the above tables).
+#define KEY_VOLUME_UP MediaKey(0xe9)
+#define KEY_VOLUME_DOWN MediaKey(0xea)
+#define KEY_VOLUME_MUTE MediaKey(0xe2) // no effect on Nexus 7
+#define KEY_SLEEP MediaKey(0x32)
+#define KEY_POWER MediaKey(0x30) // Nexus 7: sending KEY_POWER shows the power-off menu; holding KEY_SLEEP does the same
+#define KEY_PLAYPAUSE MediaKey(0xcd)
+#define KEY_STOP MediaKey(0xb7)
+#define KEY_PREV MediaKey(0xb6)
+#define KEY_NEXT MediaKey(0xb5)
+#define KEY_REWIND MediaKey(0xb4)
+#define KEY_FASTFORWARD MediaKey(0xb3)
+#define KEY_WWWHOME MediaKey(0x223) // Nexus 7: same as device home button
+#define KEY_WWWSEARCH MediaKey(0x221) // Nexus 7: this is the same as the hardware search button on many devices, but note that it triggers upon release, not press
+
+typedef struct {
+    uint16_t *press_keys;
+    uint16_t *long_press_keys;
+    uint8_t flags; // 0 or TapHold
+    char const *text; // in flash (PROGMEM), or NULL
+} SwitchAction;
+
+// Resolve a press + long_press switch as soon as something else
+// happens (see below), instead of only by the long press time.
+#define TapHold 0x01
+
+// A token bucket: one report's worth of time every interval_us,
+// saving up to capacity_us.  An interval of 0 means no limit.
+typedef struct {
+    uint16_t interval_us;
+    uint32_t capacity_us;
+} RateLimit;
+
+// Up to per_second reports a second (16 or more), and bursts of up to
+// burst reports after a quiet spell.  Every action sends two reports,
+// a press and its release, so burst has to be at least 2.
+#define Limit(per_second, burst) \
+    { 1000000UL / (per_second), (uint32_t)(burst) * (1000000UL / (per_second)) }
+#define Unlimited { 0, 0 }
+
+// Action classes, for RateLimits below.
+#define SwitchClass 0
+#define DialClass 1
+
+//
+// Begin user-configurable section.
+//
+
+// Specify NULL instead of an array to not send any keys when that
+// switch is pressed.
+//
+// End each array with 0 to indicate the end of the array.  Keep them
+// to 8 keys or fewer; host/wcet counts on that for its cycle budgets.
+//
+// Long presses behave the following way:
+//
+//   press = NULL, long_press = NULL:
+//
+//     No action when pressed/released
+//
+//   press = keys, long_press = NULL:
+//
+//     When switch is active, the keys are pressed and held until the
+//     switch is released.
+//
+//   press = keys, long_press = keys:
+//
+//     When switch is active, nothing happens until LONG_PRESS_MS
+//     (in main.c) have passed; then the long-press keys are pressed
+//     and held until the switch is released.  If the switch is released
+//     before LONG_PRESS_MS, then the normal keys are sent briefly
+//     (ie. a single keypress).
+//
+//   press = NULL, long_press = keys:
+//
+//     Same as previous but nothing happens if the switch is released
+//     before LONG_PRESS_MS.
+// 
+//
+//  Example: Pressing this button would send shift, 2, 3, and
+//    play/pause, resulting in the characters @# and the media
+//    play/pausing.
+//
+// { ((uint16_t[]){ KEY_2, KEY_SHIFT, KEY_3, KEY_PLAYPAUSE, 0 }),
+//   ((uint16_t[]){ KEY_W, 0 }) },   
+//
+//
+// Example: Pressing this button immediately sends a '2'.  Holding
+//   it triggers key-repeat on the host until it's released.
+//
+// { ((uint16_t[]){ KEY_2, 0 }),
+//   NULL },   
+//
+// Example: Pressing this button does nothing immediately.  If you
+//   release it quickly, it sends a 1 upon release.  If you hold it,
+//   it sends shift+Q and holds them down until you release,
+//   triggering key-repeat on the host.
+//
+// { (uint16_t[]){ KEY_1, 0 },     
+//   (uint16_t[]){ KEY_Q, KEY_SHIFT, 0 } },
+//
+// Dual-role (tap-hold) switches:
+//
+//   press = keys, long_press = keys, flags = TapHold:
+//
+//     Like press + long_press above, except the switch also counts
+//     as held the moment another switch is pressed or the dial moves
+//     while it's down.  This makes the long-press keys usable as
+//     modifiers for other switches and the dial.  Switches without
+//     TapHold are unaffected and work exactly as before.
+//
+// Example: Tapping this button sends play/pause.  Holding it holds
+//   down the GUI key, so pressing another button or turning the dial
+//   while it's held sends GUI plus that button's keys.
+//
+// { (uint16_t[]){ KEY_PLAYPAUSE, 0 },
+//   (uint16_t[]){ KEY_LEFT_GUI, 0 },
+//   TapHold },
+//
+// Typing text:
+//
+//   text = a string in flash:
+//
+//     The string is typed out once, at the same moment the press
+//     keys would be pressed (so on a tap, if the switch also has
+//     long-press keys), along with any press keys.  It goes out as
+//     fast as the host polls the keyboard, about a character per ms.
+//     Printable ASCII, \n and \t are typed as on a US keyboard, and
+//     anything else is skipped.  Pressing a text switch while text
+//     is still being typed does nothing.
+//
+// Example: Pressing this button types a signature.
+//
+// static char const signature[] PROGMEM = "-- \nThe Management\n";
+//
+// { NULL, NULL, 0, signature },
+//
+static SwitchAction const SwitchActionMap[7] = {
+    // PORTB0 = S2 / down
+    { (uint16_t[]){ KEY_STOP, 0 },
+      (uint16_t[]){ KEY_WWWHOME, 0 } },   
+
+    // PORTB1 = A (dial; ignored)
+    { NULL, NULL },              
+
+    // PORTB2 = S1 / center
+    { (uint16_t[]){ KEY_SLEEP, 0 },     
+      NULL },
+
+    // PORTB3 = S5 / left
+    { (uint16_t[]){ KEY_PREV, 0 },     
+      (uint16_t[]){ KEY_REWIND, 0 } },
+
+    // PORTB4 = S4 / up
+    { (uint16_t[]){ KEY_PLAYPAUSE, 0 },     
+      NULL },
+
+    // PORTB5 = B (dial; ignored)
+    { NULL, NULL },              
+
+    // PORTB6 = S3 / right
+    { (uint16_t[]){ KEY_NEXT, 0 },
+      (uint16_t[]){ KEY_FASTFORWARD, 0 } }
+};
+
+// The keys sent for each counter-clockwise or clockwise rotation of
+// the dial.  These are key arrays that work like the actions above,
+// so you could send multiple keys for each dial click if you really
+// wanted.
+static uint16_t const DialCCWKeys[] = { KEY_VOLUME_DOWN, 0 };
+static uint16_t const DialCWKeys[] = { KEY_VOLUME_UP, 0 };
+
+// Rate limits, to protect slow hosts from a chattering switch or a
+// wildly spun dial.  Each action class has a limit for each report
+// (endpoint) its keys are on, and each switch press, switch tap or
+// dial step takes two reports' worth from every one it uses: the press
+// and the release that follows it.  When one runs out, the rest wait
+// instead of being dropped:
+//
+//   - A held-back press goes out when the limit allows.  If the
+//     switch is released first, it becomes a tap, and further taps of
+//     the same switch while it waits merge into it.
+//   - Dial steps add up, both ways, and go out as the limit allows.
+//     Up to DIAL_MAX_STEPS are kept, so the volume doesn't carry on
+//     moving long after the dial has stopped.
+//
+// Releases are never held back, so no key is left stuck down, and
+// neither are long presses, which take a switch held for the long
+// press time or another switch's press.  Text paces itself by the
+// keyboard queue, and absolute volume (USB_ABSOLUTE_VOLUME) only ever
+// sends the latest level, so neither is limited.
+//
+// The pad queues up to 8 reports per endpoint (USB_IN_QUEUE_DEPTH in
+// usb_keyboard.c) and replaces the newest when that's full, so the
+// bursts of both classes together should fit in 8, and their rates
+// together should stay under the endpoint's polling rate (125 a second
+// for media).
+static RateLimit const RateLimits[2][2] = {
+    //               keyboard         media
+    [SwitchClass] = { Limit(20, 4),   Limit(20, 4) },
+    [DialClass]   = { Limit(100, 4),  Limit(100, 4) },
+};
+
+//
+// End of the keymap.
+//
+
+#endif
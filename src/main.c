@@ -7,203 +7,138 @@
 #include <stdint.h>
 
 #include "usb_keyboard.h"
-
-#ifndef NULL
-#define NULL ((void *)0)
-#endif
-
-//
-// Private definitions and types
-//
-
-// Multimedia keys aren't listed in usb_keyboard.h.
-// 
-// The ones used here are from usb_hid_usages.txt, from
-// http://www.freebsddiary.org/APC/usb_hid_usages
-// 
-// Translate.pdf is also included, from:
-//
-// http://download.microsoft.com/download/1/6/1/161ba512-40e2-4cc9-843a-923143f3456c/translate.pdf
-// mirror: http://www.hiemalis.org/~keiji/PC/scancode-translate.pdf
-//
-// It has some extra keys that are missing from usb_hid_usages, most
-// notably play/pause.
-//
-// Add more to this list if you need them, and then add them to
-// SwitchActionMap.
-
-#define MediaKey(scancode) (0x1000 | scancode)
-
-#define MODIFIER_KEYS_START 224
-#define MODIFIER_KEYS_END 231
-
-#define KEY_CTRL	224
-#define KEY_SHIFT	225
-#define KEY_ALT		226
-#define KEY_GUI		227
-#define KEY_LEFT_CTRL   224
-#define KEY_LEFT_SHIFT	225
-#define KEY_LEFT_ALT	226
-#define KEY_LEFT_GUI	227
-#define KEY_RIGHT_CTRL	228
-#define KEY_RIGHT_SHIFT	229
-#define KEY_RIGHT_ALT	230
-#define KEY_RIGHT_GUI	231
-
-// Wrapping a key in MediaKey makes it send as a "consumer" key (0x0C / 12
-// in the above tables).
-#define KEY_VOLUME_UP MediaKey(0xe9)
-#define KEY_VOLUME_DOWN MediaKey(0xea)
-#define KEY_VOLUME_MUTE MediaKey(0xe2) // no effect on Nexus 7
-#define KEY_SLEEP MediaKey(0x32)
-#define KEY_POWER MediaKey(0x30) // Nexus 7: sending KEY_POWER shows the power-off menu; holding KEY_SLEEP does the same
-#define KEY_PLAYPAUSE MediaKey(0xcd)
-#define KEY_STOP MediaKey(0xb7)
-#define KEY_PREV MediaKey(0xb6)
-#define KEY_NEXT MediaKey(0xb5)
-#define KEY_REWIND MediaKey(0xb4)
-#define KEY_FASTFORWARD MediaKey(0xb3)
-#define KEY_WWWHOME MediaKey(0x223) // Nexus 7: same as device home button
-#define KEY_WWWSEARCH MediaKey(0x221) // Nexus 7: this is the same as the hardware search button on many devices, but note that it triggers upon release, not press
-
-typedef struct {
-    uint8_t state; // pin state
-    uint16_t count; // how many ticks it has been in this state
-} PinState;
-
-typedef enum {
-    DirectionCCW,
-    DirectionCW
-} Direction;
-
-typedef struct {
-    uint16_t *press_keys;
-    uint16_t *long_press_keys;
-} SwitchAction;
+#include "synth.h"
+#include "stats.h"
+#include "capture.h"
+#include "tuning.h"
+#include "input.h"
+#include "actions.h"
+#include "keymap_features.h"
 
 //
 // Begin user-configurable section.
 //
 
-// Specify NULL instead of an array to not send any keys when that
-// switch is pressed.
-//
-// End each array with 0 to indicate the end of the array.
-//
-// Long presses behave the following way:
-//
-//   press = NULL, long_press = NULL:
-//
-//     No action when pressed/released
-//
-//   press = keys, long_press = NULL:
-//
-//     When switch is active, the keys are pressed and held until the
-//     switch is released.
-//
-//   press = keys, long_press = keys:
-//
-//     When switch is active, nothing happens until LongPressTime
-//     ticks have passed; then the long-press keys are pressed and
-//     held until the switch is released.  If the switch is released
-//     before LongPressTime, then the normal keys are sent briefly
-//     (ie. a single keypress).
-//
-//   press = NULL, long_press = keys:
-//
-//     Same as previous but nothing happens if the switch is released
-//     before LongPressTime.
-// 
-//
-//  Example: Pressing this button would send shift, 2, 3, and
-//    play/pause, resulting in the characters @# and the media
-//    play/pausing.
-//
-// { ((uint16_t[]){ KEY_2, KEY_SHIFT, KEY_3, KEY_PLAYPAUSE, 0 }),
-//   ((uint16_t[]){ KEY_W, 0 }) },   
-//
-//
-// Example: Pressing this button immediately sends a '2'.  Holding
-//   it triggers key-repeat on the host until it's released.
-//
-// { ((uint16_t[]){ KEY_2, 0 }),
-//   NULL },   
-//
-// Example: Pressing this button does nothing immediately.  If you
-//   release it quickly, it sends a 1 upon release.  If you hold it,
-//   it sends shift+Q and holds them down until you release,
-//   triggering key-repeat on the host.
+// The keys each switch and the dial send are in keymap.h.
+
+// Dial acceleration.  Turning the dial quickly can count each detent
+// as more than one step (more key presses, or a bigger change in
+// absolute volume mode).  Each DialPoint(ms, steps) applies to detents
+// within ms of the previous one, and the first point that applies is
+// used.  Slower detents count as one step.  Up to four points.
 //
-// { (uint16_t[]){ KEY_1, 0 },     
-//   (uint16_t[]){ KEY_Q, KEY_SHIFT, 0 } },
+// Example: a quick spin counts four times, a brisk one twice.
 //
-static SwitchAction const SwitchActionMap[7] = {
-    // PORTB0 = S2 / down
-    { (uint16_t[]){ KEY_STOP, 0 },
-      (uint16_t[]){ KEY_WWWHOME, 0 } },   
-
-    // PORTB1 = A (dial; ignored)
-    { NULL, NULL },              
-
-    // PORTB2 = S1 / center
-    { (uint16_t[]){ KEY_SLEEP, 0 },     
-      NULL },
-
-    // PORTB3 = S5 / left
-    { (uint16_t[]){ KEY_PREV, 0 },     
-      (uint16_t[]){ KEY_REWIND, 0 } },
-
-    // PORTB4 = S4 / up
-    { (uint16_t[]){ KEY_PLAYPAUSE, 0 },     
-      NULL },
+// #define DIAL_CURVE { DialPoint(40, 4), DialPoint(100, 2) }
+#define DIAL_CURVE { DialPoint(0, 0) }
 
-    // PORTB5 = B (dial; ignored)
-    { NULL, NULL },              
+// Milliseconds that must pass before a held key is treated as a long
+// press.  This must be longer than the debounce time (see
+// DEBOUNCE_MS).
+#define LONG_PRESS_MS 655 // About 2/3 of a second.
 
-    // PORTB6 = S3 / right
-    { (uint16_t[]){ KEY_NEXT, 0 },
-      (uint16_t[]){ KEY_FASTFORWARD, 0 } }
-};
-
-// The keys sent for each counter-clockwise or clockwise rotation of
-// the dial.  These are key arrays that work like the actions above,
-// so you could send multiple keys for each dial click if you really
-// wanted.
-static uint16_t const DialCCWKeys[] = { KEY_VOLUME_DOWN, 0 };
-static uint16_t const DialCWKeys[] = { KEY_VOLUME_UP, 0 };
-
-// Number of ticks that must pass before a held key is treated as a
-// long press.  This must be greater than DebounceTickLimit.
-//
-// We get 244.14 ticks per second (configurable; see Timer0Overflow),
-// so you can calculate your preferred time:
-//
-// LongPressTime = time_in_ms * 244.14 / 1000
-static uint16_t const LongPressTime = 160;   // About 2/3 of a second.
+// The timing settings here and below (tick rate, debounce and long
+// press times, and the dial curve) are only the defaults.  The host
+// can change them at runtime through the vendor interface, and
+// changes are kept in EEPROM; see tuning.h.
 
 // You probably won't need or want to change anything after this
 // line.
 
-// Timer 0 clock select (prescaling; controls TCCR0B[2:0] aka
-// CS0[2:0]).
+// Tick source.  Everything (debouncing, long presses, the dial) is
+// sampled once per tick.
 //
-// This controls how fast the system ticks.  We need to debounce
-// before registering a keypress, so this should be reasonably fast in
-// order to feel responsive.  See also DebounceTickLimit, which should
-// be decreased if you increase the tick frequency.
+// With TICK_SOURCE_CTC defined, timer 0 runs in CTC (clear timer on
+// compare match) mode and ticks exactly every TICK_PERIOD_US
+// microseconds.  The period must be a multiple of 4 us between
+// TICK_PERIOD_MIN_US (256, see tuning.h) and 1024 us.
+//
+// Comment out TICK_SOURCE_CTC to use the old free-running timer 0
+// overflow instead.  Its rate comes from the prescaler in
+// TIMER0_CLOCK_SELECT (TCCR0B[2:0] aka CS0[2:0]) and is never a whole
+// number of milliseconds.  TIMER0_PRESCALE must match it, and it can't
+// be faster than clkIO/64:
 //
 //   0x05; // clkIO/1024 -> 61 Hz
 //   0x04; // clkIO/256 -> 244.14 Hz
 //   0x03; // clkIO/64 -> 976.6 Hz
-static uint8_t const Timer0Overflow = 0x04;
+#define TICK_SOURCE_CTC
+#define TICK_PERIOD_US 1000
+
+#define TIMER0_CLOCK_SELECT 0x04
+#define TIMER0_PRESCALE 256
+
+// Dial sampling.  With DIAL_FAST_SAMPLING defined, the dial's pins are
+// left out of the tick's debouncing and decoded raw by timer 2 every
+// DIAL_SAMPLE_US microseconds instead, so a fast spin isn't limited by
+// the tick rate and the debounce time.  Timer 2 only interrupts while
+// the dial is turning: a change on either dial pin starts it, and it
+// stops once the pins have been still for DIAL_IDLE_SAMPLES samples.
+// The period must be a multiple of 4 us between 4 and 1024 us.
+//
+// Comment out DIAL_FAST_SAMPLING to debounce the dial once per tick
+// like the other switches.
+#define DIAL_FAST_SAMPLING
+#define DIAL_SAMPLE_US 256
+#define DIAL_IDLE_SAMPLES 32
+
+// A capture (RAW_CAPTURE in capture.h) only logs the pins once per
+// tick, so it couldn't replay dial samples taken in between.  Capture
+// builds debounce the dial with the tick instead.
+#ifdef RAW_CAPTURE
+#undef DIAL_FAST_SAMPLING
+#endif
 
-// Number of consecutive ticks that a switch has to maintain the same
-// value in order to register a keypress.
-//
-// Calculated the same way as LongPressTime, and affected by
-// Timer0Overflow in the same way as well.
-static uint8_t const DebounceTickLimit = 3;
+// Ticks per second for the configured tick source, and conversion
+// from milliseconds to ticks, rounded to the nearest tick.
+#if defined(TICK_SOURCE_CTC)
+#if (TICK_PERIOD_US % 4) || TICK_PERIOD_US < TICK_PERIOD_MIN_US || \
+    TICK_PERIOD_US > 1024
+#error "TICK_PERIOD_US must be a multiple of 4 between TICK_PERIOD_MIN_US and 1024"
+#endif
+#define TICKS_PER_SECOND (1000000UL / TICK_PERIOD_US)
+#else
+#if TIMER0_CLOCK_SELECT < 0x03 || TIMER0_CLOCK_SELECT > 0x05
+#error "TIMER0_CLOCK_SELECT must be 0x03, 0x04 or 0x05"
+#endif
+#define TICKS_PER_SECOND (F_CPU / TIMER0_PRESCALE / 256)
+#endif
+#define MsToTicks(ms) ((uint16_t)(((uint32_t)(ms) * TICKS_PER_SECOND + 500) / 1000))
+
+#if defined(DIAL_FAST_SAMPLING) && \
+    ((DIAL_SAMPLE_US % 4) || DIAL_SAMPLE_US < 4 || DIAL_SAMPLE_US > 1024)
+#error "DIAL_SAMPLE_US must be a multiple of 4 between 4 and 1024"
+#endif
+
+// Pins the tick reads as released whatever they're doing: switches
+// with nothing in the keymap, which then never need debouncing, and
+// the dial if it's sampled separately.  Without fast sampling the dial
+// pins are debounced whether they're in the keymap or not.
+#ifdef DIAL_FAST_SAMPLING
+#define IGNORED_PINS ((0x7f & ~KEYMAP_SWITCHES) | DIAL_PINS)
+#else
+#define IGNORED_PINS (0x7f & ~KEYMAP_SWITCHES & ~DIAL_PINS)
+#endif
 
+// Milliseconds that a switch has to maintain the same value in order
+// to register a keypress.
+#define DEBOUNCE_MS 12
+
+// debounce_ticks in the tuning is a byte.
+#if (DEBOUNCE_MS * TICKS_PER_SECOND + 500) / 1000 > 255
+#error "DEBOUNCE_MS is too many ticks at this tick rate"
+#endif
+
+#define DialPoint(ms, steps) { MsToTicks(ms), (steps) }
+
+static Tuning const PROGMEM TuningDefaults = {
+    TUNING_VERSION,
+    TICK_PERIOD_US,
+    TIMER0_CLOCK_SELECT,
+    MsToTicks(DEBOUNCE_MS),
+    MsToTicks(LONG_PRESS_MS),
+    DIAL_CURVE
+};
 
 //
 // End of user-configurable stuff.
@@ -215,14 +150,6 @@ static uint8_t const DebounceTickLimit = 3;
 #define LED_OFF		(PORTD &= ~(1<<6))
 #define LED_ON		(PORTD |= (1<<6))
 
-//
-// Constants
-//
-
-// Switches that represent the dial.
-static uint8_t const DialA = 1; // PORTB2
-static uint8_t const DialB = 5; // PORTB5
-
 //
 // Interrupt state
 //
@@ -232,43 +159,91 @@ static volatile uint8_t _timer0_fired;
 // Raw switches read from PORTB.  Default state: all high = nothing
 // pressed
 static volatile uint8_t _raw_switches_state;
+// Set by the ISR on every tick, to show the watchdog that sampling
+// is still running.  Cleared in main when the watchdog is fed.
+static volatile uint8_t _sampling_checkin;
+// Free-running tick counter, incremented in the ISR.  Used to
+// timestamp events.
+static volatile uint16_t _tick_count;
+#ifdef DIAL_FAST_SAMPLING
+// Dial detents counted by the dial sampling interrupts, and cleared in
+// main.
+static volatile int8_t _dial_detents;
+// The dial pins at the last sample, and how many samples since they
+// last changed.  Only used by the dial sampling interrupts.
+static uint8_t dial_last_pins;
+static uint8_t dial_still_samples;
+#endif
 
 //
-// Derived/calculated key state
+// Main loop state
 //
 
-// Switch debounce states count how long a switch has been in a given
-// state.  Its calculated state (stored in debounced_switches and
-// long_press_switches) is updated after it has been in a given state
-// for more than DebounceTickLimit ticks, and then again after
-// LongPressTime ticks.
-static PinState switch_debounce_states[7];
-
-// Switch states.  There are seven switches, with their states stored
-// in the 7 LSBs of this field.  Logic 1 means the switch is NOT
-// pressed.
-
-// Post-debouncing switch states: 0 = pressed and 1 = not pressed.
-static uint8_t debounced_switches = 0x7f;
-// Long-press states: 0 = pressed for a long time and 1 = not pressed
-// for a long time yet.  When a bit is set 1 in debounced_switches, it
-// is also set 1 here, so long presses are only counted for button
-// presses.
-static uint8_t long_press_switches = 0x7f;
+// Set by run() each time it finishes processing a tick.  The watchdog
+// is only fed when both this and _sampling_checkin are set, so it
+// resets the chip if either the tick interrupt or the main loop stops.
+// A host that stops polling doesn't count: the USB code notices that
+// itself and recovers with usb_recover_stall() instead.
+static uint8_t dispatch_checkin;
+
+// The tick currently being processed (a copy of _tick_count).
+static uint16_t tick_count;
 
 //
 // Functions
 //
 
-#define IsMediaKey(scancode) (0x1000 & scancode)
+// Configure timer 0 to give us ticks, using the current tuning.
+// Interrupts must be disabled.
+static void configure_tick_timer(void) {
+#if defined(TICK_SOURCE_CTC)
+    TCCR0A = (1<<WGM01); // CTC mode: count up to OCR0A, then clear
+    OCR0A = (tuning.tick_period_us / 4) - 1; // clkIO/64 counts every 4 us
+    TCNT0 = 0;
+    TCCR0B = 0x03; // clkIO/64
+    TIMSK0 = (1<<OCIE0A); // use the compare match A interrupt only
+#else
+	TCCR0A = 0x00;
+	TCCR0B = tuning.timer0_clock_select & 0x07;
+	TIMSK0 = (1<<TOIE0); // use the overflow interrupt only
+#endif
+}
+
+// Ticks per second with the current tuning.
+static uint16_t ticks_per_second(void) {
+#if defined(TICK_SOURCE_CTC)
+    return 1000000UL / tuning.tick_period_us;
+#else
+    static uint16_t const prescale[] = { 1, 8, 64, 256, 1024 };
+    return F_CPU / 256 / prescale[tuning.timer0_clock_select - 1];
+#endif
+}
+
+#ifdef DIAL_FAST_SAMPLING
+// Configure timer 2 to count dial sample periods, and wake it with a
+// pin change on either dial pin.  With synthetic input the dial is
+// sampled in the tick interrupt instead, where its pins change.
+static void configure_dial_sampling(void) {
+    dial_last_pins = PINB & DIAL_PINS;
+#ifndef SYNTHETIC_INPUT
+    TCCR2A = (1<<WGM21); // CTC mode: count up to OCR2A, then clear
+    OCR2A = (DIAL_SAMPLE_US / 4) - 1; // clkIO/64 counts every 4 us
+    TCCR2B = (1<<CS22); // clkIO/64
+    PCMSK0 = DIAL_PINS;
+    PCIFR = (1<<PCIF0);
+    PCICR = (1<<PCIE0);
+#endif
+}
+#endif
 
 static void setup(void) {
 
     LED_CONFIG;
     LED_ON;
     
-    // Clear the watchdog
-    MCUSR &= ~_BV(WDRF);
+    // Clear the watchdog, remembering why we were reset
+    uint8_t reset_flags = MCUSR;
+    MCUSR = 0;
     wdt_disable();
     wdt_reset();
     
@@ -283,17 +258,26 @@ static void setup(void) {
     PORTB = 0x7f;
 
     LED_OFF;
-    
-    for (uint8_t i = 0; i < 7; i++) {
-        switch_debounce_states[i].state = 1;
-        switch_debounce_states[i].count = 0;
-    }
+
+    stats_init(reset_flags);
+    tuning_load(&TuningDefaults);
+#ifdef RAW_CAPTURE
+    capture_init(ticks_per_second());
+#endif
 
 	// Initialize USB, and then wait for the host to set
 	// configuration.  If the Teensy is powered without a PC connected
 	// to the USB port, this will wait forever.
 	usb_init();
+#ifdef SYNTHETIC_INPUT
+    // Synthetic input should also run with no host attached (eg. in a
+    // simulator), so only wait a couple of seconds for one.
+    for (uint16_t i = 0; i < 2000 && !usb_configured(); i++) {
+        _delay_ms(1);
+    }
+#else
 	while (!usb_configured()) /* wait */ ;
+#endif
 
     LED_ON;
     
@@ -309,178 +293,117 @@ static void setup(void) {
     
     cli();
     
-    // Configure timer 0 to give us ticks
-	TCCR0A = 0x00;
-	TCCR0B = Timer0Overflow & 0x07;
-	TIMSK0 = (1<<TOIE0); // use the overflow interrupt only
+    configure_tick_timer();
     _timer0_fired = 0;
+#ifdef DIAL_FAST_SAMPLING
+    configure_dial_sampling();
+#endif
 }
 
-static void update_debounced_state(uint8_t raw_switches_state) {
-    for(int i = 0; i < 7; i++) {
-        uint8_t key_val = (raw_switches_state >> i) & 0x01;
-        if (key_val != switch_debounce_states[i].state) {
-            // Any time the read value doesn't match our debounce
-            // state, we reset the count.
-            
-            switch_debounce_states[i].count = 0;
-            switch_debounce_states[i].state = key_val;
-
-        } else if (switch_debounce_states[i].count < LongPressTime) {
-            // If it DOES match and we haven't reached the debounce
-            // tick limit, we increment it.
-            
-            switch_debounce_states[i].count++;
-            
-            if (switch_debounce_states[i].count == DebounceTickLimit) {
-                // Once we've hit the tick limit, we register that as
-                // a keypress state change.
-                
-                // Clear the bit for this switch, and then set it to
-                // the new, debounced value.
-                
-                debounced_switches &= ~(0x01 << i);
-                debounced_switches |= (key_val << i);
-
-                if (key_val == 1) {
-                    // We need to release the long press for this
-                    // switch immediately upon release.
-                    long_press_switches |= (key_val << i);
-                }
-            }
-
-            if ((switch_debounce_states[i].count == LongPressTime) &&
-                (key_val == 0)) {
-                // The tick limit for a long press has been reached,
-                // so we register this as a long button press.
-
-                long_press_switches &= ~(0x01 << i);
-            }
-        }
-    }
+// Send each input event (see input.h) on the vendor interface.
+void input_event(uint8_t type, uint8_t value, uint16_t tick) {
+#ifdef USB_VENDOR_INTERFACE
+    usb_event_add(type, value, tick);
+#else
+    (void)type;
+    (void)value;
+    (void)tick;
+#endif
 }
 
-static void media_key_change(uint16_t const key, uint8_t const pressed) {
-    uint8_t i, free_index = 255;
-
-    for(i = 0; i < 4; i++) {
-        if (media_keys[i] == key) {
-            if (pressed) {
-                // The key is already on; we can stop altogether
-                free_index = 255;
-                break;
-            } else {
-                media_keys[i] = 0;
-            }
-        }
-        if (pressed && !media_keys[i] && free_index == 255) {
-            free_index = i;
-        }
+#ifdef COLLECT_STATS
+// Ticks left to keep the LED off after a tick overran its period.
+static uint16_t overrun_led_ticks;
+
+// Update the load meter with one iteration of the main loop: busy is
+// the time from waking up for a tick until now, and late_ticks is how
+// many ticks have fired since then.  Any at all means this iteration
+// took longer than a tick, which is counted and flashes the LED off
+// for a quarter of a second.
+static void account_busy_time(uint16_t busy, uint16_t late_ticks) {
+    if (late_ticks > 1) {
+        // The timer may have wrapped; all we know is it was long.
+        busy = 0xFFFF;
+    }
+    stats.load_average += (busy >> 4) - (stats.load_average >> 4);
+    if (busy > stats.load_peak) {
+        stats.load_peak = busy;
     }
 
-    if (pressed && free_index < 4) {
-        // If pressed but free_index == 255, then we either don't
-        // have room in the buffer for the new key, or the key is
-        // already pressed.  Either way we have no action to take.
-        //
-        // This path, however, is when we found an empty slot in the
-        // key buffer, so we put the key into it.
-
-        media_keys[free_index] = key;
+    if (late_ticks) {
+        stats.tick_overruns++;
+        overrun_led_ticks = ticks_per_second() / 4;
+        LED_OFF;
+    } else if (overrun_led_ticks && !--overrun_led_ticks) {
+        LED_ON;
     }
 }
+#endif
 
-static void basic_key_change(uint8_t const key, uint8_t const pressed) {
-    uint8_t i, free_index = 255;
+// Switch to the tuning the host asked for, if it's valid, and keep it
+// in EEPROM.  Called between ticks, so all the new values take effect
+// together at the next one.
+static void apply_requested_tuning(void) {
+    Tuning requested;
 
-    if (key >= MODIFIER_KEYS_START && key <= MODIFIER_KEYS_END) {
-        // modifier keys are stored as bitfields
-        uint8_t affected_field = key & 0x07; // 0b00000xxx: 227 (KEY_GUI) => 0b00000011 (3)
-        uint8_t mask = (pressed ? 0x01 : 0) << affected_field; // 1 << 3 => 0b00001000 (or 0 if turning off)
+    cli();
+    requested = *(Tuning *)&tuning_requested;
+    tuning_request_pending = 0;
+    sei();
 
-        keyboard_modifier_keys &= ~(0x01 << affected_field);
-        keyboard_modifier_keys |= mask;
-        
+    if (!tuning_valid(&requested)) {
         return;
     }
-    
-    for(i = 0; i < 6; i++) {
-        if (keyboard_keys[i] == key) {
-            if (pressed) {
-                // The key is already on; we can stop altogether
-                free_index = 255;
-                break;
-            } else {
-                keyboard_keys[i] = 0;
-            }
-        }
-        if (pressed && !keyboard_keys[i] && free_index == 255) {
-            free_index = i;
-        }
-    }
-
-    if (pressed && free_index < 6) {
-        // If pressed but free_index == 255, then we either don't
-        // have room in the buffer for the new key, or the key is
-        // already pressed.  Either way we have no action to take.
-        //
-        // This path, however, is when we found an empty slot in the
-        // key buffer, so we put the key into it.
-        //
-        // (Actually, when we have no buffer space left, the HID spec
-        // says we're supposed to send something else in the buffer to
-        // indicate that more keys are pressed than we can indicate.
-        // Let's not, though.)
-
-        keyboard_keys[free_index] = key;
-    }
-}
+    tuning = requested;
 
-static void send_keys(uint16_t const *const keys, uint8_t const pressed) {
-    uint8_t i;
-    
-    for (i = 0; keys[i]; i++) {
-        uint16_t encoded_key = keys[i];
-        
-        if (IsMediaKey(encoded_key)) {
-            media_key_change(encoded_key & 0xfff, pressed);
-        } else {
-            basic_key_change(encoded_key & 0xff, pressed);
-        }
-    }
-    usb_keyboard_send();
-    usb_media_send();
-}
+    cli();
+    configure_tick_timer();
+    sei();
+#ifdef COLLECT_STATS
+    stats.tick_budget = 2000000UL / ticks_per_second();
+#endif
+#ifdef RAW_CAPTURE
+    capture_init(ticks_per_second());
+#endif
 
-static void press_keys(uint16_t const *const keys) {
-    send_keys(keys, 1);
-}
+    input_restart_debounce();
 
-static void release_keys(uint16_t const *const keys) {
-    send_keys(keys, 0);
+    tuning_save();
 }
 
+// Kept out of line so that host/wcet finds its loop under its own name.
+static void __attribute__((noinline)) run(void) {
+    input_init(actions_tap_hold_switches(), actions_long_press_switches(), PINB & 0x7f);
+    actions_init();
 
-static void run(void) {
-    uint8_t last_pressed_keys = 0x7f;
-    uint8_t last_long_pressed_keys = 0x7f;
-    
-    uint8_t dial_moving = 0;
-    uint8_t dial_position = (PINB >> DialA) & 0x01;
-    Direction dial_direction = DirectionCCW;
+#ifdef COLLECT_STATS
+    uint16_t busy_start = TCNT1;
+    tick_count = _tick_count;
+    stats.tick_budget = 2000000UL / ticks_per_second();
+#endif
 
     wdt_reset();
     wdt_enable(WDTO_1S);
     
-	for(;;) {        
+	for(;;) { // wcet: iteration
         uint8_t timer0_fired = 0;
         uint8_t raw_switches_state = 0x7f;
+#ifdef DIAL_FAST_SAMPLING
+        int8_t dial_detents = 0;
+#endif
         
         // Watch for interrupts, and sleep if nothing has fired.
         cli();
-        while(!_timer0_fired) {
+#ifdef COLLECT_STATS
+        account_busy_time(TCNT1 - busy_start, _tick_count - tick_count);
+#endif
+        while(!_timer0_fired) { // wcet: 1
             set_sleep_mode(SLEEP_MODE_IDLE);
             sleep_enable();
+#ifdef COLLECT_STATS
+            uint16_t isr_time_before = stats_isr_time;
+            STATS_START(sleep_start);
+#endif
             // It's safe to enable interrupts (sei) immediately before
             // sleeping.  Interrupts can't fire until after the
             // following instruction has executed, so there's no race
@@ -489,124 +412,62 @@ static void run(void) {
             sleep_cpu();
             sleep_disable();
             cli();
+#ifdef COLLECT_STATS
+            // The interrupt that woke us up ran before we got here,
+            // so its time doesn't count as sleep.
+            STATS_ADD(sleep_idle, sleep_start);
+            stats.sleep_idle -= (uint16_t)(stats_isr_time - isr_time_before);
+#endif
         }
 
         timer0_fired = _timer0_fired;
         raw_switches_state = _raw_switches_state;
+        tick_count = _tick_count;
         _timer0_fired = 0;
+#ifdef DIAL_FAST_SAMPLING
+        dial_detents = _dial_detents;
+        _dial_detents = 0;
+#endif
+#ifdef COLLECT_STATS
+        busy_start = TCNT1;
+#endif
+
+        if (_sampling_checkin && dispatch_checkin) {
+            wdt_reset();
+            _sampling_checkin = 0;
+            dispatch_checkin = 0;
+        }
 
         sei();
 
         if (timer0_fired) {
-            wdt_reset();
-            
-            update_debounced_state(raw_switches_state);
-            uint8_t changed_keys = last_pressed_keys ^ debounced_switches;
-            uint8_t changed_long_keys = last_long_pressed_keys ^ long_press_switches;
-                
-            //
-            // Process normal switches
-            //
-            
-            for(int i = 0; i < 7; i++) {
-                // A switch is pressed if it's logic low.
-                
-                uint16_t *action_keys = SwitchActionMap[i].press_keys;
-                uint16_t *action_long_keys = SwitchActionMap[i].long_press_keys;
-                    
-                if ((((debounced_switches >> i) & 0x01) == 0) &&
-                    ((changed_keys >> i) & 0x01)) {
-                    // Switch became newly-pressed.  If there are no
-                    // long-press actions for this key, we want to
-                    // start pressing it.
-                    
-                    if (!action_long_keys && action_keys) {
-                        press_keys(action_keys);
-                    }
-                }
+            usb_recover_stall();
 
-                if ((((long_press_switches >> i) & 0x01) == 0) &&
-                    ((changed_long_keys >> i) & 0x01)) {
-                    // Switch became newly-long-pressed.
-                    
-                    if (action_long_keys) {
-                        press_keys(action_long_keys);
-                    }
-                }
-                
-                if ((((debounced_switches >> i) & 0x01) == 1) &&
-                    ((changed_keys >> i) & 0x01)) {
-                    // Switch was released.
-
-                    if (action_long_keys) {
-                        if ((((long_press_switches >> i) & 0x01) == 1) &&
-                            ((changed_long_keys >> i) & 0x01)) {
-                            // Switch was released from a long-press
-                            // action.
-                            //
-                            // NB. long_press_switches must always be
-                            // 1 here if debounced_switches is 1,
-                            // because both fields should be cleared
-                            // when a key is released.  If not,
-                            // there's a bug.
-                            
-                            release_keys(action_long_keys);
-                        } else {
-                            // Switch was released before the
-                            // long-press action triggered.  We'll
-                            // trigger a single quick press and
-                            // release of the short-press keys.
-                            press_keys(action_keys);
-                            release_keys(action_keys);
-                        }
-                    } else {
-                        if (action_keys) {
-                            // Release the short press keys.
-                            release_keys(action_keys);
-                        }
-                    }
-                }
+            if (tuning_request_pending) {
+                apply_requested_tuning();
             }
-
-            //
-            // Process dial
-            //
             
-            if (((debounced_switches >> DialA) & 0x01) != ((debounced_switches >> DialB) & 0x01)) {
-                // The dial inputs are different from one another, so
-                // it's moving now.
-                dial_moving = 1;
-                dial_direction = (((debounced_switches >> DialA) & 0x01) != dial_position) ? DirectionCW : DirectionCCW;
-            } else if (dial_moving) {
-                // Dial was moving but now has stopped, as indicated
-                // by the fact that the two inputs now have the same
-                // value.
-                dial_moving = 0;
-                if (((debounced_switches >> DialA) & 0x01) != dial_position) {
-                    // Dial moved to new position.
-                    dial_position = ((debounced_switches >> DialA) & 0x01);
-                    if (dial_direction == DirectionCW) {
-                        press_keys(DialCWKeys);
-                        release_keys(DialCWKeys);
-                    } else {
-                        press_keys(DialCCWKeys);
-                        release_keys(DialCCWKeys);
-                    }
-                } else {
-                    // Dial returned to old position.  (Nothing to
-                    // do.)
+            input_update(raw_switches_state | IGNORED_PINS, tick_count);
+#ifdef DIAL_FAST_SAMPLING
+            // The dial pins were sampled already.
+            input_add_detents(dial_detents, tick_count);
+#endif
+            uint8_t reports = actions_run(tick_count);
+#ifdef COLLECT_STATS
+            if (reports) {
+                stats.report_ticks++;
+                stats.tick_reports += reports;
+                if (reports > stats.tick_reports_peak) {
+                    stats.tick_reports_peak = reports;
                 }
-            } else if (((debounced_switches >> DialA) & 0x01) != dial_position) {
-                // Dial isn't moving, and A and B positions match, but
-                // they don't match what we expect so we missed a full
-                // click and need to update our internal state to
-                // match.
-                dial_position = ((debounced_switches >> DialA) & 0x01);
+                stats.text_rate = actions_text_rate();
+                stats.throttled_presses = actions_throttled_presses() > 0xff ?
+                    0xff : actions_throttled_presses();
+                stats.throttled_steps = actions_throttled_steps() > 0xff ?
+                    0xff : actions_throttled_steps();
             }
-
-                
-            last_pressed_keys = debounced_switches;
-            last_long_pressed_keys = long_press_switches;
+#endif
+            dispatch_checkin = 1;
         }
 
     }
@@ -619,8 +480,84 @@ int main(void) {
 }
 
 
-// Timer 0 overflow interrupt handler.
+// Timer 0 tick interrupt handler (compare match in CTC mode, or
+// overflow otherwise).
+#if defined(TICK_SOURCE_CTC)
+ISR(TIMER0_COMPA_vect) {
+#else
 ISR(TIMER0_OVF_vect) {
+#endif
+    STATS_START(isr_start);
+
     _timer0_fired = 1;
+    _sampling_checkin = 1;
+    _tick_count++;
+#ifdef SYNTHETIC_INPUT
+    uint8_t pins = synth_next_pins();
+#ifdef USB_VENDOR_INTERFACE
+    if (pins != _raw_switches_state) {
+        usb_event_add(EVENT_SYNTH_EDGE, pins, _tick_count);
+    }
+#endif
+    _raw_switches_state = pins;
+#ifdef DIAL_FAST_SAMPLING
+    _dial_detents += input_sample_dial(pins);
+#endif
+#else
     _raw_switches_state = PINB & 0x7f;
+#endif
+#ifdef RAW_CAPTURE
+    capture_pins(_raw_switches_state, _tick_count);
+#endif
+
+    STATS_ISR_END(tick_isr, isr_start);
+}
+
+#if defined(DIAL_FAST_SAMPLING) && !defined(SYNTHETIC_INPUT)
+// Take one sample of the dial pins.  Unchanged pins can't finish a
+// detent, so only changes are decoded.  Returns whether they changed.
+static inline uint8_t sample_dial(void) {
+    uint8_t pins = PINB & DIAL_PINS;
+
+    if (pins == dial_last_pins) {
+        return 0;
+    }
+    dial_last_pins = pins;
+    _dial_detents += input_sample_dial(pins);
+    return 1;
 }
+
+// A dial pin changed while the dial was still: start sampling.  Pin
+// changes alone would interrupt on every bounce, so sampling takes
+// over until the dial stops again.
+ISR(PCINT0_vect) {
+    STATS_START(isr_start);
+
+    PCICR = 0;
+    TCNT2 = 0;
+    TIFR2 = (1<<OCF2A);
+    TIMSK2 = (1<<OCIE2A);
+    dial_still_samples = 0;
+    sample_dial();
+
+    STATS_ISR_END(dial_isr, isr_start);
+}
+
+// Timer 2 dial sampling interrupt handler.
+ISR(TIMER2_COMPA_vect) {
+    STATS_START(isr_start);
+
+    if (sample_dial()) {
+        dial_still_samples = 0;
+    } else if (++dial_still_samples == DIAL_IDLE_SAMPLES) {
+        // Go back to waiting for a pin change.  One that came before
+        // this wouldn't be noticed, so sample once more after.
+        TIMSK2 = 0;
+        PCIFR = (1<<PCIF0);
+        PCICR = (1<<PCIE0);
+        sample_dial();
+    }
+
+    STATS_ISR_END(dial_isr, isr_start);
+}
+#endif
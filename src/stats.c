@@ -0,0 +1,55 @@
+// Cheap counters of where the time goes, for spotting power and
+// performance regressions.  See stats.h.
+
+#include "stats.h"
+
+#ifdef COLLECT_STATS
+
+volatile Stats stats;
+volatile uint16_t stats_isr_time;
+
+// Reset counts are kept in RAM that isn't cleared at startup.  After a
+// power-on reset its contents are garbage, so they're checked against
+// a magic number.
+#define RESET_COUNTS_MAGIC 0x5AD1
+
+typedef struct {
+    uint16_t magic;
+    uint8_t power_on;
+    uint8_t external;
+    uint8_t brown_out;
+    uint8_t watchdog;
+} ResetCounts;
+
+static ResetCounts reset_counts __attribute__((section(".noinit")));
+
+static void count_reset(uint8_t *counter)
+{
+    if (*counter < 255) (*counter)++;
+}
+
+void stats_init(uint8_t reset_flags)
+{
+    if ((reset_flags & _BV(PORF)) || reset_counts.magic != RESET_COUNTS_MAGIC) {
+        reset_counts.magic = RESET_COUNTS_MAGIC;
+        reset_counts.power_on = 0;
+        reset_counts.external = 0;
+        reset_counts.brown_out = 0;
+        reset_counts.watchdog = 0;
+    }
+    if (reset_flags & _BV(PORF)) count_reset(&reset_counts.power_on);
+    if (reset_flags & _BV(EXTRF)) count_reset(&reset_counts.external);
+    if (reset_flags & _BV(BORF)) count_reset(&reset_counts.brown_out);
+    if (reset_flags & _BV(WDRF)) count_reset(&reset_counts.watchdog);
+    stats.resets_power_on = reset_counts.power_on;
+    stats.resets_external = reset_counts.external;
+    stats.resets_brown_out = reset_counts.brown_out;
+    stats.resets_watchdog = reset_counts.watchdog;
+
+    // Timer 1 runs free at clkIO/8 and is only ever read.
+    TCCR1A = 0x00;
+    TCNT1 = 0;
+    TCCR1B = (1<<CS11);
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef stats_h__
+#define stats_h__
+
+#include <stdint.h>
+#include <avr/io.h>
+
+// Uncomment to stop collecting the counters below.  They are read by
+// the host through feature report 2 on the vendor interface (see
+// usb_keyboard.c).
+#define COLLECT_STATS
+
+#ifdef COLLECT_STATS
+
+// Times are counted with timer 1 running free at clkIO/8, so one unit
+// is 0.5 us.  Interrupt times don't include the prologue and epilogue
+// that the compiler wraps around each handler.
+//
+// The layout of this struct is the layout of the feature report (after
+// the report ID), so only add to the end of it, and keep it under 63
+// bytes.
+typedef struct {
+    uint32_t sleep_idle;	// asleep in SLEEP_MODE_IDLE
+    uint32_t tick_isr;		// in the timer 0 tick interrupt
+    uint32_t usb_gen_isr;	// in USB_GEN_vect (mostly start-of-frame)
+    uint32_t usb_com_isr;	// in USB_COM_vect (control requests, loading IN endpoints)
+    uint32_t usb_send_wait;	// (unused: sends are queued and never wait)
+    uint16_t usb_send_timeouts;	// times the host stopped taking reports
+    uint16_t usb_recoveries;	// detaches from the bus after a stall
+    // Resets by cause (from MCUSR).  These survive every reset except
+    // a power-on reset, which starts them all again from zero.
+    uint8_t resets_power_on;
+    uint8_t resets_external;
+    uint8_t resets_brown_out;
+    uint8_t resets_watchdog;
+    // Main loop load: time from waking up for a tick until going back
+    // to sleep, against the tick period (tick_budget).
+    uint16_t tick_budget;	// one tick period
+    uint16_t load_average;	// busy time per tick, averaged over ~16 ticks
+    uint16_t load_peak;		// longest busy time since startup
+    uint16_t tick_overruns;	// ticks whose processing ran into the next tick
+    // Delivery of IN reports on every endpoint, from being queued until
+    // the host took it from the endpoint bank.
+    uint32_t usb_in_latency;	// total over usb_in_reports
+    uint16_t usb_in_reports;	// reports delivered (stops at 0xFFFF)
+    uint16_t usb_in_latency_peak;
+    // Keyboard and media reports sent by the main loop.  Everything
+    // that changes in a tick goes out together at the end of it.
+    uint32_t tick_reports;	// reports sent
+    uint16_t report_ticks;	// ticks that sent any
+    uint8_t tick_reports_peak;	// most reports sent in one tick
+    // EEPROM bytes written by eeprom_queue.c, and queued bytes that
+    // were skipped because they already held their value.
+    uint16_t eeprom_writes;
+    uint16_t eeprom_skips;
+    uint16_t text_rate;		// characters per second of the last text typed
+    uint32_t dial_isr;		// in the dial sampling interrupts (DIAL_FAST_SAMPLING)
+    // Switch presses and taps, and dial steps, held back or merged by
+    // the rate limits in keymap.h.  Both stop at 255.
+    uint8_t throttled_presses;
+    uint8_t throttled_steps;
+} Stats;
+
+extern volatile Stats stats;
+
+// Total time spent in interrupts, for taking interrupt time out of the
+// sleep time (the interrupt that wakes us runs before sleep_cpu()
+// returns).  Only the low 16 bits are kept.
+extern volatile uint16_t stats_isr_time;
+
+// Start timer 1 and count the reset described by reset_flags (the
+// value of MCUSR at startup).
+void stats_init(uint8_t reset_flags);
+
+// Add one to a counter.
+#define STATS_COUNT(counter) (stats.counter++)
+// Start timing, in a variable named `start`.
+#define STATS_START(start) uint16_t start = TCNT1
+// Add the time since `start` to a counter.
+#define STATS_ADD(counter, start) (stats.counter += (uint16_t)(TCNT1 - (start)))
+// Add the time since `start` to an interrupt's counter.
+#define STATS_ISR_END(counter, start) do {      \
+        uint16_t _elapsed = TCNT1 - (start);    \
+        stats.counter += _elapsed;              \
+        stats_isr_time += _elapsed;             \
+    } while (0)
+
+#else
+
+#define stats_init(reset_flags) ((void)(reset_flags))
+#define STATS_COUNT(counter)
+#define STATS_START(start)
+#define STATS_ADD(counter, start)
+#define STATS_ISR_END(counter, start)
+
+#endif
+
+#endif
@@ -0,0 +1,130 @@
+// Scripted input generator, used instead of the real switches when
+// SYNTHETIC_INPUT is defined in synth.h.
+//
+// The script is a list of steps stored in flash.  Every step is
+// repeated `repeat` times, and every repetition lasts `ticks` ticks:
+//
+//   SynthSet:    set all seven pins to `arg`
+//   SynthToggle: flip the pins in `arg`; repeating this with small
+//                `ticks` makes a bouncy contact
+//   SynthDialCW, SynthDialCCW:
+//                move the dial by one phase (half a detent)
+//   SynthRestart: start again from the first step
+
+#include <avr/pgmspace.h>
+
+#include "synth.h"
+
+#ifdef SYNTHETIC_INPUT
+
+#define SynthSet	0
+#define SynthToggle	1
+#define SynthDialCW	2
+#define SynthDialCCW	3
+#define SynthRestart	4
+
+typedef struct {
+    uint8_t op;
+    uint8_t arg;
+    uint8_t repeat;
+    uint8_t ticks;
+} SynthStep;
+
+// Pins, as in SwitchActionMap in keymap.h.  Switches are active low.
+#define PIN_S2		(1<<0)
+#define PIN_A		(1<<1)
+#define PIN_S1		(1<<2)
+#define PIN_S5		(1<<3)
+#define PIN_S4		(1<<4)
+#define PIN_B		(1<<5)
+#define PIN_S3		(1<<6)
+#define ALL_OPEN	0x7f
+
+// Hold the pins for ms milliseconds, assuming the default 1 ms tick.
+// Holds longer than 250 ms are rounded up to a multiple of 250 ms.
+#define HOLD(pins, ms)		{ SynthSet, (pins), ((ms) + 249) / 250, ((ms) < 250 ? (ms) : 250) }
+// Flip a switch `edges` times, `ms` apart.  An odd number of edges
+// leaves it in the opposite state.
+#define BOUNCE(pin, edges, ms)	{ SynthToggle, (pin), (edges), (ms) }
+// Turn the dial `detents` clicks, spending `ms` in each half-detent.
+#define SPIN_CW(detents, ms)	{ SynthDialCW, 0, 2 * (detents), (ms) }
+#define SPIN_CCW(detents, ms)	{ SynthDialCCW, 0, 2 * (detents), (ms) }
+
+static SynthStep const PROGMEM synth_script[] = {
+    HOLD(ALL_OPEN, 1000),
+
+    // Clean tap of S1.
+    HOLD(ALL_OPEN & ~PIN_S1, 100),
+    HOLD(ALL_OPEN, 500),
+
+    // Bouncy press and release of S4: five edges 1 ms apart each way.
+    BOUNCE(PIN_S4, 5, 1),
+    HOLD(ALL_OPEN & ~PIN_S4, 150),
+    BOUNCE(PIN_S4, 5, 1),
+    HOLD(ALL_OPEN, 500),
+
+    // A glitch shorter than the debounce time, which must be ignored.
+    BOUNCE(PIN_S3, 2, 5),
+    HOLD(ALL_OPEN, 500),
+
+    // Long press of S2.
+    HOLD(ALL_OPEN & ~PIN_S2, 1500),
+    HOLD(ALL_OPEN, 500),
+
+    // Dial: slow, medium, and faster than debouncing can follow.
+    SPIN_CW(10, 60),
+    HOLD(ALL_OPEN, 500),
+    SPIN_CCW(20, 20),
+    HOLD(ALL_OPEN, 500),
+    SPIN_CW(20, 8),
+    HOLD(ALL_OPEN, 1000),
+
+    { SynthRestart, 0, 0, 0 }
+};
+
+static uint8_t pins = ALL_OPEN;
+static uint8_t step = 255;
+static uint8_t repeat = 0;
+static uint8_t ticks = 0;
+
+uint8_t synth_next_pins(void)
+{
+    SynthStep const *s;
+
+    if (ticks) {
+        ticks--;
+        return pins;
+    }
+
+    if (!repeat) {
+        // Move on to the next step.
+        step++;
+        if (pgm_read_byte(&synth_script[step].op) == SynthRestart) {
+            step = 0;
+        }
+        repeat = pgm_read_byte(&synth_script[step].repeat);
+    }
+
+    s = &synth_script[step];
+    switch (pgm_read_byte(&s->op)) {
+    case SynthSet:
+        pins = pgm_read_byte(&s->arg);
+        break;
+    case SynthToggle:
+        pins ^= pgm_read_byte(&s->arg);
+        break;
+    case SynthDialCW:
+        // A leads B when turning clockwise.
+        pins ^= (repeat & 0x01) ? PIN_B : PIN_A;
+        break;
+    case SynthDialCCW:
+        pins ^= (repeat & 0x01) ? PIN_A : PIN_B;
+        break;
+    }
+
+    repeat--;
+    ticks = pgm_read_byte(&s->ticks) - 1;
+    return pins;
+}
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef synth_h__
+#define synth_h__
+
+#include <stdint.h>
+
+// Uncomment to replace the PINB reads in the tick interrupt with the
+// scripted input in synth.c.  The rest of the firmware runs exactly
+// as normal, so this benchmarks a build without anyone pressing
+// buttons, on a bare board or in a simulator.
+//#define SYNTHETIC_INPUT
+
+#ifdef SYNTHETIC_INPUT
+uint8_t synth_next_pins(void);	// pin states for the next tick
+#endif
+
+#endif
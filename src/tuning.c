@@ -0,0 +1,68 @@
+// Runtime timing parameters, persisted in EEPROM; see tuning.h.
+
+#include <string.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+
+#include "eeprom_queue.h"
+#include "tuning.h"
+
+Tuning tuning;
+volatile Tuning tuning_requested;
+volatile uint8_t tuning_request_pending;
+
+static Tuning EEMEM tuning_eeprom;
+static uint8_t EEMEM tuning_eeprom_check;
+// What's being written to tuning_eeprom_check.  The queue copies it
+// from here, a byte at a time, after the tuning itself.
+static uint8_t saved_check;
+
+static uint8_t tuning_check(Tuning const *t)
+{
+    uint8_t const *p = (uint8_t const *)t;
+    uint8_t i, sum = 0xA5;
+
+    for (i = 0; i < sizeof(Tuning); i++) { // wcet: 19
+        sum += p[i];
+    }
+    return sum;
+}
+
+uint8_t tuning_valid(Tuning const *t)
+{
+    for (uint8_t i = 0; i < DIAL_CURVE_POINTS; i++) { // wcet: 4
+        if (t->dial_curve[i].steps > DIAL_MAX_STEPS) {
+            return 0;
+        }
+    }
+    // Faster ticks than TICK_PERIOD_MIN_US (or the prescaler's 976 Hz)
+    // don't leave the tick interrupt and the main loop enough time.
+    return t->version == TUNING_VERSION &&
+        t->tick_period_us >= TICK_PERIOD_MIN_US &&
+        t->tick_period_us <= 1024 &&
+        (t->tick_period_us % 4) == 0 &&
+        t->timer0_clock_select >= 0x03 && t->timer0_clock_select <= 0x05 &&
+        t->debounce_ticks >= 1 &&
+        t->long_press_ticks > t->debounce_ticks;
+}
+
+void tuning_load(Tuning const *defaults)
+{
+    eeprom_read_block(&tuning, &tuning_eeprom, sizeof(Tuning));
+    if (eeprom_read_byte(&tuning_eeprom_check) != tuning_check(&tuning) ||
+        !tuning_valid(&tuning)) {
+        memcpy_P(&tuning, defaults, sizeof(Tuning));
+    }
+}
+
+void tuning_save(void)
+{
+    // The tuning is written in the background, and the check byte
+    // after it, so a reset part way through leaves a tuning that
+    // doesn't match its check and tuning_load() uses the defaults.
+    // The queue has room for both, and saving again before they're
+    // written just starts them over with the new values.
+    saved_check = tuning_check(&tuning);
+    eeprom_queue(&tuning_eeprom, &tuning, sizeof(Tuning));
+    eeprom_queue(&tuning_eeprom_check, &saved_check, 1);
+}
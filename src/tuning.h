@@ -0,0 +1,59 @@
+#ifndef tuning_h__
+#define tuning_h__
+
+#include <stdint.h>
+
+// Bump this when the layout of Tuning changes, so old EEPROM contents
+// are replaced by the compiled defaults instead of being misread.
+#define TUNING_VERSION 1
+
+#define DIAL_CURVE_POINTS 4
+// Most steps a detent can count as.  Each step is a key press and
+// release, sent within the tick.
+#define DIAL_MAX_STEPS 16
+
+// Shortest tick period, for TICK_SOURCE_CTC.  Everything sampled in a
+// tick has to be handled before the next one, and ticks per second
+// have to fit in 16 bits.
+#define TICK_PERIOD_MIN_US 256
+
+typedef struct {
+    uint16_t within_ticks;	// a detent this soon after the last one...
+    uint8_t steps;		// ...counts as this many steps
+} DialCurvePoint;
+
+// Timing parameters that can be changed without rebuilding.  They're
+// kept in EEPROM, and the host reads and writes them as feature report
+// 5 on the vendor interface, which has exactly this layout after the
+// report ID.  All times are in ticks.
+typedef struct {
+    uint8_t version;		// TUNING_VERSION
+    uint16_t tick_period_us;	// tick period, for TICK_SOURCE_CTC
+    uint8_t timer0_clock_select; // tick prescaler, without TICK_SOURCE_CTC;
+				// 0x03 (976.6 Hz) or slower
+    uint8_t debounce_ticks;	// see DEBOUNCE_MS in main.c
+    uint16_t long_press_ticks;	// see LONG_PRESS_MS in main.c
+    // Checked in order; the first point a detent fits in gives its
+    // steps.  Points with zero steps are unused.  Slower detents count
+    // as one step.
+    DialCurvePoint dial_curve[DIAL_CURVE_POINTS];
+} Tuning;
+
+// The tuning in use.  Only main.c changes it, between ticks.
+extern Tuning tuning;
+
+// The USB interrupt stores a tuning written by the host here and sets
+// tuning_request_pending.  main.c applies it before the next tick.
+extern volatile Tuning tuning_requested;
+extern volatile uint8_t tuning_request_pending;
+
+// Load the tuning from EEPROM, or use the defaults (in flash) if the
+// EEPROM doesn't hold a valid one.
+void tuning_load(Tuning const *defaults);
+// Write the tuning in use to EEPROM.  Returns straight away, and the
+// bytes are written from an interrupt (see eeprom_queue.h).
+void tuning_save(void);
+// Whether t holds values the firmware can run with.
+uint8_t tuning_valid(Tuning const *t);
+
+#endif
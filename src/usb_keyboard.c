@@ -26,6 +26,11 @@
 
 #define USB_SERIAL_PRIVATE_INCLUDE
 #include "usb_keyboard.h"
+#include "stats.h"
+#include "capture.h"
+#include "tuning.h"
+#include "keymap_features.h"
+#include <util/delay.h>
 
 /**************************************************************************
  *
@@ -46,6 +51,28 @@
 #define PRODUCT_ID              0x047C
 
 
+// If a keyboard or media report waits this many frames for the host
+// to take the one before it, the host is taken to have stalled, and
+// sends return -1 until it takes one again.
+#define USB_STALL_FRAMES        50
+
+// If reports sit in the keyboard or media endpoint for this many
+// frames while the host keeps sending start-of-frames, the host has
+// stopped polling us.  We then detach from the bus and attach again so
+// it enumerates us afresh.  This is only tried again after a report
+// has got through.
+#define USB_STALL_RECOVERY_FRAMES 2000
+
+// Keyboard and media reports are queued and loaded into their
+// endpoints by the endpoint interrupt as the host takes each one, so
+// the sends never wait.  This is how many reports each queue holds.
+// A dial detent is two media reports (press and release), and the
+// media endpoint is polled every MEDIA_INTERVAL ms, so this is enough
+// for a fast spin.  When a queue is full, the newest report is
+// replaced instead, so the last state always reaches the host.
+#define USB_IN_QUEUE_DEPTH      8
+
+
 // USB devices are supposed to implment a halt feature, which is
 // rarely (if ever) used.  If you comment this line out, the halt
 // code will be removed, saving 102 bytes of space (gcc 4.3.0).
@@ -63,19 +90,53 @@
 
 #define ENDPOINT0_SIZE          32
 
+// USB_KEYBOARD_INTERFACE is set in keymap_features.h when the keymap
+// has keyboard keys or text.  Without it, the host polls one endpoint
+// fewer, and the code for it compiles out.
+#ifdef USB_KEYBOARD_INTERFACE
 #define KEYBOARD_INTERFACE      0
 #define MEDIA_INTERFACE         1
+#define VENDOR_INTERFACE        2
+#else
+#define MEDIA_INTERFACE         0
+#define VENDOR_INTERFACE        1
+#endif
 #define KEYBOARD_ENDPOINT       3
 #define MEDIA_ENDPOINT          4
 #define KEYBOARD_SIZE           8
-#define KEYBOARD_BUFFER         EP_DOUBLE_BUFFER
+#define KEYBOARD_BUFFER         EP_SINGLE_BUFFER
 #define MEDIA_SIZE              8
-#define MEDIA_BUFFER            EP_DOUBLE_BUFFER
+#define MEDIA_BUFFER            EP_SINGLE_BUFFER
+#define VENDOR_ENDPOINT         1
+#define VENDOR_SIZE             64
+#define VENDOR_BUFFER           EP_SINGLE_BUFFER
+
+// Polling interval (bInterval) for each interrupt endpoint, in ms
+// (1-255).  The host controller polls each endpoint this often
+// whether or not we have anything to send, so slower endpoints mean
+// fewer host wakeups, at the cost of up to this much extra latency
+// per report.  See "USB polling intervals" in README.md.
+#define KEYBOARD_INTERVAL       1
+#define MEDIA_INTERVAL          8
+#define VENDOR_INTERVAL         8
+
+// A partly-filled event report is held back for up to this many
+// frames, so a burst of events goes out in a single transfer.  There
+// is no point sending more often than the host polls.
+#define VENDOR_BATCH_FRAMES     VENDOR_INTERVAL
 
 static const uint8_t PROGMEM endpoint_config_table[] = {
+#ifdef USB_VENDOR_INTERFACE
+    1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(VENDOR_SIZE) | VENDOR_BUFFER,
+#else
     0,
+#endif
     0,
+#ifdef USB_KEYBOARD_INTERFACE
     1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(KEYBOARD_SIZE) | KEYBOARD_BUFFER,
+#else
+    0,
+#endif
     1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(MEDIA_SIZE) | MEDIA_BUFFER,
 };
 
@@ -110,80 +171,85 @@ static uint8_t const PROGMEM device_descriptor[] = {
     1                                       // bNumConfigurations
 };
 
-// Keyboard Protocol 1, HID 1.11 spec, Appendix B, page 59-60
-static uint8_t const PROGMEM keyboard_hid_report_desc[] = {
-    0x05, 0x01,          // Usage Page (Generic Desktop),
-    0x09, 0x06,          // Usage (Keyboard),
+// The keyboard and media report descriptors are in usb_report_desc.h,
+// where the host tools can use them too.
+#include "usb_report_desc.h"
+
+#ifdef USB_VENDOR_INTERFACE
+// Vendor-defined event stream; see usb_keyboard.h for the layout.
+// Feature report 2 holds the counters in stats.h, input report 3
+// carries the raw pin log described in capture.h, and report 4 is the
+// absolute volume (see usb_volume_adjust).  Feature report 5 holds
+// the runtime tuning in tuning.h.
+static uint8_t const PROGMEM vendor_hid_report_desc[] = {
+    0x06, 0x00, 0xFF,    // Usage Page (Vendor Defined 0xFF00),
+    0x09, 0x01,          // Usage (1),
     0xA1, 0x01,          // Collection (Application),
-        
-    0x75, 0x01,          //   Report Size (1),
-    0x95, 0x08,          //   Report Count (8),
-    0x05, 0x07,          //   Usage Page (Key Codes),
-    0x19, 0xE0,          //   Usage Minimum (224),
-    0x29, 0xE7,          //   Usage Maximum (231),
+
+    0x85, 0x01,          //   Report ID (1),
+    0x09, 0x02,          //   Usage (2),
     0x15, 0x00,          //   Logical Minimum (0),
-    0x25, 0x01,          //   Logical Maximum (1),
-    0x81, 0x02,          //   Input (Data, Variable, Absolute), ;Modifier byte
-        
-    0x95, 0x01,          //   Report Count (1),
-    0x75, 0x08,          //   Report Size (8),
-    0x81, 0x03,          //   Input (Constant),                 ;Reserved byte
-        
-    0x95, 0x05,          //   Report Count (5),
-    0x75, 0x01,          //   Report Size (1),
-    0x05, 0x08,          //   Usage Page (LEDs),
-    0x19, 0x01,          //   Usage Minimum (1),
-    0x29, 0x05,          //   Usage Maximum (5),
-    0x91, 0x02,          //   Output (Data, Variable, Absolute), ;LED report
-        
-    0x95, 0x01,          //   Report Count (1),
-    0x75, 0x03,          //   Report Size (3),
-    0x91, 0x03,          //   Output (Constant),                 ;LED report padding
-                
-    0x95, 0x06,          //   Report Count (6),
+    0x26, 0xFF, 0x00,    //   Logical Maximum (255),
     0x75, 0x08,          //   Report Size (8),
-    0x15, 0x00,          //   Logical Minimum (0),
-    0x25, 0x68,          //   Logical Maximum(104),
-    0x05, 0x07,          //   Usage Page (Key Codes),
-    0x19, 0x00,          //   Usage Minimum (0),
-    0x29, 0x68,          //   Usage Maximum (104),
-    0x81, 0x00,          //   Input (Data, Array),
-        
-    0xc0                 // End Collection
-};
+    0x95, VENDOR_SIZE-1, //   Report Count (63),
+    0x81, 0x02,          //   Input (Data, Variable, Absolute),
+
+#ifdef RAW_CAPTURE
+    0x85, 0x03,          //   Report ID (3),
+    0x09, 0x04,          //   Usage (4),
+    0x95, VENDOR_SIZE-1, //   Report Count (63),
+    0x81, 0x02,          //   Input (Data, Variable, Absolute),
+#endif
+
+#ifdef USB_ABSOLUTE_VOLUME
+    0x85, 0x04,          //   Report ID (4),
+    0x09, 0x05,          //   Usage (5),
+    0x95, 0x03,          //   Report Count (3),
+    0x81, 0x02,          //   Input (Data, Variable, Absolute),
+    0x09, 0x05,          //   Usage (5),
+    0xB1, 0x02,          //   Feature (Data, Variable, Absolute),
+#endif
+
+    0x85, 0x05,          //   Report ID (5),
+    0x09, 0x06,          //   Usage (6),
+    0x95, sizeof(Tuning),//   Report Count,
+    0xB1, 0x02,          //   Feature (Data, Variable, Absolute),
+
+#ifdef COLLECT_STATS
+    0x85, 0x02,          //   Report ID (2),
+    0x09, 0x03,          //   Usage (3),
+    0x95, VENDOR_SIZE-1, //   Report Count (63),
+    0xB1, 0x02,          //   Feature (Data, Variable, Absolute),
+#endif
 
-// Media keys: Modified version of above
-static uint8_t const PROGMEM media_hid_report_desc[] = {
-    0x05, 0x0c,          // Usage Page (Generic Desktop),
-    0x09, 0x01,          // Usage (Keyboard),
-    0xA1, 0x01,          // Collection (Application),
-        
-    0x95, 0x04,          //   Report Count (4),
-    0x75, 0x10,          //   Report Size (16),
-    0x15, 0x00,          //   Logical Minimum (0),
-    0x26, 0x3c, 0x02,    //   Logical Maximum (0x23c),
-    0x05, 0x0c,          //   Usage Page (Multimedia/Consumer),
-    0x19, 0x00,          //   Usage Minimum (0),
-    0x2a, 0x3c, 0x02,    //   Usage Maximum (0x23c),
-    0x81, 0x00,          //   Input (Data, Array),
-        
     0xc0                 // End Collection
 };
-
-#define CONFIG1_DESC_SIZE        (9+9+9+7+9+9+7)
+#define VENDOR_DESC_SIZE         (9+9+7)
+#else
+#define VENDOR_DESC_SIZE         0
+#endif
+#ifdef USB_KEYBOARD_INTERFACE
+#define KEYBOARD_DESC_SIZE       (9+9+7)
+#else
+#define KEYBOARD_DESC_SIZE       0
+#endif
+#define NUM_INTERFACES           (1 + (KEYBOARD_DESC_SIZE != 0) + (VENDOR_DESC_SIZE != 0))
+#define CONFIG1_DESC_SIZE        (9+KEYBOARD_DESC_SIZE+9+9+7+VENDOR_DESC_SIZE)
 #define KEYBOARD_HID_DESC_OFFSET (9+9)
-#define MEDIA_HID_DESC_OFFSET    (9+9+9+7+9)
+#define MEDIA_HID_DESC_OFFSET    (9+KEYBOARD_DESC_SIZE+9)
+#define VENDOR_HID_DESC_OFFSET   (9+KEYBOARD_DESC_SIZE+9+9+7+9)
 static uint8_t const PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
     // configuration descriptor, USB spec 9.6.3, page 264-266, Table 9-10
     9,                                      // bLength;
     2,                                      // bDescriptorType;
     LSB(CONFIG1_DESC_SIZE),                 // wTotalLength
     MSB(CONFIG1_DESC_SIZE),
-    2,                                      // bNumInterfaces
+    NUM_INTERFACES,                         // bNumInterfaces
     1,                                      // bConfigurationValue
     0,                                      // iConfiguration
     0xC0,                                   // bmAttributes
     50,                                     // bMaxPower
+#ifdef USB_KEYBOARD_INTERFACE
     // interface descriptor, USB spec 9.6.5, page 267-269, Table 9-12
     9,                                      // bLength
     4,                                      // bDescriptorType
@@ -209,7 +275,8 @@ static uint8_t const PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
     KEYBOARD_ENDPOINT | 0x80,               // bEndpointAddress
     0x03,                                   // bmAttributes (0x03=intr)
     KEYBOARD_SIZE, 0,                       // wMaxPacketSize
-    1,                                      // bInterval
+    KEYBOARD_INTERVAL,                      // bInterval
+#endif
     // second (media keys) interface descriptor, USB spec 9.6.5, page 267-269, Table 9-12
     9,                                      // bLength
     4,                                      // bDescriptorType
@@ -235,7 +302,35 @@ static uint8_t const PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
     MEDIA_ENDPOINT | 0x80,                  // bEndpointAddress
     0x03,                                   // bmAttributes (0x03=intr)
     MEDIA_SIZE, 0,                          // wMaxPacketSize
-    1                                       // bInterval
+    MEDIA_INTERVAL,                         // bInterval
+#ifdef USB_VENDOR_INTERFACE
+    // third (vendor events) interface descriptor, USB spec 9.6.5, page 267-269, Table 9-12
+    9,                                      // bLength
+    4,                                      // bDescriptorType
+    VENDOR_INTERFACE,                       // bInterfaceNumber
+    0,                                      // bAlternateSetting
+    1,                                      // bNumEndpoints
+    0x03,                                   // bInterfaceClass (0x03 = HID)
+    0x00,                                   // bInterfaceSubClass
+    0x00,                                   // bInterfaceProtocol
+    0,                                      // iInterface
+    // HID interface descriptor, HID 1.11 spec, section 6.2.1
+    9,                                      // bLength
+    0x21,                                   // bDescriptorType
+    0x11, 0x01,                             // bcdHID
+    0,                                      // bCountryCode
+    1,                                      // bNumDescriptors
+    0x22,                                   // bDescriptorType
+    sizeof(vendor_hid_report_desc),         // wDescriptorLength
+    0,
+    // endpoint descriptor, USB spec 9.6.6, page 269-271, Table 9-13
+    7,                                      // bLength
+    5,                                      // bDescriptorType
+    VENDOR_ENDPOINT | 0x80,                 // bEndpointAddress
+    0x03,                                   // bmAttributes (0x03=intr)
+    VENDOR_SIZE, 0,                         // wMaxPacketSize
+    VENDOR_INTERVAL,                        // bInterval
+#endif
 };
 
 // If you're desperate for a little extra code memory, these strings
@@ -272,10 +367,16 @@ static struct descriptor_list_struct {
 } const PROGMEM descriptor_list[] = {
     {0x0100, 0x0000, device_descriptor, sizeof(device_descriptor)},
     {0x0200, 0x0000, config1_descriptor, sizeof(config1_descriptor)},
+#ifdef USB_KEYBOARD_INTERFACE
     {0x2200, KEYBOARD_INTERFACE, keyboard_hid_report_desc, sizeof(keyboard_hid_report_desc)},
     {0x2100, KEYBOARD_INTERFACE, config1_descriptor+KEYBOARD_HID_DESC_OFFSET, 9},
+#endif
     {0x2200, MEDIA_INTERFACE, media_hid_report_desc, sizeof(media_hid_report_desc)},
     {0x2101, MEDIA_INTERFACE, config1_descriptor+MEDIA_HID_DESC_OFFSET, 9},
+#ifdef USB_VENDOR_INTERFACE
+    {0x2200, VENDOR_INTERFACE, vendor_hid_report_desc, sizeof(vendor_hid_report_desc)},
+    {0x2100, VENDOR_INTERFACE, config1_descriptor+VENDOR_HID_DESC_OFFSET, 9},
+#endif
     {0x0300, 0x0000, (const uint8_t *)&string0, 4},
     {0x0301, 0x0409, (const uint8_t *)&string1, sizeof(STR_MANUFACTURER)},
     {0x0302, 0x0409, (const uint8_t *)&string2, sizeof(STR_PRODUCT)}
@@ -292,6 +393,7 @@ static struct descriptor_list_struct {
 // zero when we are not configured, non-zero when enumerated
 static volatile uint8_t usb_configuration=0;
 
+#ifdef USB_KEYBOARD_INTERFACE
 // which modifier keys are currently pressed
 // 1=left ctrl,    2=left shift,   4=left alt,    8=left gui
 // 16=right ctrl, 32=right shift, 64=right alt, 128=right gui
@@ -299,11 +401,58 @@ volatile uint8_t keyboard_modifier_keys=0;
 
 // which keys are currently pressed, up to 6 keys may be down at once
 volatile uint8_t keyboard_keys[6] = {0, 0, 0, 0, 0, 0};
+#endif
 volatile uint16_t media_keys[4] = {0, 0, 0, 0};
 
+// non-zero after a queued report waited USB_STALL_FRAMES for the host to
+// take the one before it.  Sends then return -1, and each queue only
+// keeps the latest report, until the host takes one again.
+static volatile uint8_t usb_stalled=0;
+// frames since usb_stalled was set
+static volatile uint16_t usb_stalled_frames=0;
+// cleared when we detach to recover from a stall, and set again once
+// a report gets through, so we don't re-enumerate over and over when
+// nobody is listening
+static uint8_t usb_recovery_armed=1;
+
+// reports waiting to be loaded into the keyboard or media endpoint,
+// oldest first, and a copy of the newest one queued so unchanged
+// reports aren't sent twice
+struct report_queue {
+    uint8_t head;
+    uint8_t count;
+    uint8_t reports[USB_IN_QUEUE_DEPTH][8];
+    uint8_t last[8];
+#ifdef COLLECT_STATS
+    uint16_t queued_at[USB_IN_QUEUE_DEPTH];     // TCNT1
+    uint8_t queued_frame[USB_IN_QUEUE_DEPTH];
+#endif
+};
+#ifdef USB_KEYBOARD_INTERFACE
+static struct report_queue keyboard_queue;
+#endif
+static struct report_queue media_queue;
+
+// state of the IN endpoints, one bit per endpoint number.  in_busy is
+// set while the endpoint's bank holds a report the host hasn't taken,
+// and in_waiting while there's another one to load after it.  The
+// endpoint interrupt (TXINE) is on whenever either is set.
+static volatile uint8_t in_busy=0;
+static volatile uint8_t in_waiting=0;
+// frame when each endpoint last got a report through, or started
+// waiting if it had nothing in flight
+static uint8_t in_since[MAX_ENDPOINT+1];
+#ifdef COLLECT_STATS
+// when the report in each endpoint's bank was queued, for the
+// delivery latency
+static uint16_t in_queued_at[MAX_ENDPOINT+1];
+static uint8_t in_queued_frame[MAX_ENDPOINT+1];
+#endif
+
 // protocol setting from the host.  We use exactly the same report
 // either way, so this variable only stores the setting since we
 // are required to be able to report which setting is in use.
+#ifdef USB_KEYBOARD_INTERFACE
 static uint8_t keyboard_protocol=1;
 
 // the idle configuration, how often we send the report to the
@@ -312,6 +461,7 @@ static uint8_t keyboard_idle_config=125;
 
 // count until idle timeout
 static uint8_t keyboard_idle_count=0;
+#endif
 
 // 1=num lock, 2=caps lock, 4=scroll lock, 8=compose, 16=kana
 volatile uint8_t keyboard_leds=0;
@@ -320,6 +470,40 @@ static uint8_t media_protocol=1;
 static uint8_t media_idle_config=125;
 static uint8_t media_idle_count=0;
 
+#ifdef USB_VENDOR_INTERFACE
+// events waiting to go out in the next vendor report
+static uint8_t vendor_events[VENDOR_EVENTS_PER_REPORT * VENDOR_EVENT_SIZE];
+static volatile uint8_t vendor_event_count=0;
+static volatile uint8_t vendor_events_dropped=0;
+// frame number when the first event in vendor_events was added
+static uint8_t vendor_batch_start=0;
+static uint8_t vendor_sequence=0;
+#ifdef COLLECT_STATS
+// when the vendor endpoint last started waiting to send, for the
+// delivery latency
+static uint16_t vendor_due_at;
+static uint8_t vendor_due_frame;
+#endif
+#endif
+
+#ifdef USB_ABSOLUTE_VOLUME
+#ifndef USB_VENDOR_INTERFACE
+#error "USB_ABSOLUTE_VOLUME needs USB_VENDOR_INTERFACE"
+#endif
+// the host's volume, laid out like report 4: level, max, step.  max is
+// zero until the host has told us the volume.
+static volatile uint8_t volume_report[3] = {0, 0, 1};
+// non-zero when the dial has changed the level since we last sent it
+static volatile uint8_t volume_changed=0;
+#endif
+
+#ifdef RAW_CAPTURE
+#ifndef USB_VENDOR_INTERFACE
+#error "RAW_CAPTURE needs USB_VENDOR_INTERFACE"
+#endif
+static uint8_t capture_sequence=0;
+#endif
+
 
 /**************************************************************************
  *
@@ -350,6 +534,7 @@ uint8_t usb_configured(void)
 }
 
 
+#ifdef USB_KEYBOARD_INTERFACE
 // perform a single keystroke
 int8_t usb_keyboard_press(uint8_t key, uint8_t modifier)
 {
@@ -363,6 +548,7 @@ int8_t usb_keyboard_press(uint8_t key, uint8_t modifier)
     keyboard_keys[0] = 0;
     return usb_keyboard_send();
 }
+#endif
 
 // perform a single keystroke
 int8_t usb_media_press(uint16_t key)
@@ -376,67 +562,132 @@ int8_t usb_media_press(uint16_t key)
     return usb_media_send();
 }
 
+#ifdef USB_KEYBOARD_INTERFACE
 static void send_key_data(void);
+static void copy_key_data(uint8_t *p);
+#endif
 static void send_media_key_data(void);
-
-// send the contents of keyboard_keys and keyboard_modifier_keys
+static void copy_media_key_data(uint8_t *p);
+static int8_t queue_report(struct report_queue *q, uint8_t ep, const uint8_t *report, uint8_t always);
+
+#ifdef USB_KEYBOARD_INTERFACE
+// queue the contents of keyboard_keys and keyboard_modifier_keys.
+// If the USB isn't configured this returns -1 straight away, but the
+// key state is kept and sent as soon as the host configures us again.
+// It also returns -1 if the report couldn't be queued on its own (the
+// host has stalled, or the queue is full); the key state still goes
+// out with the next report.
 int8_t usb_keyboard_send(void)
 {
-    uint8_t i, intr_state, timeout;
+    uint8_t intr_state, report[KEYBOARD_SIZE];
+    int8_t r;
 
     if (!usb_configuration) return -1;
+    copy_key_data(report);
     intr_state = SREG;
     cli();
-    UENUM = KEYBOARD_ENDPOINT;
-    timeout = UDFNUML + 50;
-    while (1) {
-        // are we ready to transmit?
-        if (UEINTX & (1<<RWAL)) break;
-        SREG = intr_state;
-        // has the USB gone offline?
-        if (!usb_configuration) return -1;
-        // have we waited too long?
-        if (UDFNUML == timeout) return -1;
-        // get ready to try checking again
-        intr_state = SREG;
-        cli();
-        UENUM = KEYBOARD_ENDPOINT;
-    }
-    send_key_data();
-    UEINTX = 0x3A;
-    keyboard_idle_count = 0;
+    r = queue_report(&keyboard_queue, KEYBOARD_ENDPOINT, report, 0);
     SREG = intr_state;
-    return 0;
+    return r;
 }
+#endif
 
 int8_t usb_media_send(void)
 {
-    uint8_t i, intr_state, timeout;
+    uint8_t intr_state, report[MEDIA_SIZE];
+    int8_t r;
+
+    if (!usb_configuration) return -1;
+    copy_media_key_data(report);
+    intr_state = SREG;
+    cli();
+    r = queue_report(&media_queue, MEDIA_ENDPOINT, report, 0);
+    SREG = intr_state;
+    return r;
+}
+
+// how many more keyboard reports can be queued before the newest
+// starts being replaced.  Zero if the USB isn't configured or the
+// host has stalled, as nothing queued then would get through anyway.
+#ifdef USB_KEYBOARD_INTERFACE
+uint8_t usb_keyboard_queue_space(void)
+{
+    if (!usb_configuration || usb_stalled) return 0;
+    return USB_IN_QUEUE_DEPTH - keyboard_queue.count;
+}
+#endif
+
+// call this regularly from the main loop.  If the host has stopped
+// taking reports for USB_STALL_RECOVERY_FRAMES, this detaches from
+// the bus for 10 ms so the host sees us unplugged and enumerates us
+// again.  Returns 1 if it did, 0 otherwise.
+int8_t usb_recover_stall(void)
+{
+    if (!usb_stalled || !usb_recovery_armed) return 0;
+    if (usb_stalled_frames < USB_STALL_RECOVERY_FRAMES) return 0;
+    usb_recovery_armed = 0;
+    UDCON |= (1<<DETACH);
+    _delay_ms(10);
+    usb_configuration = 0;
+    usb_stalled = 0;
+    UDCON &= ~(1<<DETACH);
+    STATS_COUNT(usb_recoveries);
+    return 1;
+}
+
+#ifdef USB_VENDOR_INTERFACE
+// queue an event for the vendor interface.  It goes out with the
+// next report, at most VENDOR_BATCH_FRAMES frames from now.  Returns
+// -1 if the USB isn't configured or the next report is already full.
+int8_t usb_event_add(uint8_t type, uint8_t value, uint16_t timestamp)
+{
+    uint8_t intr_state, *p;
 
     if (!usb_configuration) return -1;
     intr_state = SREG;
     cli();
-    UENUM = MEDIA_ENDPOINT;
-    timeout = UDFNUML + 50;
-    while (1) {
-        // are we ready to transmit?
-        if (UEINTX & (1<<RWAL)) break;
+    if (vendor_event_count >= VENDOR_EVENTS_PER_REPORT) {
+        if (vendor_events_dropped < 255) vendor_events_dropped++;
         SREG = intr_state;
-        // has the USB gone offline?
-        if (!usb_configuration) return -1;
-        // have we waited too long?
-        if (UDFNUML == timeout) return -1;
-        // get ready to try checking again
-        intr_state = SREG;
-        cli();
-        UENUM = MEDIA_ENDPOINT;
+        return -1;
     }
-    send_media_key_data();
-    UEINTX = 0x3A;
-    keyboard_idle_count = 0;
+    if (!vendor_event_count) vendor_batch_start = UDFNUML;
+    p = vendor_events + vendor_event_count * VENDOR_EVENT_SIZE;
+    *p++ = type;
+    *p++ = value;
+    *p++ = LSB(timestamp);
+    *p++ = MSB(timestamp);
+    *p++ = UDFNUML;
+    *p++ = UDFNUMH;
+    vendor_event_count++;
     SREG = intr_state;
     return 0;
 }
+#endif
+
+#ifdef USB_ABSOLUTE_VOLUME
+// move our copy of the host's volume by a number of dial steps.  The
+// new level goes to the host with the next start-of-frame that finds
+// the vendor endpoint free, so however many steps happen in between,
+// only the final level is sent.  Returns -1 if the host hasn't told
+// us the volume yet, so the caller should send volume keys instead.
+int8_t usb_volume_adjust(int8_t steps)
+{
+    uint8_t intr_state;
+    int16_t level;
+
+    if (!usb_configuration || !volume_report[1]) return -1;
+    intr_state = SREG;
+    cli();
+    level = volume_report[0] + steps * volume_report[2];
+    if (level < 0) level = 0;
+    if (level > volume_report[1]) level = volume_report[1];
+    volume_report[0] = level;
+    volume_changed = 1;
+    SREG = intr_state;
+    return 0;
+}
+#endif
 
 /**************************************************************************
  *
@@ -444,31 +695,303 @@ int8_t usb_media_send(void)
  *
  **************************************************************************/
 
+#ifdef USB_KEYBOARD_INTERFACE
 static void send_key_data() {
     int i;
     UEDATX = keyboard_modifier_keys;
     UEDATX = 0;
-    for (i=0; i<6; i++) {
+    for (i=0; i<6; i++) { // wcet: 6
         UEDATX = keyboard_keys[i];
     }
 }
+#endif
 
 static void send_media_key_data() {
     int i;
-    for(i = 0; i < 4; i++) {
+    for(i = 0; i < 4; i++) { // wcet: 4
         UEDATX = media_keys[i] & 0xff;
         UEDATX = media_keys[i] >> 8;
     }
 }
 
+#ifdef USB_KEYBOARD_INTERFACE
+static void copy_key_data(uint8_t *p) {
+    int i;
+    *p++ = keyboard_modifier_keys;
+    *p++ = 0;
+    for (i=0; i<6; i++) { // wcet: 6
+        *p++ = keyboard_keys[i];
+    }
+}
+#endif
+
+static void copy_media_key_data(uint8_t *p) {
+    int i;
+    for(i = 0; i < 4; i++) { // wcet: 4
+        *p++ = media_keys[i] & 0xff;
+        *p++ = media_keys[i] >> 8;
+    }
+}
+
+// turn on the endpoint interrupt for an endpoint with something to
+// send.  If the bank is free, the interrupt loads it straight away.
+// Call with interrupts off.
+static void in_start(uint8_t ep)
+{
+    uint8_t bit = 1 << ep;
+
+    if (!(in_waiting & bit)) {
+        in_waiting |= bit;
+        if (!(in_busy & bit)) in_since[ep] = UDFNUML;
+    }
+    UENUM = ep;
+    UEIENX = (1<<TXINE);
+}
+
+// add a report to a queue, unless it's the same as the last one
+// queued (and always is zero).  Call with interrupts off.
+static int8_t queue_report(struct report_queue *q, uint8_t ep, const uint8_t *report, uint8_t always)
+{
+    uint8_t i, n;
+    int8_t r = 0;
+
+    if (!always) {
+        for (i = 0; i < 8 && report[i] == q->last[i]; i++) ; // wcet: 8
+        if (i == 8) return usb_stalled ? -1 : 0;
+    }
+    for (i = 0; i < 8; i++) q->last[i] = report[i]; // wcet: 8
+    if (usb_stalled) {
+        // the host isn't listening, so when it comes back, only the
+        // current state matters
+        q->count = 0;
+        r = -1;
+    }
+    if (q->count == USB_IN_QUEUE_DEPTH) {
+        q->count--;
+        r = -1;
+    }
+    n = (q->head + q->count) % USB_IN_QUEUE_DEPTH;
+    for (i = 0; i < 8; i++) q->reports[n][i] = report[i]; // wcet: 8
+#ifdef COLLECT_STATS
+    q->queued_at[n] = TCNT1;
+    q->queued_frame[n] = UDFNUML;
+#endif
+    q->count++;
+    in_start(ep);
+    return r;
+}
+
+// forget anything queued, and queue the current keyboard and media
+// reports.  Call with interrupts off.
+static void send_current_reports(void) {
+    uint8_t report[8];
+
+    in_busy = 0;
+    in_waiting = 0;
+    media_queue.count = 0;
+#ifdef USB_KEYBOARD_INTERFACE
+    keyboard_queue.count = 0;
+    copy_key_data(report);
+    queue_report(&keyboard_queue, KEYBOARD_ENDPOINT, report, 1);
+#endif
+    copy_media_key_data(report);
+    queue_report(&media_queue, MEDIA_ENDPOINT, report, 1);
+}
+
+#ifdef USB_VENDOR_INTERFACE
+static void send_vendor_event_data(void) {
+    uint8_t i, n;
+    n = vendor_event_count * VENDOR_EVENT_SIZE;
+    UEDATX = 1;
+    UEDATX = vendor_sequence++;
+    UEDATX = vendor_event_count;
+    UEDATX = vendor_events_dropped;
+    for (i = 0; i < n; i++) { // wcet: 60
+        UEDATX = vendor_events[i];
+    }
+    for (; i < VENDOR_SIZE - 4; i++) { // wcet: 60
+        UEDATX = 0;
+    }
+    vendor_event_count = 0;
+    vendor_events_dropped = 0;
+}
+#endif
+
+#ifdef RAW_CAPTURE
+static void send_capture_data(void) {
+    uint8_t i, n, pins;
+    uint16_t tick;
+
+    n = capture_pending();
+    if (n > CAPTURE_RECORDS_PER_REPORT) n = CAPTURE_RECORDS_PER_REPORT;
+    UEDATX = 3;
+    UEDATX = capture_sequence++;
+    UEDATX = n;
+    UEDATX = capture_take_lost();
+    UEDATX = LSB(capture_ticks_per_second());
+    UEDATX = MSB(capture_ticks_per_second());
+    for (i = 0; i < n; i++) { // wcet: 19
+        capture_pop(&tick, &pins);
+        UEDATX = LSB(tick);
+        UEDATX = MSB(tick);
+        UEDATX = pins;
+    }
+    for (i = 6 + n * CAPTURE_RECORD_SIZE; i < VENDOR_SIZE; i++) { // wcet: 58
+        UEDATX = 0;
+    }
+}
+#endif
+
+#ifdef USB_VENDOR_INTERFACE
+// is there something for the vendor endpoint?  Events are held back
+// until the report is full or the batch window is up, and the pin log
+// only goes when there are no events waiting.
+static uint8_t vendor_report_due(void)
+{
+#ifdef USB_ABSOLUTE_VOLUME
+    if (volume_changed) return 1;
+#endif
+    if (vendor_event_count) {
+        return vendor_event_count == VENDOR_EVENTS_PER_REPORT ||
+            (uint8_t)(UDFNUML - vendor_batch_start) >= VENDOR_BATCH_FRAMES;
+    }
+#ifdef RAW_CAPTURE
+    if (capture_pending()) return 1;
+#endif
+    return 0;
+}
+
+// load the vendor endpoint with whatever is most urgent: the volume
+// first, since it's the only thing the user is waiting for, then
+// events, then the pin log.  Returns 0 if there was nothing.
+static uint8_t load_vendor_report(void)
+{
+#ifdef USB_ABSOLUTE_VOLUME
+    if (volume_changed) {
+        UEDATX = 4;
+        UEDATX = volume_report[0];
+        UEDATX = volume_report[1];
+        UEDATX = volume_report[2];
+        volume_changed = 0;
+        return 1;
+    }
+#endif
+    if (vendor_event_count) {
+        send_vendor_event_data();
+        return 1;
+    }
+#ifdef RAW_CAPTURE
+    if (capture_pending()) {
+        send_capture_data();
+        return 1;
+    }
+#endif
+    return 0;
+}
+#endif
+
+// has an endpoint had a report waiting for USB_STALL_FRAMES without
+// the host taking anything?
+static uint8_t in_stalled(uint8_t ep)
+{
+    return (in_waiting & (1<<ep)) && (uint8_t)(UDFNUML - in_since[ep]) >= USB_STALL_FRAMES;
+}
+
+#ifdef COLLECT_STATS
+// count a report the host has taken, queued at TCNT1 = queued_at
+static void count_delivery(uint16_t queued_at, uint8_t queued_frame)
+{
+    uint16_t latency = TCNT1 - queued_at;
+
+    // timer 1 wraps every 32.8 ms
+    if ((uint8_t)(UDFNUML - queued_frame) >= 32) latency = 0xFFFF;
+    if (latency > stats.usb_in_latency_peak) stats.usb_in_latency_peak = latency;
+    if (stats.usb_in_reports < 0xFFFF) {
+        stats.usb_in_reports++;
+        stats.usb_in_latency += latency;
+    }
+}
+#endif
+
+// load the next report from a queue into the selected endpoint
+static void load_queued_report(struct report_queue *q, uint8_t ep)
+{
+    uint8_t i;
+
+    for (i = 0; i < 8; i++) { // wcet: 8
+        UEDATX = q->reports[q->head][i];
+    }
+#ifdef COLLECT_STATS
+    in_queued_at[ep] = q->queued_at[q->head];
+    in_queued_frame[ep] = q->queued_frame[q->head];
+#endif
+    q->head = (q->head + 1) % USB_IN_QUEUE_DEPTH;
+    q->count--;
+    if (!q->count) in_waiting &= ~(1<<ep);
+}
+
+// Endpoint interrupt for an IN endpoint: the bank is free, so the host
+// has taken whatever was in it.  Load the next report if there is
+// one, otherwise turn the interrupt off until there is.
+static void usb_in_interrupt(uint8_t ep)
+{
+    uint8_t bit = 1 << ep;
+
+    UENUM = ep;
+    if (!(UEINTX & (1<<TXINI))) return;
+    if (in_busy & bit) {
+        in_busy &= ~bit;
+        in_since[ep] = UDFNUML;
+#ifdef COLLECT_STATS
+        count_delivery(in_queued_at[ep], in_queued_frame[ep]);
+#endif
+        if (ep != VENDOR_ENDPOINT) {
+            // the host is taking reports again
+            usb_stalled = 0;
+            usb_recovery_armed = 1;
+        }
+    }
+    if (in_waiting & bit) {
+#ifdef USB_KEYBOARD_INTERFACE
+        if (ep == KEYBOARD_ENDPOINT) {
+            load_queued_report(&keyboard_queue, ep);
+            keyboard_idle_count = 0;
+        } else
+#endif
+        if (ep == MEDIA_ENDPOINT) {
+            load_queued_report(&media_queue, ep);
+            media_idle_count = 0;
+        }
+#ifdef USB_VENDOR_INTERFACE
+        else {
+            in_waiting &= ~bit;
+            if (!load_vendor_report()) {
+                UEIENX = 0;
+                return;
+            }
+#ifdef COLLECT_STATS
+            in_queued_at[ep] = vendor_due_at;
+            in_queued_frame[ep] = vendor_due_frame;
+#endif
+        }
+#endif
+        UEINTX = 0x3A;
+        in_busy |= bit;
+        return;
+    }
+    UEIENX = 0;
+}
+
 
 // USB Device Interrupt - handle all device-level events
-// the transmit buffer flushing is triggered by the start of frame
+// the start-of-frame interrupt sends idle reports, starts the vendor
+// endpoint when it has something due, and watches for a stalled host
 //
 ISR(USB_GEN_vect)
 {
-    uint8_t intbits, t, i;
+    uint8_t intbits, report[8];
     static uint8_t div4=0;
+    STATS_START(isr_start);
 
     intbits = UDINT;
     UDINT = 0;
@@ -481,37 +1004,59 @@ ISR(USB_GEN_vect)
         usb_configuration = 0;
     }
     if ((intbits & (1<<SOFI)) && usb_configuration) {
+        if (usb_stalled) {
+            if (usb_stalled_frames < 0xFFFF) usb_stalled_frames++;
+        } else if (
+#ifdef USB_KEYBOARD_INTERFACE
+                   in_stalled(KEYBOARD_ENDPOINT) ||
+#endif
+                   in_stalled(MEDIA_ENDPOINT)) {
+            usb_stalled_frames = 0;
+            usb_stalled = 1;
+            STATS_COUNT(usb_send_timeouts);
+        }
+#ifdef USB_KEYBOARD_INTERFACE
         if (keyboard_idle_config && (++div4 & 3) == 0) {
-            UENUM = KEYBOARD_ENDPOINT;
-            if (UEINTX & (1<<RWAL)) {
+            if (!((in_busy | in_waiting) & (1<<KEYBOARD_ENDPOINT))) {
                 keyboard_idle_count++;
                 if (keyboard_idle_count == keyboard_idle_config) {
                     keyboard_idle_count = 0;
-                    send_key_data();
-                    UEINTX = 0x3A;
+                    copy_key_data(report);
+                    queue_report(&keyboard_queue, KEYBOARD_ENDPOINT, report, 1);
                 }
             }
         }
+#endif
         if (media_idle_config && (++div4 & 3) == 0) {
-            UENUM = MEDIA_ENDPOINT;
-            if (UEINTX & (1<<RWAL)) {
+            if (!((in_busy | in_waiting) & (1<<MEDIA_ENDPOINT))) {
                 media_idle_count++;
                 if (media_idle_count == media_idle_config) {
                     media_idle_count = 0;
-                    send_media_key_data();
-                    UEINTX = 0x3A;
+                    copy_media_key_data(report);
+                    queue_report(&media_queue, MEDIA_ENDPOINT, report, 1);
                 }
             }
         }
+#ifdef USB_VENDOR_INTERFACE
+        if (!(in_waiting & (1<<VENDOR_ENDPOINT)) && vendor_report_due()) {
+#ifdef COLLECT_STATS
+            vendor_due_at = TCNT1;
+            vendor_due_frame = UDFNUML;
+#endif
+            in_start(VENDOR_ENDPOINT);
+        }
+#endif
     }
+    STATS_ISR_END(usb_gen_isr, isr_start);
 }
 
 
 
-// Misc functions to wait for ready and send/receive packets
+// Misc functions to wait for ready and send/receive packets.  The
+// waits are on the host, so host/wcet counts each as one pass.
 static inline void usb_wait_in_ready(void)
 {
-    while (!(UEINTX & (1<<TXINI))) ;
+    while (!(UEINTX & (1<<TXINI))) ; // wcet: 1
 }
 static inline void usb_send_in(void)
 {
@@ -519,7 +1064,7 @@ static inline void usb_send_in(void)
 }
 static inline void usb_wait_receive_out(void)
 {
-    while (!(UEINTX & (1<<RXOUTI))) ;
+    while (!(UEINTX & (1<<RXOUTI))) ; // wcet: 1
 }
 static inline void usb_ack_out(void)
 {
@@ -528,11 +1073,58 @@ static inline void usb_ack_out(void)
 
 
 
-// USB Endpoint Interrupt - endpoint 0 is handled here.  The
-// other endpoints are manipulated by the user-callable
-// functions, and the start-of-frame interrupt.
+#ifdef USB_VENDOR_INTERFACE
+// send a feature report from RAM in response to GET_REPORT.  The
+// report is the ID followed by report_size bytes: the first size come
+// from data, and the rest are zeros.
+static void usb_send_feature(uint8_t id, const uint8_t *data, uint8_t size, uint8_t report_size, uint16_t wLength)
+{
+    uint8_t i, n, len, pos = 0;
+
+    // at most 64 bytes: two packets and a zero-length one
+    len = (wLength < report_size + 1) ? wLength : report_size + 1;
+    do {
+        // wait for host ready for IN packet
+        do {
+            i = UEINTX;
+        } while (!(i & ((1<<TXINI)|(1<<RXOUTI)))); // wcet: 1
+        if (i & (1<<RXOUTI)) return;    // abort
+        // send IN packet
+        n = len < ENDPOINT0_SIZE ? len : ENDPOINT0_SIZE;
+        for (i = n; i; i--, pos++) { // wcet: 32
+            if (pos == 0) UEDATX = id;
+            else if (pos <= size) UEDATX = data[pos - 1];
+            else UEDATX = 0;
+        }
+        len -= n;
+        usb_send_in();
+    } while (len || n == ENDPOINT0_SIZE); // wcet: 3
+}
+#endif
+
+static void usb_endpoint_interrupt(void);
+
+// USB Endpoint Interrupt - endpoint 0 is handled here, and the IN
+// endpoints are loaded as the host takes each report.
 //
 ISR(USB_COM_vect)
+{
+    uint8_t intbits;
+    STATS_START(isr_start);
+
+    intbits = UEINT;
+#ifdef USB_KEYBOARD_INTERFACE
+    if (intbits & (1<<KEYBOARD_ENDPOINT)) usb_in_interrupt(KEYBOARD_ENDPOINT);
+#endif
+    if (intbits & (1<<MEDIA_ENDPOINT)) usb_in_interrupt(MEDIA_ENDPOINT);
+#ifdef USB_VENDOR_INTERFACE
+    if (intbits & (1<<VENDOR_ENDPOINT)) usb_in_interrupt(VENDOR_ENDPOINT);
+#endif
+    if (intbits & 1) usb_endpoint_interrupt();
+    STATS_ISR_END(usb_com_isr, isr_start);
+}
+
+static void usb_endpoint_interrupt(void)
 {
     uint8_t intbits;
     const uint8_t *list;
@@ -561,7 +1153,7 @@ ISR(USB_COM_vect)
         UEINTX = ~((1<<RXSTPI) | (1<<RXOUTI) | (1<<TXINI));
         if (bRequest == GET_DESCRIPTOR) {
             list = (const uint8_t *)descriptor_list;
-            for (i=0; ; i++) {
+            for (i=0; ; i++) { // wcet: 12
                 if (i >= NUM_DESC_LIST) {
                     UECONX = (1<<STALLRQ)|(1<<EPEN);  //stall
                     return;
@@ -583,22 +1175,23 @@ ISR(USB_COM_vect)
                 desc_length = pgm_read_byte(list);
                 break;
             }
+            // at most 255 bytes, in 32-byte packets
             len = (wLength < 256) ? wLength : 255;
             if (len > desc_length) len = desc_length;
             do {
                 // wait for host ready for IN packet
                 do {
                     i = UEINTX;
-                } while (!(i & ((1<<TXINI)|(1<<RXOUTI))));
+                } while (!(i & ((1<<TXINI)|(1<<RXOUTI)))); // wcet: 1
                 if (i & (1<<RXOUTI)) return;    // abort
                 // send IN packet
                 n = len < ENDPOINT0_SIZE ? len : ENDPOINT0_SIZE;
-                for (i = n; i; i--) {
+                for (i = n; i; i--) { // wcet: 32
                     UEDATX = pgm_read_byte(desc_addr++);
                 }
                 len -= n;
                 usb_send_in();
-            } while (len || n == ENDPOINT0_SIZE);
+            } while (len || n == ENDPOINT0_SIZE); // wcet: 9
             return;
         }
         if (bRequest == SET_ADDRESS) {
@@ -611,7 +1204,7 @@ ISR(USB_COM_vect)
             usb_configuration = wValue;
             usb_send_in();
             cfg = endpoint_config_table;
-            for (i=1; i<5; i++) {
+            for (i=1; i<5; i++) { // wcet: 4
                 UENUM = i;
                 en = pgm_read_byte(cfg++);
                 UECONX = en;
@@ -622,6 +1215,13 @@ ISR(USB_COM_vect)
             }
             UERST = 0x1E;
             UERST = 0;
+            if (usb_configuration) {
+                // Anything pressed or released while we weren't
+                // configured (eg. after a bus reset) never made it to
+                // the host, so the first reports after configuration
+                // carry the current state of every key.
+                send_current_reports();
+            }
             return;
         }
         if (bRequest == GET_CONFIGURATION && bmRequestType == 0x80) {
@@ -664,6 +1264,7 @@ ISR(USB_COM_vect)
             }
         }
 #endif
+#ifdef USB_KEYBOARD_INTERFACE
         if (wIndex == KEYBOARD_INTERFACE) {
             if (bmRequestType == 0xA1) {
                 if (bRequest == HID_GET_REPORT) {
@@ -706,6 +1307,7 @@ ISR(USB_COM_vect)
                 }
             }
         }
+#endif
         if (wIndex == MEDIA_INTERFACE) {
             if (bmRequestType == 0xA1) {
                 if (bRequest == HID_GET_REPORT) {
@@ -748,6 +1350,75 @@ ISR(USB_COM_vect)
                 }
             }
         }
+#ifdef USB_VENDOR_INTERFACE
+        if (wIndex == VENDOR_INTERFACE) {
+            if (bmRequestType == 0xA1) {
+                if (bRequest == HID_GET_REPORT && wValue == 0x0305) {
+                    usb_send_feature(5, (const uint8_t *)&tuning, sizeof(Tuning), sizeof(Tuning), wLength);
+                    return;
+                }
+            }
+            if (bmRequestType == 0x21) {
+                if (bRequest == HID_SET_REPORT && wValue == 0x0305) {
+                    // the new tuning, after the report ID.  The main
+                    // loop checks and applies it before the next tick.
+                    usb_wait_receive_out();
+                    if (UEDATX == 5 && !tuning_request_pending) {
+                        for (i = 0; i < sizeof(Tuning); i++) { // wcet: 19
+                            ((volatile uint8_t *)&tuning_requested)[i] = UEDATX;
+                        }
+                        tuning_request_pending = 1;
+                    }
+                    usb_ack_out();
+                    usb_send_in();
+                    return;
+                }
+            }
+#ifdef COLLECT_STATS
+            if (bmRequestType == 0xA1) {
+                if (bRequest == HID_GET_REPORT && wValue == 0x0302) {
+                    // feature report 2
+                    usb_send_feature(2, (const uint8_t *)&stats, sizeof(stats), VENDOR_SIZE-1, wLength);
+                    return;
+                }
+            }
+#endif
+#ifdef USB_ABSOLUTE_VOLUME
+            if (bmRequestType == 0xA1) {
+                if (bRequest == HID_GET_REPORT && wValue == 0x0304) {
+                    usb_send_feature(4, (const uint8_t *)volume_report, 3, 3, wLength);
+                    return;
+                }
+            }
+            if (bmRequestType == 0x21) {
+                if (bRequest == HID_SET_REPORT && wValue == 0x0304) {
+                    // the host's volume, after the report ID
+                    usb_wait_receive_out();
+                    if (UEDATX == 4) {
+                        volume_report[0] = UEDATX;
+                        volume_report[1] = UEDATX;
+                        volume_report[2] = UEDATX;
+                        if (volume_report[0] > volume_report[1]) {
+                            volume_report[0] = volume_report[1];
+                        }
+                        volume_changed = 0;
+                    }
+                    usb_ack_out();
+                    usb_send_in();
+                    return;
+                }
+            }
+#endif
+            if (bmRequestType == 0x21) {
+                if (bRequest == HID_SET_IDLE) {
+                    // events are only sent when there are some, so
+                    // the idle rate doesn't apply
+                    usb_send_in();
+                    return;
+                }
+            }
+        }
+#endif
     }
     UECONX = (1<<STALLRQ) | (1<<EPEN);      // stall
 }
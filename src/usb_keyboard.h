@@ -3,6 +3,17 @@
 
 #include <stdint.h>
 
+// Vendor-defined raw HID interface that streams batched, timestamped
+// input events to host applications (see usb_event_add).  Comment this
+// out to remove the interface and its endpoint.
+#define USB_VENDOR_INTERFACE
+
+// Absolute volume: the host companion writes the current volume into
+// feature report 4 on the vendor interface.  The dial then moves a
+// local copy of it and reports the new level (input report 4) instead
+// of sending volume up/down keys.  Needs USB_VENDOR_INTERFACE.
+//#define USB_ABSOLUTE_VOLUME
+
 void usb_init(void);			// initialize everything
 uint8_t usb_configured(void);		// is the USB port configured
 
@@ -10,12 +21,40 @@ int8_t usb_keyboard_press(uint8_t key, uint8_t modifier);
 int8_t usb_media_press(uint16_t key);
 int8_t usb_keyboard_send(void);
 int8_t usb_media_send(void);
+uint8_t usb_keyboard_queue_space(void);
+int8_t usb_recover_stall(void);
 
 extern volatile uint8_t keyboard_modifier_keys;
 extern volatile uint8_t keyboard_keys[6];
 extern volatile uint16_t media_keys[4];
 extern volatile uint8_t keyboard_leds;
 
+#ifdef USB_VENDOR_INTERFACE
+// Events are packed VENDOR_EVENTS_PER_REPORT at a time into 64-byte
+// input reports (report ID 1):
+//
+//   byte 0      report ID (1)
+//   byte 1      sequence number, incremented for every report
+//   byte 2      number of events in this report
+//   byte 3      events dropped since the last report (saturates at 255)
+//   byte 4...   events, VENDOR_EVENT_SIZE bytes each:
+//                 type, value, timestamp (LE16), USB frame number (LE16)
+//
+// The timestamp is whatever the caller passes in; the frame number is
+// read from UDFNUM when the event is added, so the host can line up
+// device time with its own.
+#define VENDOR_EVENT_SIZE		6
+#define VENDOR_EVENTS_PER_REPORT	10
+
+int8_t usb_event_add(uint8_t type, uint8_t value, uint16_t timestamp);
+#endif
+
+#ifdef USB_ABSOLUTE_VOLUME
+// Report 4, both input and feature, is three bytes: the volume level
+// (0 to max), max, and how much one dial step changes the level.
+int8_t usb_volume_adjust(int8_t steps);
+#endif
+
 // This file does not include the HID debug functions, so these empty
 // macros replace them with nothing, so users can compile code that
 // has calls to these functions.
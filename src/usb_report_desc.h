@@ -0,0 +1,76 @@
+#ifndef usb_report_desc_h__
+#define usb_report_desc_h__
+
+// HID report descriptors for the keyboard and media interfaces.
+// usb_keyboard.c serves these to the host, and the host tools in host/
+// include this file too (with PROGMEM defined as nothing) to create
+// virtual devices that describe exactly the same reports.  The keyboard
+// one is left out when the keymap has no keyboard interface.
+
+#include <stdint.h>
+
+#include "keymap_features.h"
+
+#ifdef USB_KEYBOARD_INTERFACE
+// Keyboard Protocol 1, HID 1.11 spec, Appendix B, page 59-60
+static uint8_t const PROGMEM keyboard_hid_report_desc[] = {
+    0x05, 0x01,          // Usage Page (Generic Desktop),
+    0x09, 0x06,          // Usage (Keyboard),
+    0xA1, 0x01,          // Collection (Application),
+        
+    0x75, 0x01,          //   Report Size (1),
+    0x95, 0x08,          //   Report Count (8),
+    0x05, 0x07,          //   Usage Page (Key Codes),
+    0x19, 0xE0,          //   Usage Minimum (224),
+    0x29, 0xE7,          //   Usage Maximum (231),
+    0x15, 0x00,          //   Logical Minimum (0),
+    0x25, 0x01,          //   Logical Maximum (1),
+    0x81, 0x02,          //   Input (Data, Variable, Absolute), ;Modifier byte
+        
+    0x95, 0x01,          //   Report Count (1),
+    0x75, 0x08,          //   Report Size (8),
+    0x81, 0x03,          //   Input (Constant),                 ;Reserved byte
+        
+    0x95, 0x05,          //   Report Count (5),
+    0x75, 0x01,          //   Report Size (1),
+    0x05, 0x08,          //   Usage Page (LEDs),
+    0x19, 0x01,          //   Usage Minimum (1),
+    0x29, 0x05,          //   Usage Maximum (5),
+    0x91, 0x02,          //   Output (Data, Variable, Absolute), ;LED report
+        
+    0x95, 0x01,          //   Report Count (1),
+    0x75, 0x03,          //   Report Size (3),
+    0x91, 0x03,          //   Output (Constant),                 ;LED report padding
+                
+    0x95, 0x06,          //   Report Count (6),
+    0x75, 0x08,          //   Report Size (8),
+    0x15, 0x00,          //   Logical Minimum (0),
+    0x25, 0x68,          //   Logical Maximum(104),
+    0x05, 0x07,          //   Usage Page (Key Codes),
+    0x19, 0x00,          //   Usage Minimum (0),
+    0x29, 0x68,          //   Usage Maximum (104),
+    0x81, 0x00,          //   Input (Data, Array),
+        
+    0xc0                 // End Collection
+};
+#endif
+
+// Media keys: Modified version of above
+static uint8_t const PROGMEM media_hid_report_desc[] = {
+    0x05, 0x0c,          // Usage Page (Generic Desktop),
+    0x09, 0x01,          // Usage (Keyboard),
+    0xA1, 0x01,          // Collection (Application),
+        
+    0x95, 0x04,          //   Report Count (4),
+    0x75, 0x10,          //   Report Size (16),
+    0x15, 0x00,          //   Logical Minimum (0),
+    0x26, 0x3c, 0x02,    //   Logical Maximum (0x23c),
+    0x05, 0x0c,          //   Usage Page (Multimedia/Consumer),
+    0x19, 0x00,          //   Usage Minimum (0),
+    0x2a, 0x3c, 0x02,    //   Usage Maximum (0x23c),
+    0x81, 0x00,          //   Input (Data, Array),
+        
+    0xc0                 // End Collection
+};
+
+#endif